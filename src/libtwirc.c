@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // pthread_setaffinity_np(), CPU_SET()
+#endif
 #define TCPSOCK_IMPLEMENTATION
 
 #include <stdio.h>      // NULL, fprintf(), perror()
@@ -6,14 +9,36 @@
 #include <unistd.h>     // close()
 #include <string.h>     // strlen(), strerror()
 #include <sys/epoll.h>  // epoll_create(), epoll_ctl(), epoll_wait()
+#include <sys/timerfd.h>// timerfd_create()
+#include <sys/eventfd.h>// eventfd()
 #include <time.h>       // time() (as seed for rand())
 #include <signal.h>     // sigset_t et al
+#include <limits.h>     // UCHAR_MAX
+#include <stddef.h>     // offsetof()
 #include "tcpsock.h"
 #include "libtwirc.h"
 #include "libtwirc_internal.h"
+#include "libtwirc_arena.c"
+#include "libtwirc_scan.c"
+#include "libtwirc_tags.c"
+#include "libtwirc_chans.c"
+#include "libtwirc_rate.c"
+#include "libtwirc_joins.c"
 #include "libtwirc_cmds.c"
 #include "libtwirc_util.c"
 #include "libtwirc_evts.c"
+#include "libtwirc_uring.c"
+#include "libtwirc_pool.c"
+#include "libtwirc_runtime.c"
+#include "libtwirc_pipeline.c"
+#include "libtwirc_extern.c"
+#include "libtwirc_dns.c"
+#include "libtwirc_race.c"
+#include "libtwirc_reconnect.c"
+#include "libtwirc_handover.c"
+#include "libtwirc_tls.c"
+#include "libtwirc_sockopts.c"
+#include "libtwirc_stats.c"
 
 /*
  * Sets the state's error flag to TWIRC_ERR_OUT_OF_MEMORY and returns -1.
@@ -94,250 +119,72 @@ libtwirc_free_login(twirc_state_t *s)
 	s->login.id   = NULL;
 }
 
-/*
- * Copies a portion of src to dest. The copied part will start from the offset
- * given in off and end at the next null terminator encountered, but at most 
- * slen bytes. It is essential for slen to be correctly provided, as this 
- * function is supposed to handle src strings that were network-transmitted and
- * might not be null-terminated. The copied string will be null terminated, even
- * if no null terminator was read from src. If dlen is not sufficient to store 
- * the copied string plus the null terminator, or if the given offset points to 
- * the end or beyond src, -1 is returned. Returns the number of bytes copied + 1, 
- * so this value can be used as an offset for successive calls of this function, 
- * or slen if all chunks have been read. 
- */
-static size_t
-libtwirc_next_chunk(char *dest, size_t dlen, const char *src, size_t slen, size_t off)
-{
-	/*
-	 | recv() 1    | recv() 2       |
-	 |-------------|----------------|
-	 | SOMETHING\r | \n\0ELSE\r\n\0 |
-	
-	 chunk 1 -> SOMETHING\0
-	 chunk 2 -> \0
-	 chunk 3 -> ELSE\0
-	
-	 | recv(1)     | recv() 2      |
-	 |-------------|---------------|
-	 | SOMETHING\r | \nSTUFF\r\n\0 |
-	
-	 chunk 1 -> SOMETHING\0
-	 chunk 2 -> \nSTUFF\0
-	*/
-	
-	// Determine the maximum number of bytes we'll have to read
-	size_t chunk_len = slen - off;
-	
-	// Invalid offset (or maybe we're just done reading src)
-	if (chunk_len <= 0)
-	{
-		return -1;
-	}
-	
-	// Figure out the maximum size we can read
-	size_t max_len = dlen < chunk_len ? dlen : chunk_len;
-	
-	// Copy everything from offset to (and including) the next null terminator
-	// but at most max_len bytes (important if there is no null terminator)
-	strncpy(dest, src + off, max_len); 
-	
-	// Check how much we've actually written to the dest buffer
-	size_t cpy_len = strnlen(dest, max_len);
-	
-	// Check if we've entirely filled the buffer (no space for \0)
-	if (cpy_len == dlen)
-	{
-		dest[0] = '\0';
-		return -1;
-	}
-	
-	// Make sure there is a null terminator at the end, even if
-	// there was no null terminator in the copied string
-	dest[cpy_len] = '\0';
-	
-	// Calculate the offset to the next chunk (+1 to skip null terminator)
-	size_t new_off = off + cpy_len + 1;
-	
-	// Return slen if we've read all data, otherwise the offset to the next chunk
-	return new_off >= slen ? slen : new_off;
-}
-	
-/*
- * Finds the first occurrence of the sep string in src, then copies everything 
- * that is found before the separator into dest. The extracted part and the 
- * separator will be removed from src. Note that this function will by design
- * not extract the last token, unless it also ends in the given separator.
- * This is so because it was designed to extract complete IRC messages from a 
- * string containing multiple of those, where the last one might be incomplete.
- * Only extracting tokens that _end_ in the separator guarantees that we will
- * only extract complete IRC messages and leave incomplete ones in src.
- *
- * Returns the size of the copied string, or 0 if the separator could not be 
- * found in the src string.
- */
-static size_t
-libtwirc_shift_token(char *dest, char *src, const char *sep)
-{
-	// Find the first occurence of the separator
-	char *sep_pos = strstr(src, sep);
-	if (sep_pos == NULL)
-	{
-		return 0;
-	}
-
-	// Figure out the length of the token etc
-	size_t sep_len = strlen(sep);
-	size_t new_len = strlen(sep_pos) - sep_len;
-	size_t tok_len = sep_pos - src;
-	
-	// Copy the token to the dest buffer
-	strncpy(dest, src, tok_len);
-	dest[tok_len] = '\0';
-
-	// Remove the token from src
-	memmove(src, sep_pos + sep_len, new_len); 
-
-	// Make sure src is null terminated again
-	src[new_len] = '\0';
-
-	return tok_len;
-}
-
 /*
  * Takes an escaped string (as described in the IRCv3 spec, section tags)
- * and returns a pointer to a malloc'd string that holds the unescaped string.
- * Remember that the returned pointer has to be free'd by the caller!
- * TODO: THIS CAN SEGFAULT! FIX IT!
- * TODO: ^- regarding above comment, I think we fixed the segfault and simply
- *          forgot to remove the comment... but not sure, so please re-check.
+ * and unescapes it in place. As the unescaped string can never be longer
+ * than the escaped one, this is always possible without additional memory.
+ * Returns a pointer to str, for convenience.
  */
 static char*
-libtwirc_unescape(const char *str)
+libtwirc_unescape(char *str)
 {
-	size_t str_len = strlen(str);
-	char *unescaped = malloc((str_len + 1) * sizeof(char));
-	if (unescaped == NULL) { return NULL; }
+	// Fast path: nothing to unescape if there isn't a single backslash
+	char *u = strchr(str, '\\');
+	if (u == NULL)
+	{
+		return str;
+	}
 
-	int u = 0;
-	for (int i = 0; i < (int) str_len; ++i)
+	for (char *c = u; *c != '\0'; ++c)
 	{
-		if (str[i] == '\\')  
+		if (c[0] == '\\')
 		{
-			if (str[i+1] == ':') // "\:" -> ";"
+			if (c[1] == ':') // "\:" -> ";"
 			{
-				unescaped[u++] = ';';
-				++i;
+				*u++ = ';';
+				++c;
 				continue;
 			}
-			if (str[i+1] == 's') // "\s" -> " ";
+			if (c[1] == 's') // "\s" -> " ";
 			{
-				unescaped[u++] = ' ';
-				++i;
+				*u++ = ' ';
+				++c;
 				continue;
 			}
-			if (str[i+1] == '\\') // "\\" -> "\";
+			if (c[1] == '\\') // "\\" -> "\";
 			{
-				unescaped[u++] = '\\';
-				++i;
+				*u++ = '\\';
+				++c;
 				continue;
 			}
-			if (str[i+1] == 'r') // "\r" -> '\r' (CR)
+			if (c[1] == 'r') // "\r" -> '\r' (CR)
 			{
-				unescaped[u++] = '\r';
-				++i;
+				*u++ = '\r';
+				++c;
 				continue;
 			}
-			if (str[i+1] == 'n') // "\n" -> '\n' (LF)
+			if (c[1] == 'n') // "\n" -> '\n' (LF)
 			{
-				unescaped[u++] = '\n';
-				++i;
+				*u++ = '\n';
+				++c;
 				continue;
 			}
 		}
-		unescaped[u++] = str[i];
+		*u++ = *c;
 	}
-	unescaped[u] = '\0';
-	return unescaped;
-}
-
-/*
- * Dynamically allocates a twirc_tag_t from the given key and value strings.
- * Returns NULL if memory allocation failed or the given key was NULL or an
- * empty string, otherwise a pointer to the created tag. If the given value 
- * was NULL, it will be set to an empty string. Both key and value are also 
- * dynamically allocated and need to be free'd by the caller at some point.
- */
-static twirc_tag_t*
-libtwirc_create_tag(const char *key, const char *val)
-{
-	// Key can't be NULL or empty
-	if (key == NULL || strlen(key) == 0)
-	{
-		return NULL;
-	}
-	
-	// Allocate memory
-	twirc_tag_t *tag = malloc(sizeof(twirc_tag_t));
-
-	// Check if allocation worked
-	if (tag == NULL) {
-		return NULL;
-	}
-
-	// Set key and value; if value was NULL, set it to empty string
-	tag->key   = strdup(key);
-	tag->value = val == NULL ? strdup("") : libtwirc_unescape(val);
-
-	return tag;
-}
-
-static void
-libtwirc_free_tag(twirc_tag_t *tag)
-{
-	free(tag->key);
-	free(tag->value);
-}
-
-static void
-libtwirc_free_tags(twirc_tag_t **tags)
-{
-	if (tags == NULL)
-	{
-		return;
-	}
-	for (int i = 0; tags[i] != NULL; ++i)
-	{
-		libtwirc_free_tag(tags[i]);
-		free(tags[i]);
-		tags[i] = NULL;
-	}
-}
-
-static void
-libtwirc_free_params(char **params)
-{
-	if (params == NULL)
-	{
-		return;
-	}
-	for (int i = 0; params[i] != NULL; ++i)
-	{
-		free(params[i]);
-		params[i] = NULL;
-	}
-	//free(params);
+	*u = '\0';
+	return str;
 }
 
 /*
  * Extracts the nickname from an IRC message's prefix, if any. Done this way:
  * Searches prefix for an exclamation mark ('!'). If there is one, everything 
- * before it will be returned as a pointer to an allocated string (malloc), so
- * the caller has to free() it at some point. If there is no exclamation mark 
- * in prefix or prefix is NULL or we're out of memory, NULL will be returned.
+ * before it will be copied to the arena and returned. If there is no 
+ * exclamation mark in prefix, prefix is NULL or we're out of memory, NULL 
+ * will be returned.
  */
 static char*
-libtwirc_parse_nick(const char *prefix)
+libtwirc_parse_nick(struct libtwirc_arena *a, const char *prefix)
 {
 	// Nothing to do if nothing has been handed in
 	if (prefix == NULL)
@@ -346,117 +193,173 @@ libtwirc_parse_nick(const char *prefix)
 	}
 	
 	// Search for an exclamation mark in prefix
-	char *sep = strstr(prefix, "!");
+	char *sep = strchr(prefix, '!');
 	if (sep == NULL)
 	{
 		return NULL;
 	}
 	
-	// Return the nick as malloc'd string
-	size_t len = sep - prefix;
-	return strndup(prefix, len);
+	// The prefix needs to stay intact, so we copy the nick
+	return libtwirc_arena_strndup(a, prefix, sep - prefix);
 }
 
 /*
- * Extracts tags from the beginning of an IRC message, if any, and returns them
- * as a pointer to a dynamically allocated array of twirc_tag structs, where 
- * each struct contains two members, key and value, representing the key and 
- * value of a tag, respectively. The value member of a tag can be empty string 
- * for key-only tags. The last element of the array will be a NULL pointer, so 
- * you can loop over all tags until you hit NULL. The number of extracted tags
- * is returned in len. If no tags have been found at the beginning of msg, tags
- * will be NULL, len will be 0 and this function will return a pointer to msg.
- * Otherwise, a pointer to the part of msg after the tags will be returned. 
- *
- * https://ircv3.net/specs/core/message-tags-3.2.html
+ * Checks if msg starts with tags and, if so, null terminates the tags string 
+ * in place and returns a pointer to it (after the '@') in block; otherwise,
+ * block will be NULL. The message ends at end, which has to point to its null
+ * terminator. Returns a pointer to the part of msg after the tags, if any.
+ * Splitting the tags is left to libtwirc_split_tags(), so this can be done 
+ * only when the tags are actually needed.
  */
-static const char*
-libtwirc_parse_tags(const char *msg, twirc_tag_t ***tags, size_t *len)
+static char*
+libtwirc_parse_tags(char *msg, char *end, char **block)
 {
 	// If msg doesn't start with "@", then there are no tags
 	if (msg[0] != '@')
 	{
-		*len = 0;
-		*tags = NULL;
+		*block = NULL;
 		return msg;
 	}
 
-	// Find the next space (the end of the tags string within msg)
-	char *next = strstr(msg, " ");
-	
-	// Duplicate the string from after the '@' until the next space
-	char *tag_str = strndup(msg + 1, next - (msg + 1));
+	// Find the next space (the end of the tags string within msg) and
+	// terminate the tags string there; no space means there is no more
+	char *tags_end = libtwirc_scan1(msg, end, ' ');
+	char *next = tags_end == end ? end : tags_end + 1;
+	*tags_end = '\0';
 
-	// Set the initial number of tags we want to allocate memory for
-	size_t num_tags = TWIRC_NUM_TAGS;
-	
-	// Allocate memory in the provided pointer to ptr-to-array-of-structs
-	*tags = malloc(num_tags * sizeof(twirc_tag_t*));
+	*block = msg + 1;
+	return next;
+}
 
-	char *tag = NULL;
-	int i;
-	for (i = 0; (tag = strtok(i == 0 ? tag_str : NULL, ";")) != NULL; ++i)
+/*
+ * Splits the tags string of evt (its tag_block member) into the tags array, 
+ * an array of pointers to twirc_tag structs, where each struct contains two 
+ * members, key and value, representing the key and value of a tag, 
+ * respectively. The value member of a tag can be empty string for key-only
+ * tags. The last element of the array will be a NULL pointer, so you can 
+ * loop over all tags until you hit NULL. The number of extracted tags is 
+ * stored in num_tags. Splitting is done in place: the delimiters are replaced
+ * with null terminators and key and value of each tag will point into the 
+ * tags string. The arrays are allocated from the arena. For every well-known
+ * tag, its position in the tags array (plus one) will be stored in the 
+ * tag_index member of evt. If lazy is set, escaped values will be left as 
+ * they are, but marked in the tag_escaped member of evt, so that they can be
+ * unescaped if and when they are requested; the tags array is then only kept
+ * in the tag_list member, as handing it out is up to twirc_get_tags(), which
+ * unescapes all of them first. Returns 0 on success (or if there
+ * were no tags to begin with) and -1 if we ran out of memory.
+ *
+ * https://ircv3.net/specs/core/message-tags-3.2.html
+ */
+static int
+libtwirc_split_tags(struct libtwirc_arena *a, twirc_event_t *evt, int lazy)
+{
+	char *block = evt->tag_block;
+	if (block == NULL)
 	{
-		// Make sure we have enough space; last element has to be NULL
-		if (i >= num_tags - 1)
-		{
-			size_t add = (size_t) (num_tags / 2);
-			num_tags += add;
-			*tags = realloc(*tags, num_tags * sizeof(twirc_tag_t*));
-		}
+		return 0;
+	}
+	char *end = block + strlen(block);
 
-		char *eq = strstr(tag, "=");
+	// Count the separators so we know how many tags there are at most
+	size_t num_tags = libtwirc_count(block, end, ';') + 1;
 
-		// It's a key-only tag, like "foo" (never seen that on Twitch)
-		// Hence, we didn't find a '=' at all 
-		if (eq == NULL)
+	// Allocate the tags and the pointers to them (plus one for NULL)
+	twirc_tag_t *list = libtwirc_arena_alloc(a, num_tags * sizeof(twirc_tag_t));
+	twirc_tag_t **ptrs = libtwirc_arena_alloc(a, (num_tags + 1) * sizeof(twirc_tag_t*));
+	unsigned char *esc = lazy ? libtwirc_arena_alloc(a, num_tags) : NULL;
+	if (list == NULL || ptrs == NULL || (lazy && esc == NULL))
+	{
+		return -1;
+	}
+
+	size_t i = 0;
+	char *tag = block;
+	while (tag < end)
+	{
+		// Find the end of the key: it is either followed by a '=' and
+		// the value ("foo=bar", "foo=") or it is a key-only tag ("foo")
+		char *sep = libtwirc_scan2(tag, end, '=', ';');
+		char *val = NULL;
+		size_t key_len = sep - tag;
+		int escaped = 0;
+
+		if (*sep == '=')
 		{
-			// TODO we should check for libtwirc_create_tag()
-			// 	returning NULL and act accordingly
-			(*tags)[i] = libtwirc_create_tag(tag, NULL);
+			// Find the end of the value, noting if it has escapes
+			*sep = '\0';
+			val = sep + 1;
+			sep = libtwirc_scan2(val, end, ';', '\\');
+			if (*sep == '\\')
+			{
+				escaped = 1;
+				sep = libtwirc_scan1(sep, end, ';');
+			}
 		}
-		// It's either a key-only tag with a trailing '=' ("foo=")
-		// or a tag with key-value pair, like "foo=bar"
-		else
+		*sep = '\0';
+
+		// Ignore empty tags (something like "a=b;;c=d")
+		if (tag[0] != '\0')
 		{
-			// Turn the '=' into '\0' to separate key and value
-			eq[0] = '\0'; // Turn the '=' into '\0'
-			
-			// TODO we should check for libtwirc_create_tag()
-			// 	returning NULL and act accordingly
-			(*tags)[i] = libtwirc_create_tag(tag, eq+1);
-		}
+			list[i].key   = tag;
+			list[i].value = val == NULL ? "" : 
+				(escaped && !lazy ? libtwirc_unescape(val) : val);
+			ptrs[i] = &list[i];
 
-		//fprintf(stderr, ">>> TAG %d: %s = %s\n", i, (*tags)[i]->key, (*tags)[i]->value);
-	}
+			if (lazy)
+			{
+				esc[i] = escaped;
+			}
 
-	// Set the number of tags found
-	*len = i;
+			// Remember where to find it if it's a well-known tag; if 
+			// a key appears twice, the first one wins, as it would in
+			// twirc_get_tag(), and we can only index so many tags
+			int id = libtwirc_tag_id(tag, key_len);
+			if (id != -1 && evt->tag_index[id] == 0 && i < UCHAR_MAX)
+			{
+				evt->tag_index[id] = i + 1;
+			}
 
-	free(tag_str);
-	
-	// Trim this down to the exact right size
-	if (i < num_tags - 1)
-	{
-		*tags = realloc(*tags, (i + 1) * sizeof(twirc_tag_t*));
+			//fprintf(stderr, ">>> TAG %zu: %s = %s\n", i, list[i].key, list[i].value);
+			++i;
+		}
+
+		tag = sep + 1;
 	}
 
 	// Make sure the last element is a NULL ptr
-	(*tags)[i] = NULL;
+	ptrs[i] = NULL;
 
-	// Return a pointer to the remaining part of msg
-	return next + 1;
+	evt->tags = lazy ? NULL : ptrs;
+	evt->tag_list = ptrs;
+	evt->num_tags = i;
+	evt->tag_escaped = esc;
+	evt->tag_block = NULL;
+	return 0;
+}
+
+/*
+ * Unescapes the value of the tag at position idx within the tags of evt, if
+ * it has been left escaped by lazy tag splitting (see libtwirc_split_tags).
+ */
+static void
+libtwirc_unescape_tag(twirc_event_t *evt, size_t idx)
+{
+	if (evt->tag_escaped && evt->tag_escaped[idx])
+	{
+		libtwirc_unescape(evt->tag_list[idx]->value);
+		evt->tag_escaped[idx] = 0;
+	}
 }
 
 /*
  * Extracts the prefix from the beginning of msg, if there is one. The prefix 
- * will be returned as a pointer to a dynamically allocated string in prefix.
- * The caller needs to make sure to free the memory at some point. If no prefix
- * was found at the beginning of msg, prefix will be NULL. Returns a pointer to
+ * will be null terminated in place and returned in prefix. If no prefix was 
+ * found at the beginning of msg, prefix will be NULL. Returns a pointer to 
  * the next part of the message, after the prefix.
  */
-static const char*
-libtwirc_parse_prefix(const char *msg, char **prefix)
+static char*
+libtwirc_parse_prefix(char *msg, char *end, char **prefix)
 {
 	if (msg[0] != ':')
 	{
@@ -464,127 +367,197 @@ libtwirc_parse_prefix(const char *msg, char **prefix)
 		return msg;
 	}
 	
-	// Find the next space (the end of the prefix string within msg)
-	char *next = strstr(msg, " ");
+	// The prefix starts after the ':'
+	*prefix = msg + 1;
 
-	// Duplicate the string from after the ':' until the next space
-	*prefix = strndup(msg + 1, next - (msg + 1));
+	// Find the next space (the end of the prefix string within msg)
+	char *next = libtwirc_scan1(msg, end, ' ');
+	if (next == end)
+	{
+		return end;
+	}
 
-	// Return a pointer to the remaining part of msg
+	// Terminate the prefix and return a pointer to the remaining part
+	*next = '\0';
 	return next + 1;
 }
 
-static const char*
-libtwirc_parse_command(const char *msg, char **cmd)
+/*
+ * Returns the TWIRC_CMD_* constant for the command cmd, which has a length
+ * of len, or TWIRC_CMD_OTHER if it isn't a command we know of. Switching on 
+ * the length and the first character leaves at most one or two candidates, 
+ * so only very few bytes actually need to be compared.
+ */
+static int
+libtwirc_command_id(const char *cmd, size_t len)
 {
-	// Find the next space (the end of the cmd string withing msg)
-	char *next = strstr(msg, " ");
+	switch (len)
+	{
+		case 3:
+			switch (cmd[0])
+			{
+				case '0': if (memcmp(cmd, "001", 3) == 0) { return TWIRC_CMD_WELCOME; } break;
+				case '3': if (memcmp(cmd, "353", 3) == 0) { return TWIRC_CMD_NAMREPLY; }
+				          if (memcmp(cmd, "366", 3) == 0) { return TWIRC_CMD_ENDOFNAMES; } break;
+				case '4': if (memcmp(cmd, "421", 3) == 0) { return TWIRC_CMD_UNKNOWNCMD; } break;
+				case 'C': if (memcmp(cmd, "CAP", 3) == 0) { return TWIRC_CMD_CAP; } break;
+			}
+			break;
+		case 4:
+			switch (cmd[0])
+			{
+				case 'J': if (memcmp(cmd, "JOIN", 4) == 0) { return TWIRC_CMD_JOIN; } break;
+				case 'M': if (memcmp(cmd, "MODE", 4) == 0) { return TWIRC_CMD_MODE; } break;
+				case 'P': if (memcmp(cmd, "PING", 4) == 0) { return TWIRC_CMD_PING; }
+				          if (memcmp(cmd, "PONG", 4) == 0) { return TWIRC_CMD_PONG; }
+				          if (memcmp(cmd, "PART", 4) == 0) { return TWIRC_CMD_PART; } break;
+			}
+			break;
+		case 6:
+			if (memcmp(cmd, "NOTICE", 6) == 0) { return TWIRC_CMD_NOTICE; }
+			break;
+		case 7:
+			switch (cmd[0])
+			{
+				case 'P': if (memcmp(cmd, "PRIVMSG", 7) == 0) { return TWIRC_CMD_PRIVMSG; } break;
+				case 'W': if (memcmp(cmd, "WHISPER", 7) == 0) { return TWIRC_CMD_WHISPER; } break;
+			}
+			break;
+		case 8:
+			if (memcmp(cmd, "CLEARMSG", 8) == 0) { return TWIRC_CMD_CLEARMSG; }
+			break;
+		case 9:
+			switch (cmd[0])
+			{
+				case 'C': if (memcmp(cmd, "CLEARCHAT", 9) == 0) { return TWIRC_CMD_CLEARCHAT; } break;
+				case 'R': if (memcmp(cmd, "ROOMSTATE", 9) == 0) { return TWIRC_CMD_ROOMSTATE; }
+				          if (memcmp(cmd, "RECONNECT", 9) == 0) { return TWIRC_CMD_RECONNECT; } break;
+				case 'U': if (memcmp(cmd, "USERSTATE", 9) == 0) { return TWIRC_CMD_USERSTATE; } break;
+			}
+			break;
+		case 10:
+			switch (cmd[0])
+			{
+				case 'H': if (memcmp(cmd, "HOSTTARGET", 10) == 0) { return TWIRC_CMD_HOSTTARGET; } break;
+				case 'U': if (memcmp(cmd, "USERNOTICE", 10) == 0) { return TWIRC_CMD_USERNOTICE; } break;
+			}
+			break;
+		case 15:
+			if (memcmp(cmd, "GLOBALUSERSTATE", 15) == 0) { return TWIRC_CMD_GLOBALUSERSTATE; }
+			break;
+	}
+	return TWIRC_CMD_OTHER;
+}
 
-	// Duplicate the string from start to next space or end of msg
-	*cmd = strndup(msg, next == NULL ? strlen(msg) : next - msg);
-	
-	// Return NULL if cmd was the last bit of msg, or a pointer to
-	// the remaining part (the parameters)
-	return next == NULL ? NULL : next + 1;
+/*
+ * Extracts the command from msg, which will be null terminated in place and
+ * returned in cmd. The command will also be classified, its TWIRC_CMD_* ID
+ * will be returned in id. Returns NULL if cmd was the last bit of msg, or a
+ * pointer to the remaining part (the parameters).
+ */
+static char*
+libtwirc_parse_command(char *msg, char *end, char **cmd, int *id)
+{
+	*cmd = msg;
+
+	// Find the next space (the end of the cmd string within msg)
+	char *next = libtwirc_scan1(msg, end, ' ');
+	*id = libtwirc_command_id(msg, next - msg);
+	if (next == end)
+	{
+		return NULL;
+	}
+
+	*next = '\0';
+	return next + 1;
 }
 
-static const char*
-libtwirc_parse_params(const char *msg, char ***params, size_t *len, int *t_idx)
+/*
+ * Splits msg into its parameters, in place. The parameters are returned in 
+ * params, an array of pointers into msg that is allocated from the arena and
+ * that will be NULL terminated. The number of parameters is returned in len,
+ * the index of the trailing parameter in t_idx (-1 if there is none). If msg 
+ * is NULL or empty, params will be NULL. Returns 0 on success, -1 if out of 
+ * memory.
+ */
+static int
+libtwirc_parse_params(struct libtwirc_arena *a, char *msg, char *end, char ***params, size_t *len, int *t_idx)
 {
+	*t_idx = -1;
+	*len = 0;
+	*params = NULL;
+
 	if (msg == NULL)
 	{
-		*t_idx = -1;
-		*len = 0;
-		*params = NULL;
-		return NULL;
+		return 0;
 	}
 
-	// Initialize params to hold TWIRC_NUM_PARAMS pointers to char
-	size_t num_params = TWIRC_NUM_PARAMS;
-	*params = malloc(num_params * sizeof(char*));
+	// Skip leading spaces, if any
+	while (*msg == ' ') { ++msg; }
 
-	// Copy everything that's left in msg (params are always last)
-	char *p_str = strdup(msg);
+	if (msg == end)
+	{
+		return 0;
+	}
+
+	// Count the spaces so we know how many params there are at most
+	size_t num_params = libtwirc_count(msg, end, ' ') + 1;
+
+	// Allocate the pointers to the params (plus one for NULL)
+	char **list = libtwirc_arena_alloc(a, (num_params + 1) * sizeof(char*));
+	if (list == NULL)
+	{
+		return -1;
+	}
 
-	size_t p_len = strlen(p_str);
 	size_t num_tokens = 0;
-	int trailing = 0;
-	int from = 0;
+	char *p = msg;
 
-	for (int i = 0; i < p_len; ++i)
+	while (p < end)
 	{
-		// Make sure we have enough space; last element has to be NULL
-		if (num_tokens >= num_params - 1)
+		// Prefix of trailing token, it extends to the end of msg
+		if (*p == ':')
 		{
-			size_t add = num_params;
-			num_params += add;
-			*params = realloc(*params, num_params * sizeof(char*));
+			*t_idx = num_tokens;
+			list[num_tokens++] = p + 1;
+			break;
 		}
 
-		// Prefix of trailing token (ignore if part of trailing token)
-		if (p_str[i] == ':' && !trailing)
-		{
-			// Remember that we're in the trailing token
-			trailing = 1;
-			// Set the start position marker to the next char
-			from = i+1;
-			continue;
-		}
+		list[num_tokens++] = p;
 
-		// Token separator (ignore if trailing token)
-		if (p_str[i] == ' ' && !trailing)
+		// Find the token separator and terminate the token there
+		char *sp = libtwirc_scan1(p, end, ' ');
+		if (sp == end)
 		{
-			// Copy everything from the beginning to here
-			(*params)[num_tokens++] = strndup(p_str + from, i - from);
-			//fprintf(stderr, "- %s\n", (*params)[num_tokens-1]);
-			// Set the start position marker to the next char
-			from = i+1;
-			continue;
+			break;
 		}
+		*sp = '\0';
 
-		// We're at the last character (null terminator, hopefully)
-		if (i == p_len - 1)
-		{
-			// Copy everything from the beginning to here + 1
-			(*params)[num_tokens++] = strndup(p_str + from, (i + 1) - from);
-			//fprintf(stderr, "- %s\n", (*params)[num_tokens-1]);
-		}
+		// Skip to the next token (ignoring repeated spaces)
+		for (p = sp + 1; *p == ' '; ++p);
 	}
 
-	// Set index of the trailing parameter, if any, otherwise -1
-	*t_idx = trailing ? num_tokens - 1 : -1;
-	// Set number of tokens (parameters) found and copied
-	*len = num_tokens;
-	
-	free(p_str);
-
-	// Trim this down to the exact amount of memory we need
-	if (num_tokens < num_params - 1)
-	{
-		*params = realloc(*params, (num_tokens + 1) * sizeof(char*));
-	}
-	
 	// Make sure the last element is a NULL ptr
-	(*params)[num_tokens] = NULL;
+	list[num_tokens] = NULL;
 
-	// We've reached the end of msg, so we'll return NULL
-	return NULL;
+	*params = list;
+	*len = num_tokens;
+	return 0;
 }
 
 /*
  * Checks if the event is a CTCP event. If so, strips the CTCP markers (0x01)
  * as well as the CTCP command from the trailing parameter and fills the ctcp
- * member of evt with the CTCP command instead. If it isn't a CTCP command, 
- * this function does nothing.
- * Returns 0 on success, -1 if an error occured (not enough memory).
+ * member of evt with the CTCP command instead. This is done in place. If it 
+ * isn't a CTCP command, this function does nothing.
  */
-static int
+static void
 libtwirc_parse_ctcp(twirc_event_t *evt)
 {
-	// Can't be CTCP if we don't even have enough parameters
-	if (evt->num_params <= evt->trailing)
+	// Can't be CTCP if we don't even have a trailing parameter
+	if (evt->trailing < 0 || evt->num_params <= (size_t) evt->trailing)
 	{
-		return 0;
+		return;
 	}
 	
 	// For convenience, get a ptr to the trailing parameter
@@ -593,173 +566,221 @@ libtwirc_parse_ctcp(twirc_event_t *evt)
 	// First char not 0x01? Not CTCP!
 	if (trailing[0] != 0x01)
 	{
-		return 0;
+		return;
 	}
 	
 	// Last char not 0x01? Not CTCP!
-	int last = strlen(trailing) - 1;
-	if (trailing[last] != 0x01)
+	size_t last = strlen(trailing) - 1;
+	if (last == 0 || trailing[last] != 0x01)
 	{
-		return 0;
+		return;
 	}
 
-	// Find the first space within the trailing parameter
-	char *space = strstr(trailing, " ");
-	if (space == NULL) { return -1; }
+	// Strip the trailing 0x01 marker
+	trailing[last] = '\0';
 
-	// Copy the CTCP command
-	evt->ctcp = strndup(trailing + 1, space - (trailing + 1));
-	if (evt->ctcp == NULL) { return -1; }
-	
-	// Strip 0x01
-	char *message = strndup(space + 1, (trailing + last) - (space + 1));
-	if (message == NULL) { return -1; }
+	// The CTCP command starts after the first 0x01 marker
+	evt->ctcp = trailing + 1;
 
-	// Free the old trailing parameter, swap in the stripped one
-	free(evt->params[evt->trailing]);
-	evt->params[evt->trailing] = message;
+	// Find the first space within the trailing parameter; if there is
+	// none, it is a CTCP command without message (like "VERSION")
+	char *space = strchr(trailing, ' ');
+	if (space == NULL)
+	{
+		evt->params[evt->trailing] = trailing + last;
+		return;
+	}
 
-	return 0;
+	// Terminate the CTCP command, the message follows after it
+	*space = '\0';
+	evt->params[evt->trailing] = space + 1;
 }
 
-static void
-libtwirc_dispatch_out(twirc_state_t *s, twirc_event_t *evt)
+// Maps each TWIRC_CMD_* to its internal event handler and the offset of its
+// callback within twirc_callbacks_t; this is what libtwirc_dispatch_evt() uses
+static const struct libtwirc_dispatch libtwirc_dispatch_table[TWIRC_CMD_COUNT] =
 {
-	libtwirc_on_outbound(s, evt);
-	s->cbs.outbound(s, evt);
-}
+	[TWIRC_CMD_OTHER]           = { libtwirc_on_other,           offsetof(twirc_callbacks_t, other) },
+	[TWIRC_CMD_PRIVMSG]         = { libtwirc_on_privmsg,         offsetof(twirc_callbacks_t, privmsg) },
+	[TWIRC_CMD_JOIN]            = { libtwirc_on_join,            offsetof(twirc_callbacks_t, join) },
+	[TWIRC_CMD_PART]            = { libtwirc_on_part,            offsetof(twirc_callbacks_t, part) },
+	[TWIRC_CMD_CLEARCHAT]       = { libtwirc_on_clearchat,       offsetof(twirc_callbacks_t, clearchat) },
+	[TWIRC_CMD_CLEARMSG]        = { libtwirc_on_clearmsg,        offsetof(twirc_callbacks_t, clearmsg) },
+	[TWIRC_CMD_NOTICE]          = { libtwirc_on_notice,          offsetof(twirc_callbacks_t, notice) },
+	[TWIRC_CMD_ROOMSTATE]       = { libtwirc_on_roomstate,       offsetof(twirc_callbacks_t, roomstate) },
+	[TWIRC_CMD_USERSTATE]       = { libtwirc_on_userstate,       offsetof(twirc_callbacks_t, userstate) },
+	[TWIRC_CMD_USERNOTICE]      = { libtwirc_on_usernotice,      offsetof(twirc_callbacks_t, usernotice) },
+	[TWIRC_CMD_WHISPER]         = { libtwirc_on_whisper,         offsetof(twirc_callbacks_t, whisper) },
+	[TWIRC_CMD_PING]            = { libtwirc_on_ping,            offsetof(twirc_callbacks_t, ping) },
+	[TWIRC_CMD_PONG]            = { libtwirc_on_other,           offsetof(twirc_callbacks_t, other) },
+	[TWIRC_CMD_MODE]            = { libtwirc_on_mode,            offsetof(twirc_callbacks_t, mode) },
+	[TWIRC_CMD_NAMREPLY]        = { libtwirc_on_names,           offsetof(twirc_callbacks_t, names) },
+	[TWIRC_CMD_ENDOFNAMES]      = { libtwirc_on_names,           offsetof(twirc_callbacks_t, names) },
+	[TWIRC_CMD_HOSTTARGET]      = { libtwirc_on_hosttarget,      offsetof(twirc_callbacks_t, hosttarget) },
+	[TWIRC_CMD_CAP]             = { libtwirc_on_capack,          offsetof(twirc_callbacks_t, capack) },
+	[TWIRC_CMD_WELCOME]         = { libtwirc_on_welcome,         offsetof(twirc_callbacks_t, welcome) },
+	[TWIRC_CMD_GLOBALUSERSTATE] = { libtwirc_on_globaluserstate, offsetof(twirc_callbacks_t, globaluserstate) },
+	[TWIRC_CMD_UNKNOWNCMD]      = { libtwirc_on_invalidcmd,      offsetof(twirc_callbacks_t, invalidcmd) },
+	[TWIRC_CMD_RECONNECT]       = { libtwirc_on_reconnect,       offsetof(twirc_callbacks_t, reconnect) },
+};
 
 /*
- * Dispatches the internal and external event handler / callback functions
- * for the given event, based on the command field of evt. Does not handle
- * CTCP events - call libtwirc_dispatch_ctcp() for those instead.
+ * Returns a bitmask with one bit (1 << TWIRC_CMD_*) set for every command 
+ * that we need to parse, because either the user has installed a callback 
+ * that it would be dispatched to, or we need to handle it internally. The 
+ * bit at TWIRC_CMD_COUNT is set if the user wants to see CTCP events, which 
+ * could come with any command.
  */
-static void
-libtwirc_dispatch_evt(twirc_state_t *s, twirc_event_t *evt)
+static unsigned long
+libtwirc_subscriptions(twirc_state_t *s)
 {
-	// TODO try ordering these by "probably usually most frequent", so that
-	// we waste as little CPU cycles as possible on strcmp() here!
-	
-	if (strcmp(evt->command, "PRIVMSG") == 0)
+	unsigned long subs = 0;
+	for (int id = 0; id < TWIRC_CMD_COUNT; ++id)
 	{
-		libtwirc_on_privmsg(s, evt);
-		s->cbs.privmsg(s, evt);
-		return;
+		if (LIBTWIRC_CALLBACK(s, libtwirc_dispatch_table[id].callback) != libtwirc_on_null)
+		{
+			subs |= 1UL << id;
+		}
 	}
-	if (strcmp(evt->command, "JOIN") == 0)
+
+	// Anything but "CAP * ACK" ends up as 'other'
+	if (s->cbs.other != libtwirc_on_null)
 	{
-		libtwirc_on_join(s, evt);
-		s->cbs.join(s, evt);
-		return;
+		subs |= 1UL << TWIRC_CMD_CAP;
 	}
-	if (strcmp(evt->command, "CLEARCHAT") == 0)
+
+	// CTCP events are dispatched to either 'action' or 'other'
+	if (s->cbs.action != libtwirc_on_null || s->cbs.other != libtwirc_on_null)
 	{
-		libtwirc_on_clearchat(s, evt);
-		s->cbs.clearchat(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "CLEARMSG") == 0)
-	{		
-		libtwirc_on_clearmsg(s, evt);
-		s->cbs.clearmsg(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "NOTICE") == 0)
-	{	
-		libtwirc_on_notice(s, evt);
-		s->cbs.notice(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "ROOMSTATE") == 0)
-	{		
-		libtwirc_on_roomstate(s, evt);
-		s->cbs.roomstate(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "USERSTATE") == 0)
-	{		
-		libtwirc_on_userstate(s, evt);
-		s->cbs.userstate(s, evt);
-		return;
+		subs |= 1UL << TWIRC_CMD_COUNT;
 	}
-	if (strcmp(evt->command, "USERNOTICE") == 0)
-	{		
-		libtwirc_on_usernotice(s, evt);
-		s->cbs.usernotice(s, evt);
-		return;
-	}
-	if (strcmp(evt->command, "WHISPER") == 0)
+
+	// These need to be handled internally, no matter what
+	subs |= 1UL << TWIRC_CMD_WELCOME;
+	subs |= 1UL << TWIRC_CMD_GLOBALUSERSTATE;
+	subs |= 1UL << TWIRC_CMD_PING;
+	subs |= 1UL << TWIRC_CMD_RECONNECT;
+	subs |= 1UL << TWIRC_CMD_USERSTATE;
+
+	// The bulk join planner needs to know if the joins worked out
+	if (s->joins.num)
 	{
-		libtwirc_on_whisper(s, evt);
-		s->cbs.whisper(s, evt);
-		return;
+		subs |= 1UL << TWIRC_CMD_JOIN;
+		subs |= 1UL << TWIRC_CMD_ROOMSTATE;
+		subs |= 1UL << TWIRC_CMD_NOTICE;
 	}
-	if (strcmp(evt->command, "PART") == 0)
+
+	// Automatic reconnects need to know which channels to rejoin, and the
+	// handover which ones the second connection has to get into
+	if (s->reconnect_min || s->handover)
 	{
-		libtwirc_on_part(s, evt);
-		s->cbs.join(s, evt);
-		return;
+		subs |= 1UL << TWIRC_CMD_JOIN;
+		subs |= 1UL << TWIRC_CMD_PART;
 	}
-	if (strcmp(evt->command, "PING") == 0)
+	return subs;
+}
+
+/*
+ * Takes a quick look at the raw IRC message msg, without parsing or even 
+ * copying it, to figure out its command. Returns 1 if the message needs to 
+ * be processed according to the state's subscriptions, 0 if there is no one
+ * interested in it and it can be dropped right away.
+ */
+static int
+libtwirc_subscribed(twirc_state_t *s, const char *msg)
+{
+	const char *cmd = msg;
+
+	// Skip the tags and the prefix, if any
+	if (cmd[0] == '@' && (cmd = strchr(cmd, ' ')) != NULL)
 	{
-		libtwirc_on_ping(s, evt);
-		s->cbs.ping(s, evt);
-		return;
+		++cmd;
 	}
-	if (strcmp(evt->command, "MODE") == 0)
+	if (cmd && cmd[0] == ':' && (cmd = strchr(cmd, ' ')) != NULL)
 	{
-		libtwirc_on_mode(s, evt);
-		s->cbs.mode(s, evt);
-		return;
+		++cmd;
 	}
-	if (strcmp(evt->command, "353") == 0 ||
-	    strcmp(evt->command, "366") == 0)
+	if (cmd == NULL)
 	{
-		libtwirc_on_names(s, evt);
-		s->cbs.names(s, evt);
-		return;
+		return 1; // Malformed, let the parser deal with it
 	}
-	if (strcmp(evt->command, "HOSTTARGET") == 0)
+
+	const char *next = strchr(cmd, ' ');
+	size_t len = next ? (size_t) (next - cmd) : strlen(cmd);
+	if (s->subs & (1UL << libtwirc_command_id(cmd, len)))
 	{
-		libtwirc_on_hosttarget(s, evt);
-		s->cbs.hosttarget(s, evt);		
-		return;
+		return 1;
 	}
-	if (strcmp(evt->command, "CAP") == 0 &&
-	    strcmp(evt->params[0], "*") == 0)
+
+	// Someone wants CTCP events, and this one might be one
+	if (s->subs & (1UL << TWIRC_CMD_COUNT))
 	{
-		libtwirc_on_capack(s, evt);
-		s->cbs.capack(s, evt);
-		return;
+		size_t msg_len = strlen(msg);
+		return msg_len && msg[msg_len - 1] == 0x01;
 	}
-	if (strcmp(evt->command, "001") == 0)
+	return 0;
+}
+
+/*
+ * Calls the user callback cb for the given event (which can be NULL), or has
+ * the state's pipeline call it, if it has one. Callbacks that haven't been
+ * set aren't worth the trip through the pipeline, so they are skipped.
+ */
+static void
+libtwirc_callback(twirc_state_t *s, twirc_callback cb, twirc_event_t *evt)
+{
+	if (cb == libtwirc_on_null)
 	{
-		libtwirc_on_welcome(s, evt);
-		s->cbs.welcome(s, evt);
 		return;
 	}
-	if (strcmp(evt->command, "GLOBALUSERSTATE") == 0)
-	{ 
-		libtwirc_on_globaluserstate(s, evt);
-		s->cbs.globaluserstate(s, evt);
+
+	// While another connection takes over, messages are delivered once,
+	// always to the state the user knows about (see libtwirc_handover.c)
+	if ((s->primary || s->seen.until) && !libtwirc_handover_pass(s, evt))
+	{
 		return;
 	}
-	if (strcmp(evt->command, "421") == 0)
+	s = s->primary ? s->primary : s;
+
+	// With a pipeline, this only times handing the event over; how long
+	// it waited in there will be recorded by the consumer
+	uint64_t t0 = libtwirc_stats_now();
+	if (s->pipeline == NULL || libtwirc_pipeline_push(s->pipeline, s, cb, evt) == -1)
 	{
-		libtwirc_on_invalidcmd(s, evt);
-		s->cbs.invalidcmd(s, evt);
-		return;
+		libtwirc_stats_latency(s, evt, t0);
+		cb(s, evt);
 	}
-	if (strcmp(evt->command, "RECONNECT") == 0)
+	libtwirc_stats_callback(s, t0);
+}
+
+static void
+libtwirc_dispatch_out(twirc_state_t *s, twirc_event_t *evt)
+{
+	libtwirc_on_outbound(s, evt);
+	libtwirc_callback(s, s->cbs.outbound, evt);
+}
+
+/*
+ * Dispatches the internal and external event handler / callback functions
+ * for the given event, based on the command_id field of evt. Does not handle
+ * CTCP events - call libtwirc_dispatch_ctcp() for those instead.
+ */
+static void
+libtwirc_dispatch_evt(twirc_state_t *s, twirc_event_t *evt)
+{
+	int id = evt->command_id;
+
+	// We only care about "CAP * ACK", other CAP messages are 'other'
+	if (id == TWIRC_CMD_CAP && 
+	    (evt->num_params == 0 || strcmp(evt->params[0], "*") != 0))
 	{
-		libtwirc_on_reconnect(s, evt);
-		s->cbs.reconnect(s, evt);
-		return;
+		id = TWIRC_CMD_OTHER;
 	}
-	
-	// Some unaccounted-for event occured
-	libtwirc_on_other(s, evt);
-	s->cbs.other(s, evt);
+
+	libtwirc_stats_command(s, id);
+	const struct libtwirc_dispatch *d = &libtwirc_dispatch_table[id];
+	d->handler(s, evt);
+	libtwirc_callback(s, LIBTWIRC_CALLBACK(s, d->callback), evt);
 }
 
 /*
@@ -770,52 +791,76 @@ libtwirc_dispatch_evt(twirc_state_t *s, twirc_event_t *evt)
 static void
 libtwirc_dispatch_ctcp(twirc_state_t *s, twirc_event_t *evt)
 {
+	libtwirc_stats_command(s, TWIRC_CMD_COUNT);
 	if (strcmp(evt->ctcp, "ACTION") == 0)
 	{
 		libtwirc_on_action(s, evt);
-		s->cbs.action(s, evt);
+		libtwirc_callback(s, s->cbs.action, evt);
 		return;
 	}
 	
 	// Some unaccounted-for event occured
 	libtwirc_on_other(s, evt);
-	s->cbs.other(s, evt);
+	libtwirc_callback(s, s->cbs.other, evt);
 }
 
 /*
- * Takes a raw IRC message and parses all the relevant information into a 
- * twirc_event struct, then calls upon the functions responsible for the 
- * dispatching of the event to internal and external callback functions.
- * Returns 0 on success, -1 if an out of memory error occured during the
- * parsing/handling of a CTCP event.
+ * Does the actual work for libtwirc_process_msg(), which takes care of the
+ * arena. Returns 0 on success, -1 if we ran out of memory.
  */
 static int
-libtwirc_process_msg(twirc_state_t *s, const char *msg, int outbound)
+libtwirc_parse_msg(twirc_state_t *s, const char *msg, int outbound)
 {
-	//fprintf(stderr, "> %s (%zu)\n", msg, strlen(msg));
+	uint64_t t0 = libtwirc_stats_now();
+	size_t pushes = s->arena.pushes;
 
-	int err = 0;
 	twirc_event_t evt = { 0 };
+	evt.raw = (char *) msg;
+	evt.state = s;
+	evt.recv_ns = outbound ? 0 : s->recv_ns;
+
+	// Copy the message, as we will be parsing it in place; unless we may
+	// parse it right where it has been received (see twirc_set_zero_copy),
+	// then the receive buffer is ours to scribble on and raw goes away
+	size_t len = strlen(msg);
+	char *line = NULL;
+	if (!outbound && s->zero_copy)
+	{
+		line = (char *) msg;
+		evt.raw = NULL;
+	}
+	else if ((line = libtwirc_arena_strndup(&s->arena, msg, len)) == NULL)
+	{
+		return -1;
+	}
+	char *end = line + len;
 
-	evt.raw = strdup(msg);
-
-	// Extract the tags, if any
-	msg = libtwirc_parse_tags(msg, &(evt.tags), &(evt.num_tags));
+	// Extract the tags, if any; unless lazy tag parsing has been enabled,
+	// in which case they will be split once someone asks for them
+	line = libtwirc_parse_tags(line, end, &(evt.tag_block));
+	if (!s->lazy_tags && libtwirc_split_tags(&s->arena, &evt, 0) == -1)
+	{
+		return -1;
+	}
 
 	// Extract the prefix, if any
-	msg = libtwirc_parse_prefix(msg, &(evt.prefix));
+	line = libtwirc_parse_prefix(line, end, &(evt.prefix));
 
 	// Extract the command, always
-	msg = libtwirc_parse_command(msg, &(evt.command));
+	line = libtwirc_parse_command(line, end, &(evt.command), &(evt.command_id));
 
 	// Extract the parameters, if any
-	msg = libtwirc_parse_params(msg, &(evt.params), &(evt.num_params), &(evt.trailing));
+	if (libtwirc_parse_params(&s->arena, line, end, &(evt.params), &(evt.num_params), &(evt.trailing)) == -1)
+	{
+		return -1;
+	}
 
 	// Check for CTCP and possibly modify the event accordingly
-	err = libtwirc_parse_ctcp(&evt);
+	libtwirc_parse_ctcp(&evt);
 
 	// Extract the nick from the prefix, maybe
-	evt.origin = libtwirc_parse_nick(evt.prefix);
+	evt.origin = libtwirc_parse_nick(&s->arena, evt.prefix);
+	libtwirc_stats_parsed(s, t0, s->arena.pushes - pushes);
 	
 	if (outbound)
 	{
@@ -830,120 +875,220 @@ libtwirc_process_msg(twirc_state_t *s, const char *msg, int outbound)
 		libtwirc_dispatch_evt(s, &evt);
 	}
 
-	// Free event
-	// TODO: make all of this into a function? libtwirc_free_event()
-	libtwirc_free_params(evt.params);
-	free(evt.params);
-	evt.params = NULL;
-	libtwirc_free_tags(evt.tags);
-	free(evt.tags);
-	evt.tags = NULL;
-	free(evt.raw);
-	free(evt.prefix);
-	free(evt.origin);
-	free(evt.target);
-	free(evt.command);
-	free(evt.ctcp);
-
-	return err;
+	return 0;
 }
 
 /*
- * Process the raw IRC data stored in `buf`, which has a size of len bytes.
- * Incomplete commands will be buffered in state->buffer, complete commands 
- * will be processed right away. Returns 0 on success, -1 if out of memory.
+ * Takes a raw IRC message and parses all the relevant information into a 
+ * twirc_event struct, then calls upon the functions responsible for the 
+ * dispatching of the event to internal and external callback functions.
+ * The message is copied to the state's arena once, then parsed in place; all
+ * members of the event will point into that copy, except for raw, which 
+ * points to msg itself. In zero-copy mode, inbound messages are parsed in 
+ * place in the receive buffer instead, and raw will be NULL. Everything that
+ * has been allocated from the arena for this message is released in one go
+ * once the event has been dispatched.
+ * Messages that would only be dispatched to the dummy callback (and that we
+ * don't need to handle internally) are dropped without being parsed at all.
+ * Returns 0 on success, -1 if an out of memory error occured.
  */
-int
-libtwirc_process_data(twirc_state_t *s, const char *buf, size_t len)
+static int
+libtwirc_process_msg(twirc_state_t *s, const char *msg, int outbound)
 {
-	/*
-	    +----------------------+----------------+
-	    |       recv() 1       |    recv() 2    |
-	    +----------------------+----------------+
-	    |USER MYNAME\r\n\0PASSW|ORD MYPASS\r\n\0|
-	    +----------------------+----------------+
-
-	    -> libtwirc_next_chunk() 1.1 => "USER MYNAME\r\n\0"
-	    -> libtwirc_next_chunk() 1.2 => "PASSW\0"
-	    -> libtwirc_next_chunk() 2.1 => "ORD MYPASS\r\n\0"
-	*/
-
-	// A chunk has to be able to hold at least as much data as the buffer
-	// we're working on. This means we'll dynamically allocate the chunk 
-	// buffer to the same size as the handed in buffer, plus one to make
-	// room for a null terminator which might not be present in the data
-	// received, but will definitely be added in the chunk.
-
-	char *chunk = malloc(len + 1);
-	if (chunk == NULL) { return libtwirc_oom(s); }
-	chunk[0] = '\0';
-	int off = 0;
-
-	// Here, we'll get one chunk at a time, where a chunk is a part of the
-	// recieved bytes that ends in a null terminator. We'll add all of the 
-	// extracted chunks to the buffer, which might already contain parts of
-	// an incomplete IRC command. The buffer needs to be sufficiently big 
-	// to contain more than one delivery in case one of them is incomplete,
-	// but the next one is complete and adds the missing pieces of the 
-	// previous one.
-
-	while ((off = libtwirc_next_chunk(chunk, len + 1, buf, len, off)) > 0)
-	{
-		// Concatenate the current buffer and the newly extracted chunk
-		strcat(s->buffer, chunk);
-	}
-
-	free(chunk);
-
-	// Here, we're lookin at each IRC command in the buffer. We do so by 
-	// getting the string from the beginning of the buffer that ends in 
-	// '\r\n', if any. This string will then be deleted from the buffer.
-	// We do this repeatedly until we've extracted all complete commands 
-	// from the buffer. If the last bit of the buffer was an incomplete 
-	// command (did not end in '\r\n'), it will be left in the buffer. 
-	// Hopefully, successive recv() calls will bring in the missing pieces.
-	// If not, we will run into issues, as the buffer could silently and 
-	// slowly fill up until it finally overflows. TODO: test for that?
-	
-	char msg[TWIRC_MESSAGE_SIZE];
-	msg[0] = '\0';
+	//fprintf(stderr, "> %s (%zu)\n", msg, strlen(msg));
 
-	while (libtwirc_shift_token(msg, s->buffer, "\r\n") > 0)
+	// There is no point in parsing messages no one is going to look at
+	if (outbound ? s->cbs.outbound == libtwirc_on_null : !libtwirc_subscribed(s, msg))
 	{
-		// Process the message and check if we ran out of memory doing so
-		if (libtwirc_process_msg(s, msg, 0) == -1)
+		libtwirc_stats_msg(s, outbound, 1);
+		return 0;
+	}
+	libtwirc_stats_msg(s, outbound, 0);
+
+	// Outbound messages are usually sent from within a callback, while the
+	// inbound event is still being handled; by releasing the arena only up
+	// to this mark, we won't touch the data of the inbound event
+	struct libtwirc_mark mark = libtwirc_arena_mark(&s->arena);
+
+	int err = libtwirc_parse_msg(s, msg, outbound);
+
+	libtwirc_arena_release(&s->arena, mark);
+	return err == -1 ? libtwirc_oom(s) : 0;
+}
+
+/*
+ * Makes sure that there are at least len bytes of free space at the end of 
+ * the state's buffer (plus one for a null terminator), growing the buffer if
+ * need be. Returns 0 on success, -1 if we ran out of memory.
+ */
+static int
+libtwirc_reserve(twirc_state_t *s, size_t len)
+{
+	if (s->buf_size - s->buf_len > len)
+	{
+		return 0;
+	}
+
+	size_t size = s->buf_size;
+	while (size - s->buf_len <= len)
+	{
+		size *= 2;
+	}
+
+	char *grown = realloc(s->buffer, size);
+	if (grown == NULL)
+	{
+		return -1;
+	}
+
+	s->buffer   = grown;
+	s->buf_size = size;
+	return 0;
+}
+
+/*
+ * Processes the raw IRC data in the state's buffer. Every complete message
+ * (ending in '\n', usually preceded by '\r') will be null terminated in place
+ * and processed right away. Bytes before s->buf_scan have been looked at 
+ * before and are known not to contain a line break, so every byte is scanned 
+ * only once. Once all complete messages have been processed, what's left (an
+ * incomplete message, if any) is moved to the front of the buffer; hence, 
+ * data is moved at most once per call. Returns 0 on success, -1 if we ran 
+ * out of memory.
+ */
+static int
+libtwirc_process_buffer(twirc_state_t *s)
+{
+	char *buf = s->buffer;
+	char *end = s->buffer + s->buf_len;
+	char *msg = s->buffer;
+	char *lf  = NULL;
+
+	// Check what events the user is interested in; callbacks might have
+	// been changed since the last time we got data
+	s->subs = libtwirc_subscriptions(s);
+	libtwirc_stats_buffer(s);
+
+	while ((lf = memchr(s->buffer + s->buf_scan, '\n', end - (s->buffer + s->buf_scan))) != NULL)
+	{
+		// Next scan starts after this line break
+		s->buf_scan = (lf + 1) - buf;
+
+		// Terminate the message, dropping the '\r' if there is one
+		char *term = (lf > msg && lf[-1] == '\r') ? lf - 1 : lf;
+		*term = '\0';
+
+		// We've been skipping a message that was too long; this is
+		// the rest of it, which we'll skip as well, then we're done
+		if (s->buf_skip)
+		{
+			s->buf_skip = 0;
+		}
+		// Ignore empty lines, process everything else and check 
+		// if we ran out of memory doing so
+		else if (term > msg && libtwirc_process_msg(s, msg, 0) == -1)
 		{
 			return -1;
 		}
+
+		// The connection has been lost while handling the message, 
+		// which emptied the buffer; the rest of it has to go as well
+		if (s->buf_len == 0)
+		{
+			return 0;
+		}
+
+		msg = lf + 1;
 	}
-	
+
+	// Move the incomplete message (if any) to the front of the buffer
+	size_t rest = end - msg;
+	if (msg != buf)
+	{
+		memmove(buf, msg, rest);
+	}
+	s->buf_len  = rest;
+	s->buf_scan = rest;
+
+	// The incomplete message has grown unreasonably big; something is
+	// off, so we drop what we have and skip the rest of that message
+	if (rest > TWIRC_MESSAGE_MAX)
+	{
+		s->buf_len  = 0;
+		s->buf_scan = 0;
+		s->buf_skip = 1;
+	}
+
+	s->buffer[s->buf_len] = '\0';
 	return 0;
 }
 
-/*
- * Handles the epoll event epev.
- * Returns 0 on success, -1 if the connection has been interrupted or
- * not enough memory was available to process the incoming data.
- */
-static int
-libtwirc_handle_event(twirc_state_t *s, struct epoll_event *epev)
-{
+/*
+ * Handles the epoll event epev.
+ * Returns 0 on success, -1 if the connection has been interrupted or
+ * not enough memory was available to process the incoming data.
+ */
+static int
+libtwirc_handle_event(twirc_state_t *s, struct epoll_event *epev)
+{
+	// With TLS, we're only connected once the handshake is done, which
+	// can take a few rounds of the socket becoming readable or writable
+	if ((s->status & TWIRC_STATUS_CONNECTING) && s->tls &&
+	    !(epev->events & (EPOLLERR | EPOLLHUP)))
+	{
+		if (s->ssl == NULL && !(epev->events & EPOLLOUT))
+		{
+			return 0;
+		}
+		int res = libtwirc_tls_handshake(s);
+		if (res == -1)
+		{
+			s->error = TWIRC_ERR_TLS_HANDSHAKE;
+			libtwirc_on_disconnect(s);
+			libtwirc_callback(s, s->cbs.disconnect, NULL);
+			return -1;
+		}
+		if (res == 0)
+		{
+			return 0;
+		}
+		libtwirc_on_connect(s);
+		libtwirc_callback(s, s->cbs.connect, NULL);
+	}
+
 	// We've got data coming in
 	if(epev->events & EPOLLIN)
 	{
-		char buf[TWIRC_BUFFER_SIZE];
 		int bytes_received = 0;
 		
-		// Fetch and process all available data from the socket
-		while ((bytes_received = libtwirc_recv(s, buf, TWIRC_BUFFER_SIZE)) > 0)
+		// Fetch and process all available data from the socket; we 
+		// receive into the state's buffer directly, right after the
+		// incomplete message that might still be waiting in there
+		while (1)
 		{
+			// Make sure there is enough space for a full read
+			if (libtwirc_reserve(s, TWIRC_BUFFER_SIZE) == -1)
+			{
+				return libtwirc_oom(s);
+			}
+
+			bytes_received = libtwirc_recv(s, s->buffer + s->buf_len, 
+					s->buf_size - s->buf_len);
+			if (bytes_received <= 0)
+			{
+				break;
+			}
+			s->buf_len += bytes_received;
+
 			// Process the data and check if we ran out of memory doing so
-			if (libtwirc_process_data(s, buf, bytes_received) == -1)
+			if (libtwirc_process_buffer(s) == -1)
 			{
-				s->error = TWIRC_ERR_OUT_OF_MEMORY;
-				return -1;
+				return libtwirc_oom(s);
 			}
 		}
+
+		// Keep ACKing right away, if that's what we're asked to do
+		libtwirc_sockopts_rearm(s);
 		
 		// If twirc_recv() returned -1, the connection is probably down,
 		// either way, we  have a serious issue and should stop running!
@@ -951,12 +1096,15 @@ libtwirc_handle_event(twirc_state_t *s, struct epoll_event *epev)
 		{
 			s->error = TWIRC_ERR_SOCKET_RECV;
 			
-			// We were connected but now seem to be disconnected?
-			if (twirc_is_connected(s) && tcpsock_status(s->socket_fd) == -1)
+			// We were connected but now seem to be disconnected? Note
+			// that recv() reports (and clears) the socket's error, so
+			// after a reset, only the event might still tell us
+			if (twirc_is_connected(s) && ((epev->events & (EPOLLERR | EPOLLHUP)) ||
+			    tcpsock_status(s->socket_fd) == -1))
 			{
 				// If so, call the disconnect event handlers
 				libtwirc_on_disconnect(s);
-				s->cbs.disconnect(s, NULL);
+				libtwirc_callback(s, s->cbs.disconnect, NULL);
 			}
 			return -1;
 		}
@@ -971,8 +1119,12 @@ libtwirc_handle_event(twirc_state_t *s, struct epoll_event *epev)
 			// The internal connect event handler will initiate the
 			// request of capabilities as well as the login process
 			libtwirc_on_connect(s);
-			s->cbs.connect(s, NULL);
+			libtwirc_callback(s, s->cbs.connect, NULL);
 		}
+
+		// Send whatever has been waiting for the socket to drain;
+		// if this fails, it will show as EPOLLERR or EPOLLHUP
+		libtwirc_flush(s);
 	}
 	
 	// Server closed the connection
@@ -980,7 +1132,7 @@ libtwirc_handle_event(twirc_state_t *s, struct epoll_event *epev)
 	{
 		s->error = TWIRC_ERR_CONN_CLOSED;
 		libtwirc_on_disconnect(s);
-		s->cbs.disconnect(s, NULL);
+		libtwirc_callback(s, s->cbs.disconnect, NULL);
 		return -1;
 	}
 	
@@ -989,7 +1141,7 @@ libtwirc_handle_event(twirc_state_t *s, struct epoll_event *epev)
 	{
 		s->error = TWIRC_ERR_CONN_HANGUP;
 		libtwirc_on_disconnect(s);
-		s->cbs.disconnect(s, NULL);
+		libtwirc_callback(s, s->cbs.disconnect, NULL);
 		return -1;
 	}
 
@@ -998,7 +1150,7 @@ libtwirc_handle_event(twirc_state_t *s, struct epoll_event *epev)
 	{
 		s->error = TWIRC_ERR_CONN_SOCKET;
 		libtwirc_on_disconnect(s);
-		s->cbs.disconnect(s, NULL);
+		libtwirc_callback(s, s->cbs.disconnect, NULL);
 		return -1;
 	}
 	
@@ -1007,41 +1159,169 @@ libtwirc_handle_event(twirc_state_t *s, struct epoll_event *epev)
 }
 
 /*
- * Sends data to the IRC server, using the state's socket.
- * On success, returns the number of bytes sent.
- * On error, -1 is returned and errno is set appropriately.
+ * Sends as much of the outbound queue to the IRC server as the socket will 
+ * take right now. Whatever is left will be sent once epoll reports that the 
+ * socket is writable again (EPOLLOUT). Returns 0 on success, even if not all
+ * data could be sent, or -1 if an error occured on the socket.
  */
 static int
-libtwirc_send(twirc_state_t *s, const char *msg)
+libtwirc_flush(twirc_state_t *s)
 {
-	// Get the actual message length (without null terminator)
-	// If the message is too big for the message buffer, we only
-	// grab as much as we can fit in our buffer (we truncate)
-	size_t msg_len = strnlen(msg, TWIRC_BUFFER_SIZE - 3);
+	// With io_uring, all states of a pool send in one go, see there
+	if (s->uring_slot != -1)
+	{
+		return libtwirc_uring_flush(s);
+	}
+
+	while (s->out_head < s->out_len)
+	{
+		int ret = s->ssl ?
+			libtwirc_tls_send(s, s->out + s->out_head, s->out_len - s->out_head) :
+			tcpsock_send(s->socket_fd, s->out + s->out_head, 
+				s->out_len - s->out_head);
+		libtwirc_stats_send(s, ret);
+		if (ret == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				// Socket's send buffer is full, try again later
+				return 0;
+			}
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			s->error = TWIRC_ERR_SOCKET_SEND;
+			return -1;
+		}
+		s->out_head += ret;
+	}
+
+	// Everything has been sent, start over at the front
+	s->out_head = 0;
+	s->out_len  = 0;
+	return 0;
+}
+
+/*
+ * Adds the message msg, which is len bytes long, to the outbound queue (with
+ * the required "\r\n" appended), which is then sent right away, or as soon 
+ * as the socket is ready to take it. This way, we never block and never lose
+ * data to short writes. Unlike libtwirc_queue(), this doesn't dispatch the 
+ * outgoing event. Returns 0 on success and -1 on error.
+ */
+static int
+libtwirc_enqueue(twirc_state_t *s, const char *msg, size_t len)
+{
+	size_t queued = s->out_len - s->out_head;
+	size_t total  = len + 2;
 
-	// Create a perfectly sized buffer (max TWIRC_BUFFER_SIZE)
-	size_t buf_len = msg_len + 3;
-	char *buf = malloc(buf_len * sizeof(char));
+	// Not enough space at the end of the queue; move the data that's yet
+	// to be sent to the front and, if that's not enough, grow the queue
+	if (s->out_size - s->out_len < total && s->out_head > 0)
+	{
+		memmove(s->out, s->out + s->out_head, queued);
+		s->out_head = 0;
+		s->out_len  = queued;
+	}
+	if (s->out_size - s->out_len < total)
+	{
+		size_t size = s->out_size ? s->out_size : TWIRC_BUFFER_SIZE;
+		while (size - s->out_len < total)
+		{
+			size *= 2;
+		}
+		char *grown = realloc(s->out, size);
+		if (grown == NULL)
+		{
+			return libtwirc_oom(s);
+		}
+		s->out      = grown;
+		s->out_size = size;
+	}
 
-	// Copy the user's message into our slightly larger buffer
-	snprintf(buf, buf_len, "%s", msg);
+	// Append the message; IRC messages need to be CR-LF (\r\n) terminated!
+	memcpy(s->out + s->out_len, msg, len);
+	memcpy(s->out + s->out_len + len, "\r\n", 2);
+	s->out_len += total;
+	libtwirc_stats_queue(s);
 
-	// Use the additional space for line and null terminators
-	// IRC messages need to be CR-LF (\r\n) terminated!
-	buf[msg_len+0] = '\r';
-	buf[msg_len+1] = '\n';
-	buf[msg_len+2] = '\0';
+	// Actually send the message, unless there is still data waiting for
+	// the socket to become writable, in which case this would be futile
+	return queued ? 0 : libtwirc_flush(s);
+}
 
-	// Actually send the message
-	int ret = tcpsock_send(s->socket_fd, buf, buf_len);
+/*
+ * Adds the message msg, which is len bytes long, to the outbound queue (see
+ * libtwirc_enqueue()) and dispatches the outgoing event for it.
+ * Returns 0 on success and -1 on error.
+ */
+static int
+libtwirc_queue(twirc_state_t *s, const char *msg, size_t len)
+{
+	int ret = libtwirc_enqueue(s, msg, len);
 	
 	// Dispatch the outgoing event
 	libtwirc_process_msg(s, msg, 1);
 
-	free(buf);
 	return ret;
 }
 
+/*
+ * Sends data to the IRC server, using the state's socket. Messages that are 
+ * subject to Twitch's rate limits (chat messages, whispers, JOINs) might be 
+ * held back until they can be sent without exceeding the limits, everything
+ * else is added to the outbound queue right away (see libtwirc_queue), unless
+ * it would overtake messages that are being held back. 
+ * Returns 0 on success and -1 on error; if the queue is full, the error will
+ * be set to TWIRC_ERR_QUEUE_FULL and the message won't be sent at all.
+ */
+static int
+libtwirc_send(twirc_state_t *s, const char *msg)
+{
+	// Get the actual message length (without null terminator)
+	// If the message is too big for the message buffer, we only
+	// grab as much as we can fit in our buffer (we truncate)
+	size_t len = strnlen(msg, TWIRC_BUFFER_SIZE - 3);
+
+	// Callbacks called by a pipeline send from other threads; a shadow
+	// is charged to the rate limits of its primary, so it locks that too
+	if (s->primary)
+	{
+		pthread_mutex_lock(&s->primary->lock);
+	}
+	pthread_mutex_lock(&s->lock);
+
+	int res = -1;
+	unsigned cost = 0;
+
+	// Refuse to queue even more if the queue is at its high-water mark
+	if (s->out_max && twirc_get_queue_len(s) >= s->out_max)
+	{
+		s->error = TWIRC_ERR_QUEUE_FULL;
+	}
+	else
+	{
+		// Messages that aren't rate limited must not overtake those that
+		// are held back (a PART would beat the PRIVMSG before it); only 
+		// PONGs can't wait, or the server might drop us
+		int buckets = libtwirc_rate_class(s, msg, len, &cost);
+		int pong = len >= 4 && strncmp(msg, "PONG", 4) == 0;
+		res = buckets || (s->pend_len && !pong) ?
+			libtwirc_rate_send(s, msg, len, buckets, cost) :
+			libtwirc_queue(s, msg, len);
+	}
+
+	// Whatever didn't go out right away needs the socket to be writable
+	libtwirc_interest(s);
+	pthread_mutex_unlock(&s->lock);
+	if (s->primary)
+	{
+		pthread_mutex_unlock(&s->primary->lock);
+	}
+	return res;
+}
+
 /*
  * Reads data from the socket and copies it into the provided buffer `buf`.
  * Returns the number of bytes read or 0 if there was no more data to read.
@@ -1053,7 +1333,27 @@ libtwirc_recv(twirc_state_t *s, char *buf, size_t len)
 {
 	// Receive data
 	ssize_t res_len;
-	res_len = tcpsock_receive(s->socket_fd, buf, len - 1);
+	struct timespec ts = { 0 };
+	if (s->ssl)
+	{
+		res_len = libtwirc_tls_recv(s, buf, len - 1);
+	}
+	else if (s->sockopts.timestamps)
+	{
+		// Have the kernel tell us when the data actually came in
+		res_len = tcpsock_receive_ts(s->socket_fd, buf, len - 1, &ts);
+	}
+	else
+	{
+		res_len = tcpsock_receive(s->socket_fd, buf, len - 1);
+	}
+	libtwirc_stats_recv(s, res_len);
+
+	// All messages completed by this data have been received now
+	if (res_len > 0)
+	{
+		s->recv_ns = libtwirc_sockopts_stamp(&ts);
+	}
 
 	// Check if tcpsno_receive() reported an error
 	if (res_len == -1)
@@ -1067,6 +1367,12 @@ libtwirc_recv(twirc_state_t *s, char *buf, size_t len)
 		return -1;
 	}
 	
+	// The peer closed the connection; with epoll, we'd get EPOLLRDHUP
+	if (res_len == 0)
+	{
+		s->eof = 1;
+	}
+
 	// Make sure that the received data is null terminated
 	buf[res_len] = '\0';
 
@@ -1074,6 +1380,201 @@ libtwirc_recv(twirc_state_t *s, char *buf, size_t len)
 	return res_len;
 }
 
+/*
+ * Registers the state's socket, timer, resolver eventfd and connect attempts
+ * (if they exist) with the epoll 
+ * instance epfd. The data of each epoll event will point to a watch that 
+ * tells us which state the event belongs to and what kind of file it is
+ * about, see libtwirc_handle_watch(). Files that have been registered with
+ * epfd before are fine. Returns 0 on success, -1 on error.
+ */
+static int
+libtwirc_watch(twirc_state_t *s, int epfd)
+{
+	struct epoll_event eev = { 0 };
+
+	if (s->socket_fd != -1)
+	{
+		// With io_uring, data is received without epoll's help; the
+		// recv completing with 0 tells us that the server closed the
+		// connection, after all data before that has been processed
+		eev.data.ptr = &s->sock_watch;
+		eev.events = EPOLLOUT | EPOLLET;
+		eev.events |= s->uring_slot == -1 ? EPOLLIN | EPOLLRDHUP : 0;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->socket_fd, &eev) == -1 && errno != EEXIST)
+		{
+			// Socket could not be registered for IO
+			s->error = TWIRC_ERR_EPOLL_CTL;
+			return -1;
+		}
+	}
+
+	if (s->timer_fd != -1)
+	{
+		eev.data.ptr = &s->timer_watch;
+		eev.events = EPOLLIN;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->timer_fd, &eev) == -1 && errno != EEXIST)
+		{
+			s->error = TWIRC_ERR_EPOLL_CTL;
+			return -1;
+		}
+	}
+
+	if (s->dns_fd != -1)
+	{
+		eev.data.ptr = &s->dns_watch;
+		eev.events = EPOLLIN;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->dns_fd, &eev) == -1 && errno != EEXIST)
+		{
+			s->error = TWIRC_ERR_EPOLL_CTL;
+			return -1;
+		}
+	}
+
+	// Connect attempts still racing each other, see libtwirc_race_start()
+	for (size_t i = 0; i < TWIRC_CONNECT_ATTEMPTS; ++i)
+	{
+		struct libtwirc_attempt *at = &s->race.attempts[i];
+		if (at->fd == -1)
+		{
+			continue;
+		}
+		eev.data.ptr = &at->watch;
+		eev.events = EPOLLOUT | EPOLLET;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, at->fd, &eev) == -1 && errno != EEXIST)
+		{
+			s->error = TWIRC_ERR_EPOLL_CTL;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Removes the state's socket, timer, resolver eventfd and connect attempts
+ * from the epoll instance epfd. As the
+ * socket might have been closed already, errors are ignored.
+ */
+static void
+libtwirc_unwatch(twirc_state_t *s, int epfd)
+{
+	struct epoll_event eev = { 0 };
+	if (s->socket_fd != -1)
+	{
+		epoll_ctl(epfd, EPOLL_CTL_DEL, s->socket_fd, &eev);
+	}
+	if (s->timer_fd != -1)
+	{
+		epoll_ctl(epfd, EPOLL_CTL_DEL, s->timer_fd, &eev);
+	}
+	if (s->dns_fd != -1)
+	{
+		epoll_ctl(epfd, EPOLL_CTL_DEL, s->dns_fd, &eev);
+	}
+	for (size_t i = 0; i < TWIRC_CONNECT_ATTEMPTS; ++i)
+	{
+		if (s->race.attempts[i].fd != -1)
+		{
+			epoll_ctl(epfd, EPOLL_CTL_DEL, s->race.attempts[i].fd, &eev);
+		}
+	}
+}
+
+/*
+ * Does whatever the state's timer went off for: sends what the rate limits
+ * allow now (if that fails, the socket will let us know about it soon
+ * enough), starts the next connect attempt or reconnects. Returns 0 on 
+ * success, -1 if all connect attempts have failed.
+ */
+static int
+libtwirc_timer(twirc_state_t *s)
+{
+	int res = 0;
+	if (libtwirc_race_pump(s) == -1)
+	{
+		res = libtwirc_race_failed(s);
+	}
+	libtwirc_reconnect_pump(s);
+	libtwirc_handover_pump(s);
+	libtwirc_rate_flush(s);
+	return res;
+}
+
+/*
+ * Handles the epoll event epev, which can belong to any state (so we can 
+ * handle events of many states that share one epoll instance, see pools). 
+ * Returns 0 on success, -1 if the state's connection has been interrupted or
+ * not enough memory was available to process the incoming data.
+ */
+static int
+libtwirc_handle_watch(struct epoll_event *epev)
+{
+	struct libtwirc_watch *w = epev->data.ptr;
+
+	// The state has been removed while we still had events to handle, or
+	// it's a runtime worker's mailbox, which the worker checks by itself
+	if (w == NULL || w->kind == TWIRC_WATCH_WAKE)
+	{
+		return 0;
+	}
+	twirc_state_t *s = w->state;
+
+	// Keep threads of a pipeline from sending while we're at it
+	pthread_mutex_lock(&s->lock);
+	int res = 0;
+
+	// The rate limiter's timer went off
+	if (w->kind == TWIRC_WATCH_TIMER)
+	{
+		uint64_t expirations;
+		if (read(s->timer_fd, &expirations, sizeof(expirations)) > 0)
+		{
+			res = libtwirc_timer(s);
+		}
+	}
+	// One of the connect attempts is done, one way or another
+	else if (w->kind == TWIRC_WATCH_ATTEMPT)
+	{
+		res = libtwirc_race_event(w, epev);
+	}
+	// The host has been resolved, go on to connect
+	else if (w->kind == TWIRC_WATCH_DNS)
+	{
+		res = libtwirc_dns_done(s);
+	}
+	else
+	{
+		res = libtwirc_handle_event(s, epev);
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	// A shadow that failed only ends the handover, the old connection
+	// carries on (and gets reconnected once it goes away)
+	if (res == -1 && s->primary != NULL)
+	{
+		pthread_mutex_lock(&s->primary->lock);
+		libtwirc_handover_drop(s->primary);
+		pthread_mutex_unlock(&s->primary->lock);
+		res = 0;
+	}
+	return res;
+}
+
+/*
+ * Fills sigset with the signals that epoll_pwait() should block, see the 
+ * explanation in twirc_tick().
+ */
+static void
+libtwirc_sigset(sigset_t *sigset)
+{
+	sigemptyset(sigset);
+	sigaddset(sigset, SIGCHLD);  // default: ignore
+	sigaddset(sigset, SIGCONT);  // default: continue execution
+	sigaddset(sigset, SIGURG);   // default: ignore
+	sigaddset(sigset, SIGWINCH); // default: ignore
+}
+
 /*
  * Ininitates an anonymous connection with the given server.
  * The username will be `justinfan` plus a randomly generated numeric suffix.
@@ -1103,50 +1604,94 @@ twirc_connect_anon(twirc_state_t *s, const char *host, const char *port)
 int
 twirc_connect(twirc_state_t *s, const char *host, const char *port, const char *nick, const char *pass)
 {
-	// Create socket
-	s->socket_fd = tcpsock_create(s->ip_type, TCPSOCK_NONBLOCK);
-	if (s->socket_fd < 0)
+	// A connection that was about to take over won't be needed anymore
+	libtwirc_handover_drop(s);
+
+	// Neither will the lookup or connect attempts of an earlier call
+	libtwirc_dns_cancel(s);
+	libtwirc_race_free(s);
+
+	// The TLS session of a connection closed by twirc_disconnect()
+	libtwirc_tls_free(s);
+
+	// Create the eventfd that tells us when the host has been resolved;
+	// the socket will only be created once we know where to connect to
+	if (s->dns_fd == -1)
 	{
-		s->error = TWIRC_ERR_SOCKET_CREATE;
-		return -1;
+		s->dns_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (s->dns_fd == -1)
+		{
+			s->error = TWIRC_ERR_EVENTFD_CREATE;
+			return -1;
+		}
 	}
 
-	// Create epoll instance 
-	s->epfd = epoll_create(1);
-	if (s->epfd < 0)
+	// Create the timer that tells us when rate limited messages can be
+	// sent; we keep it around across connections. An external event loop
+	// handles the timer as well as the socket, so we need neither.
+	if (s->external)
 	{
-		s->error = TWIRC_ERR_EPOLL_CREATE;
-		return -1;
+		s->eof = 0;
 	}
-
-	// Set up the epoll instance
-	struct epoll_event eev = { 0 };
-	eev.data.ptr = s;
-	eev.events = EPOLLRDHUP | EPOLLOUT | EPOLLIN | EPOLLET;
-	int epctl_result = epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->socket_fd, &eev);
-	
-	if (epctl_result)
+	else if (s->timer_fd == -1)
 	{
-		// Socket could not be registered for IO
-		s->error = TWIRC_ERR_EPOLL_CTL;
-		return -1;
+		s->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (s->timer_fd == -1)
+		{
+			s->error = TWIRC_ERR_TIMER_CREATE;
+			return -1;
+		}
 	}
 
-	// Properly initialize the login struct and copy the login data into it
-	s->login.host = strdup(host);
-	s->login.port = strdup(port);
-	s->login.nick = strdup(nick);
-	s->login.pass = strdup(pass);
+	// Create epoll instance, unless we're part of a pool, which has one,
+	// or a shadow, which uses that of the state it's standing in for
+	if (s->pool == NULL && !s->external && s->primary == NULL)
+	{
+		if (s->epfd != -1)
+		{
+			close(s->epfd);
+		}
+		s->epfd = epoll_create(1);
+		if (s->epfd < 0)
+		{
+			s->error = TWIRC_ERR_EPOLL_CREATE;
+			return -1;
+		}
+	}
 
-	// Connect the socket (and handle a possible connection error)
-	if (tcpsock_connect(s->socket_fd, s->ip_type, host, port) == -1)
+	// Set up the epoll instance
+	if (!s->external && libtwirc_watch(s, s->epfd) == -1)
 	{
-		s->error = TWIRC_ERR_SOCKET_CONNECT;
 		return -1;
 	}
 
+	// Properly initialize the login struct and copy the login data into it;
+	// when reconnecting, that's where the data comes from, so copy first
+	char *login_host = strdup(host);
+	char *login_port = strdup(port);
+	char *login_nick = strdup(nick);
+	char *login_pass = strdup(pass);
+	libtwirc_free_login(s);
+	s->login.host = login_host;
+	s->login.port = login_port;
+	s->login.nick = login_nick;
+	s->login.pass = login_pass;
+
+	// Whatever is going on, we're connecting now
+	s->quit = 0;
+	s->reconnect_at = 0;
+
 	// We are in the process of connecting!
 	s->status = TWIRC_STATUS_CONNECTING;
+	s->socket_fd = -1;
+
+	// Resolve the host (in the background, unless it's cached), then
+	// connect the socket (and handle a possible connection error)
+	if (libtwirc_dns_resolve(s, s->login.host, s->login.port) == -1)
+	{
+		s->status = TWIRC_STATUS_DISCONNECTED;
+		return -1;
+	}
 	return 0;
 }
 
@@ -1158,8 +1703,35 @@ twirc_connect(twirc_state_t *s, const char *host, const char *port, const char *
 int
 twirc_disconnect(twirc_state_t *s)
 {
-	// Say bye-bye to the IRC server
+	// Don't come back
+	s->quit = 1;
+	s->reconnect_at = 0;
+	libtwirc_handover_drop(s);
+
+	// Say bye-bye to the IRC server; messages still held back by the rate
+	// limits won't make it out anyway, but the QUIT must not wait behind
+	// them, and neither must whatever is left in the outbound queue
+	libtwirc_rate_clear(s);
 	twirc_cmd_quit(s);
+	libtwirc_flush(s);
+
+	// io_uring holds on to the socket until its requests are cancelled
+	if (s->uring_slot != -1)
+	{
+		libtwirc_uring_cancel(s->pool, s, 0);
+	}
+
+	// An external event loop won't tell us about the socket we closed,
+	// so this is the only chance to call the disconnect event handlers;
+	// the same goes for a state that is still resolving or racing
+	if (s->external || s->dns != NULL || s->race.num > 0)
+	{
+		pthread_mutex_lock(&s->lock);
+		libtwirc_on_disconnect(s);
+		libtwirc_callback(s, s->cbs.disconnect, NULL);
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
 	
 	// Close the socket and return if that worked
 	return tcpsock_close(s->socket_fd);
@@ -1236,6 +1808,9 @@ twirc_init()
 	// Seed the random number generator
 	srand(time(NULL));
 
+	// Pick the fastest way to scan data that the CPU supports
+	libtwirc_scan_init();
+
 	// Init state struct
 	twirc_state_t *s = malloc(sizeof(twirc_state_t));
 	if (s == NULL) { return NULL; } 
@@ -1243,16 +1818,69 @@ twirc_init()
 
 	// Set some defaults / initial values
 	s->status    = TWIRC_STATUS_DISCONNECTED;
-	s->ip_type   = TWIRC_IPV4;
+	s->ip_type   = TWIRC_IPANY;
 	s->socket_fd = -1;
 	s->error     = 0;
+	s->subs      = ~0UL;
+	s->out_max   = TWIRC_QUEUE_MAX;
+	s->timer_fd  = -1;
+	s->dns_fd    = -1;
+	s->epfd      = -1;
+	s->uring_slot = -1;
+
+	// Recursive, as callbacks might send while we're handling events
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&s->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	// Watches tell us what an epoll event is about
+	s->sock_watch.state  = s;
+	s->sock_watch.kind   = TWIRC_WATCH_SOCKET;
+	s->timer_watch.state = s;
+	s->timer_watch.kind  = TWIRC_WATCH_TIMER;
+	s->dns_watch.state   = s;
+	s->dns_watch.kind    = TWIRC_WATCH_DNS;
+	for (size_t i = 0; i < TWIRC_CONNECT_ATTEMPTS; ++i)
+	{
+		s->race.attempts[i].fd = -1;
+		s->race.attempts[i].watch.state = s;
+		s->race.attempts[i].watch.kind  = TWIRC_WATCH_ATTEMPT;
+	}
 	
-	// Initialize the buffer - it will be twice the message size so it can
-	// easily hold an incomplete message in addition to a complete one
-	s->buffer = malloc(2 * TWIRC_MESSAGE_SIZE * sizeof(char));
-	if (s->buffer == NULL) { return NULL; } 
+	// Initialize the buffer - it can hold an incomplete message in addition
+	// to the data of a full recv(), so it usually never needs to grow
+	s->buf_size = TWIRC_MESSAGE_SIZE + TWIRC_BUFFER_SIZE;
+	s->buffer = malloc(s->buf_size * sizeof(char));
+	if (s->buffer == NULL)
+	{
+		pthread_mutex_destroy(&s->lock);
+		free(s);
+		return NULL;
+	}
 	s->buffer[0] = '\0';
 
+	// Initialize the arena that will hold the data of parsed messages
+	if (libtwirc_arena_init(&s->arena, TWIRC_ARENA_SIZE) == -1)
+	{
+		free(s->buffer);
+		pthread_mutex_destroy(&s->lock);
+		free(s);
+		return NULL;
+	}
+
+	// Set up the rate limiter with the default limits
+	if (libtwirc_rate_init(s) == -1)
+	{
+		libtwirc_rate_free(s);
+		libtwirc_arena_free(&s->arena);
+		free(s->buffer);
+		pthread_mutex_destroy(&s->lock);
+		free(s);
+		return NULL;
+	}
+
 	// Make sure the structs within state are zero-initialized
 	memset(&s->login, 0, sizeof(twirc_login_t));
 	memset(&s->cbs,   0, sizeof(twirc_callbacks_t));
@@ -1270,10 +1898,36 @@ twirc_init()
 void
 twirc_free(twirc_state_t *s)
 {
-	close(s->epfd);
+	libtwirc_handover_free(s);
+	libtwirc_race_free(s);
+	libtwirc_tls_free(s);
+	twirc_set_tls(s, 0, NULL);
+	if (s->pool)
+	{
+		twirc_pool_remove(s->pool, s);
+	}
+	if (s->epfd != -1)
+	{
+		close(s->epfd);
+	}
 	libtwirc_free_callbacks(s);
 	libtwirc_free_login(s);
+	libtwirc_arena_free(&s->arena);
 	free(s->buffer);
+	free(s->out);
+	libtwirc_rate_free(s);
+	libtwirc_joins_free(s);
+	libtwirc_chans_free(&s->chans);
+	if (s->timer_fd != -1)
+	{
+		close(s->timer_fd);
+	}
+	libtwirc_dns_cancel(s);
+	if (s->dns_fd != -1)
+	{
+		close(s->dns_fd);
+	}
+	pthread_mutex_destroy(&s->lock);
 	free(s);
 	s = NULL;
 }
@@ -1302,11 +1956,12 @@ twirc_kill(twirc_state_t *s)
  * connection alive. Remember, however, that messages will keep piling up in 
  * the kernel; if your program is handling very busy channels, you might not 
  * want to stay connected without handling those messages for too long. 
+ * States that have been added to a pool are driven by twirc_pool_tick().
  */
 int
 twirc_tick(twirc_state_t *s, int timeout)
 {
-	struct epoll_event epev;
+	struct epoll_event epev[TWIRC_TICK_EVENTS];
 	
 	// epoll_wait()/epoll_pwait() will return -1 if a signal is caught.
 	// User code might catch "harmless" signals, like SIGWINCH, that are
@@ -1319,13 +1974,9 @@ twirc_tick(twirc_state_t *s, int timeout)
 	// https://en.wikipedia.org/wiki/Signal_(IPC)
 	
 	sigset_t sigset;
-	sigemptyset(&sigset);
-	sigaddset(&sigset, SIGCHLD);  // default: ignore
-	sigaddset(&sigset, SIGCONT);  // default: continue execution
-	sigaddset(&sigset, SIGURG);   // default: ignore
-	sigaddset(&sigset, SIGWINCH); // default: ignore
+	libtwirc_sigset(&sigset);
 
-	int num_events = epoll_pwait(s->epfd, &epev, 1, timeout, &sigset);
+	int num_events = epoll_pwait(s->epfd, epev, TWIRC_TICK_EVENTS, timeout, &sigset);
 
 	// An error has occured
 	if (num_events == -1)
@@ -1357,19 +2008,24 @@ twirc_tick(twirc_state_t *s, int timeout)
 		if (twirc_is_connected(s) && tcpsock_status(s->socket_fd) == -1)
 		{
 			// ...if so, call the disconnect event handlers
+			pthread_mutex_lock(&s->lock);
 			libtwirc_on_disconnect(s);
-			s->cbs.disconnect(s, NULL);
+			libtwirc_callback(s, s->cbs.disconnect, NULL);
+			pthread_mutex_unlock(&s->lock);
 		}
 		return -1;
 	}
 	
-	// No events have occured
-	if (num_events == 0)
+	// Handle all events (or none, if none have occured)
+	int ret = 0;
+	for (int i = 0; i < num_events; ++i)
 	{
-		return 0;
+		if (libtwirc_handle_watch(&epev[i]) == -1)
+		{
+			ret = -1;
+		}
 	}
-
-	return libtwirc_handle_event(s, &epev);
+	return ret;
 }
 
 /*
@@ -1387,7 +2043,10 @@ twirc_loop(twirc_state_t *s)
 	// so that we stop running after the connection attempt has been going 
 	// on for so-and-so long. Or shall we leave that up to the user code?
 
-	while (twirc_tick(s, -1) == 0)
+	// A lost connection doesn't end the loop if we're going to reconnect,
+	// but a signal (or any other problem with epoll) still does
+	while (twirc_tick(s, -1) == 0 || (twirc_is_reconnecting(s) &&
+	       s->error != TWIRC_ERR_EPOLL_SIG && s->error != TWIRC_ERR_EPOLL_WAIT))
 	{
 		// Nothing to do here, actually. :-)
 	}
@@ -1,6 +1,8 @@
 #ifndef LIBTWIRC_H
 #define LIBTWIRC_H
 
+#include <stdint.h>     // uint64_t
+
 // Name & Version
 #define TWIRC_NAME "libtwirc"
 #define TWIRC_VER_MAJOR 0
@@ -10,6 +12,7 @@
 // Convenience
 #define TWIRC_IPV4 TCPSOCK_IPV4
 #define TWIRC_IPV6 TCPSOCK_IPV6
+#define TWIRC_IPANY TCPSOCK_IPANY // Both, whatever the host resolves to
 
 // State (bitfield)
 #define TWIRC_STATUS_DISCONNECTED    0
@@ -33,6 +36,12 @@
 #define TWIRC_ERR_CONN_HANGUP      -12 // Connection lost: unexpectedly
 #define TWIRC_ERR_CONN_SOCKET      -13 // Connection lost: socket error
 #define TWIRC_ERR_EPOLL_SIG        -14 // epoll_pwait() caught a signal
+#define TWIRC_ERR_QUEUE_FULL       -15 // Outbound queue at high-water mark
+#define TWIRC_ERR_TIMER_CREATE     -16 // timerfd_create() error
+#define TWIRC_ERR_DNS_RESOLVE      -17 // Host could not be resolved
+#define TWIRC_ERR_TLS_INIT         -18 // TLS unavailable or CA file unusable
+#define TWIRC_ERR_TLS_HANDSHAKE    -19 // TLS handshake failed (certificate?)
+#define TWIRC_ERR_EVENTFD_CREATE   -20 // eventfd() error
 
 // Maybe we should do this, too:
 // https://github.com/shaoner/libircclient/blob/master/include/libirc_rfcnumeric.h
@@ -46,11 +55,16 @@
 // of the message, which can often result in messages that easily exceed the 
 // 1024 bytes length limit as described by the IRCv3 spec. According to some 
 // tests, we should be fine with doubling that to 2048. Note that the internal
-// buffer of the twirc_state struct will use a buffer that is twice as big as
-// TWIRC_MESSAGE_SIZE in order to be able to accomodate parts of an incomplete
-// message in addition to a complete one.
+// buffer of the twirc_state struct will be TWIRC_MESSAGE_SIZE plus 
+// TWIRC_BUFFER_SIZE bytes in order to be able to accomodate parts of an 
+// incomplete message in addition to the data of a full recv().
 #define TWIRC_MESSAGE_SIZE 2048
 
+// Messages that are larger than TWIRC_MESSAGE_SIZE can still be received, as
+// the internal buffer will grow to fit them. However, a message larger than 
+// this means something is seriously off, and it will be dropped instead.
+#define TWIRC_MESSAGE_MAX (32 * TWIRC_MESSAGE_SIZE)
+
 // The buffer size will be used for retrieving network data via recv(), which 
 // means it could be very small (say, 256 bytes), as we call recv() in a loop
 // until all data has been retrieved and processed. However, this will also 
@@ -60,6 +74,12 @@
 // we can assure that we will be able to process an entire message in one go.
 #define TWIRC_BUFFER_SIZE TWIRC_MESSAGE_SIZE
 
+// Outgoing messages are queued until the socket is ready to take them. Once
+// this many bytes are waiting in the queue, further messages will be refused
+// (with TWIRC_ERR_QUEUE_FULL) instead of being queued, so that a runaway 
+// sender can't eat up all memory. Can be changed with twirc_set_queue_max().
+#define TWIRC_QUEUE_MAX (64 * TWIRC_MESSAGE_SIZE)
+
 // The prefix is an optional part of every IRC message retrieved from a server.
 // As such, it can never exceed or even reach the size of a message itself.
 // Usually, the prefix is a rather short string, based upon the length of the 
@@ -86,6 +106,13 @@
 // https://www.reddit.com/r/Twitch/comments/32w5b2/username_requirements/
 #define TWIRC_NICK_SIZE 32
 
+// Initial size of the arena, the memory that parsed messages are stored in.
+// It has to hold a copy of the message plus the tag and parameter arrays, as 
+// well as some bits extracted from it (like the nick). Hence, twice the size
+// of a message should be enough for most messages. If it isn't, the arena 
+// will grow, so this only matters for the number of allocations we'll see.
+#define TWIRC_ARENA_SIZE (2 * TWIRC_MESSAGE_SIZE)
+
 // The number of expected tags in an IRC message. This will be used to allocate 
 // memory for the tags. If this number is smaller than the actual number of 
 // tags in a message, realloc() will be used to allocate more memory. In other 
@@ -104,6 +131,121 @@
 // http://www.networksorcery.com/enp/protocol/irc.htm
 #define TWIRC_NUM_PARAMS 4
 
+// Initial number of slots of the channel table, which holds what we know 
+// about channels (like whether we're a moderator there). It will grow as 
+// needed. Has to be a power of two.
+#define TWIRC_NUM_CHANS 16
+
+// Rate limits, see twirc_set_rate_limit(). Twitch limits how many messages 
+// an account may send within a certain time; accounts that exceed the limits
+// will be muted for 30 minutes. Hence, outgoing messages are held back until
+// sending them won't exceed any of these limits. By default, the limits are
+// those of regular accounts: 20 messages per 30 seconds (CHAT), 100 messages 
+// per 30 seconds in channels where we're a moderator or the broadcaster (MOD),
+// 20 channels joined per 10 seconds (JOIN) and whispers to 3 per second 
+// (WHISPER) as well as 100 per minute (WHISPER_MIN).
+#define TWIRC_RATE_CHAT         0
+#define TWIRC_RATE_MOD          1
+#define TWIRC_RATE_JOIN         2
+#define TWIRC_RATE_WHISPER      3
+#define TWIRC_RATE_WHISPER_MIN  4
+#define TWIRC_RATE_COUNT        5
+
+// The bulk join planner (see twirc_cmd_join_list()) puts as many channels
+// into one JOIN as fit into a message of this size (without "\r\n"). 
+#define TWIRC_JOIN_LINE 510
+
+// Joins that haven't been confirmed by the server within this many ms will 
+// be reported as failed (TWIRC_JOIN_TIMEDOUT) by the bulk join planner.
+#define TWIRC_JOIN_TIMEOUT 10000
+
+// If the bulk join planner couldn't send a JOIN (because the outbound queue
+// was full, for example), it tries again after this many ms.
+#define TWIRC_JOIN_RETRY 1000
+
+// Addresses that host names have been resolved to are cached (and shared by
+// all states) for this many ms, so that reconnecting many states at once will
+// only take a single lookup. getaddrinfo() doesn't tell us the records' TTL.
+#define TWIRC_DNS_TTL 300000
+
+// When the host resolves to several addresses, we try to connect to them in
+// turn (alternating between IPv6 and IPv4), but start the next attempt after
+// this many ms, while the previous ones are still in progress; whichever
+// connects first wins (see RFC 8305, "Happy Eyeballs").
+#define TWIRC_CONNECT_DELAY 250
+
+// Maximum number of connect attempts in progress at once
+#define TWIRC_CONNECT_ATTEMPTS 4
+
+// Delays between automatic reconnects, if enabled with twirc_set_reconnect():
+// the first attempt will be made within TWIRC_RECONNECT_MIN ms, then the delay
+// doubles with every failed attempt, up to TWIRC_RECONNECT_MAX ms.
+#define TWIRC_RECONNECT_MIN 1000
+#define TWIRC_RECONNECT_MAX 60000
+
+// When taking over from a connection that the server wants to close (see
+// twirc_set_handover()), messages are deduplicated by their id for this many
+// ms after the switch, by remembering the last TWIRC_HANDOVER_IDS ids (must
+// be a power of two).
+#define TWIRC_HANDOVER_GRACE 10000
+#define TWIRC_HANDOVER_IDS 4096
+
+// Directions of a TLS connection that the kernel encrypts (kTLS), as returned
+// by twirc_get_ktls()
+#define TWIRC_KTLS_TX 1
+#define TWIRC_KTLS_RX 2
+
+// Buckets of a histogram (see twirc_hist_t): values below TWIRC_HIST_SUB get
+// a bucket each, then every power of two is split into TWIRC_HIST_SUB more,
+// so that values are off by at most 1/TWIRC_HIST_SUB. The last bucket takes
+// everything that doesn't fit otherwise (about 17 s, for nanoseconds).
+#define TWIRC_HIST_SUB 8
+#define TWIRC_HIST_BUCKETS 256
+
+// The latency histograms of twirc_stats_t are rolling: they only cover what
+// happened within the current window of this many ms and the one before it,
+// so that a burst doesn't drown in hours of history.
+#define TWIRC_STATS_WINDOW 60000
+
+// Results of joining a channel, as reported by the bulk join planner
+#define TWIRC_JOIN_OK           0 // Joined the channel
+#define TWIRC_JOIN_FAILED       1 // Server sent a NOTICE instead
+#define TWIRC_JOIN_TIMEDOUT     2 // Server didn't confirm in time
+
+// Maximum number of epoll events handled per call of twirc_tick(); every
+// state has a socket, a timer, an eventfd for host lookups and up to
+// TWIRC_CONNECT_ATTEMPTS sockets racing to connect, and during a handover
+// its shadow has all of those as well. More events would be picked up by the
+// next call, but this way one call gets them all.
+#define TWIRC_TICK_EVENTS (2 * (3 + TWIRC_CONNECT_ATTEMPTS))
+
+// Maximum number of epoll events handled per call of twirc_pool_tick(). 
+// More events will simply be picked up by the next call.
+#define TWIRC_POOL_EVENTS 64
+
+// Size of the submission queue of a pool that uses io_uring, see
+// twirc_pool_use_uring(). More requests than this per tick are fine.
+#define TWIRC_URING_ENTRIES 256
+
+// Number of buffers (of TWIRC_BUFFER_SIZE bytes each) that a pool using 
+// io_uring provides for the kernel to receive data into. They are shared by
+// all states of the pool and handed back as soon as their data has been 
+// copied. Must be a power of two.
+#define TWIRC_URING_BUFS 512
+
+// Number of events a pipeline can hold, unless told otherwise; see
+// twirc_pipeline_init().
+#define TWIRC_PIPELINE_SIZE 4096
+
+// What a pipeline does with events that come in while it is full
+#define TWIRC_OVERFLOW_DROP_NEWEST 0 // Drop the event that came in
+#define TWIRC_OVERFLOW_DROP_OLDEST 1 // Drop the oldest waiting event
+#define TWIRC_OVERFLOW_INLINE      2 // Call the callback right away
+
+// What a state driven by an external event loop needs its socket watched for
+#define TWIRC_WANT_READ  1
+#define TWIRC_WANT_WRITE 2
+
 // If you want to connect to Twitch IRC anonymously, which means you'll be able
 // to read chat but not participate, then you need to use the special username 
 // "justinfan<randomnumber>", which seems to be a relic from the JustinTV days.
@@ -113,6 +255,91 @@
 // anonymous username (TWIRC_USER_ANON)
 #define TWIRC_USER_ANON_MAX_DIGITS 7
 
+// IDs of the commands we know of. The command of every event is classified
+// once, while parsing, and stored in the event's command_id member, so that
+// there is no need to compare the command string against string literals.
+#define TWIRC_CMD_OTHER            0 // Everything we don't know of
+#define TWIRC_CMD_PRIVMSG          1
+#define TWIRC_CMD_JOIN             2
+#define TWIRC_CMD_PART             3
+#define TWIRC_CMD_CLEARCHAT        4
+#define TWIRC_CMD_CLEARMSG         5
+#define TWIRC_CMD_NOTICE           6
+#define TWIRC_CMD_ROOMSTATE        7
+#define TWIRC_CMD_USERSTATE        8
+#define TWIRC_CMD_USERNOTICE       9
+#define TWIRC_CMD_WHISPER         10
+#define TWIRC_CMD_PING            11
+#define TWIRC_CMD_PONG            12
+#define TWIRC_CMD_MODE            13
+#define TWIRC_CMD_NAMREPLY        14 // 353
+#define TWIRC_CMD_ENDOFNAMES      15 // 366
+#define TWIRC_CMD_HOSTTARGET      16
+#define TWIRC_CMD_CAP             17
+#define TWIRC_CMD_WELCOME         18 // 001
+#define TWIRC_CMD_GLOBALUSERSTATE 19
+#define TWIRC_CMD_UNKNOWNCMD      20 // 421
+#define TWIRC_CMD_RECONNECT       21
+#define TWIRC_CMD_COUNT           22
+
+// IDs of well-known tags, as sent by Twitch. When parsing the tags of an 
+// event, we remember where these can be found, so that they can be looked 
+// up by ID (see twirc_get_tag_id()) without having to compare any strings.
+// Tags that aren't listed here can still be looked up with twirc_get_tag().
+#define TWIRC_TAG_BADGE_INFO                       0
+#define TWIRC_TAG_BADGES                           1
+#define TWIRC_TAG_BAN_DURATION                     2
+#define TWIRC_TAG_BITS                             3
+#define TWIRC_TAG_BROADCASTER_LANG                 4
+#define TWIRC_TAG_CLIENT_NONCE                     5
+#define TWIRC_TAG_COLOR                            6
+#define TWIRC_TAG_DISPLAY_NAME                     7
+#define TWIRC_TAG_EMOTE_ONLY                       8
+#define TWIRC_TAG_EMOTE_SETS                       9
+#define TWIRC_TAG_EMOTES                           10
+#define TWIRC_TAG_FIRST_MSG                        11
+#define TWIRC_TAG_FLAGS                            12
+#define TWIRC_TAG_FOLLOWERS_ONLY                   13
+#define TWIRC_TAG_ID                               14
+#define TWIRC_TAG_LOGIN                            15
+#define TWIRC_TAG_MESSAGE_ID                       16
+#define TWIRC_TAG_MOD                              17
+#define TWIRC_TAG_MSG_ID                           18
+#define TWIRC_TAG_MSG_PARAM_CUMULATIVE_MONTHS      19
+#define TWIRC_TAG_MSG_PARAM_DISPLAYNAME            20
+#define TWIRC_TAG_MSG_PARAM_LOGIN                  21
+#define TWIRC_TAG_MSG_PARAM_MONTHS                 22
+#define TWIRC_TAG_MSG_PARAM_RECIPIENT_DISPLAY_NAME 23
+#define TWIRC_TAG_MSG_PARAM_RECIPIENT_ID           24
+#define TWIRC_TAG_MSG_PARAM_RECIPIENT_USER_NAME    25
+#define TWIRC_TAG_MSG_PARAM_RITUAL_NAME            26
+#define TWIRC_TAG_MSG_PARAM_SHOULD_SHARE_STREAK    27
+#define TWIRC_TAG_MSG_PARAM_STREAK_MONTHS          28
+#define TWIRC_TAG_MSG_PARAM_SUB_PLAN               29
+#define TWIRC_TAG_MSG_PARAM_SUB_PLAN_NAME          30
+#define TWIRC_TAG_MSG_PARAM_VIEWERCOUNT            31
+#define TWIRC_TAG_R9K                              32
+#define TWIRC_TAG_REPLY_PARENT_DISPLAY_NAME        33
+#define TWIRC_TAG_REPLY_PARENT_MSG_BODY            34
+#define TWIRC_TAG_REPLY_PARENT_MSG_ID              35
+#define TWIRC_TAG_REPLY_PARENT_USER_ID             36
+#define TWIRC_TAG_REPLY_PARENT_USER_LOGIN          37
+#define TWIRC_TAG_RETURNING_CHATTER                38
+#define TWIRC_TAG_ROOM_ID                          39
+#define TWIRC_TAG_SLOW                             40
+#define TWIRC_TAG_SUBS_ONLY                        41
+#define TWIRC_TAG_SUBSCRIBER                       42
+#define TWIRC_TAG_SYSTEM_MSG                       43
+#define TWIRC_TAG_TARGET_MSG_ID                    44
+#define TWIRC_TAG_TARGET_USER_ID                   45
+#define TWIRC_TAG_THREAD_ID                        46
+#define TWIRC_TAG_TMI_SENT_TS                      47
+#define TWIRC_TAG_TURBO                            48
+#define TWIRC_TAG_USER_ID                          49
+#define TWIRC_TAG_USER_TYPE                        50
+#define TWIRC_TAG_VIP                              51
+#define TWIRC_TAG_COUNT                            52
+
 /*
  * Structures
  */
@@ -120,14 +347,26 @@
 struct twirc_state;
 struct twirc_event;
 struct twirc_callbacks;
+struct twirc_pool;
+struct twirc_runtime;
+struct twirc_pipeline;
 struct twirc_login;
 struct twirc_tag;
+struct twirc_socket_opts;
+struct twirc_hist;
+struct twirc_stats;
 
 typedef struct twirc_event twirc_event_t;
 typedef struct twirc_login twirc_login_t;
 typedef struct twirc_tag twirc_tag_t;
 typedef struct twirc_state twirc_state_t;
 typedef struct twirc_callbacks twirc_callbacks_t;
+typedef struct twirc_pool twirc_pool_t;
+typedef struct twirc_runtime twirc_runtime_t;
+typedef struct twirc_pipeline twirc_pipeline_t;
+typedef struct twirc_socket_opts twirc_socket_opts_t;
+typedef struct twirc_hist twirc_hist_t;
+typedef struct twirc_stats twirc_stats_t;
 
 struct twirc_login
 {
@@ -148,24 +387,82 @@ struct twirc_tag
 struct twirc_event
 {
 	// Raw data
-	char *raw;                         // The raw message as received
+	char *raw;                         // The raw message (NULL: zero-copy)
 	// Separated raw data
 	char *prefix;                      // IRC message prefix
 	char *command;                     // IRC message command
+	int command_id;                    // Command as TWIRC_CMD_* constant
 	char **params;                     // IRC message parameter
 	size_t num_params;                 // Number of elements in params
 	int trailing;                      // Index of the trailing param
 	twirc_tag_t **tags;                // IRC message tags
 	size_t num_tags;                   // Number of elements in tags
+	unsigned char tag_index[TWIRC_TAG_COUNT]; // Well-known tags (index + 1)
 	// For convenience
 	char *origin;                      // Nick as extracted from prefix
 	char *channel;                     // Channel as extracted from params
 	char *target;                      // Target user of hosts, bans, etc.
 	char *message;                     // Message as extracted from params
 	char *ctcp;                        // CTCP commmand, if any
+	uint64_t recv_ns;                  // When received (CLOCK_MONOTONIC, ns)
+	// Internal
+	twirc_state_t *state;              // State the event belongs to
+	char *tag_block;                   // Tags not split yet (lazy tags)
+	unsigned char *tag_escaped;        // Values not unescaped yet (lazy)
+	twirc_tag_t **tag_list;            // Split tags, even if not in tags yet
+};
+
+// Options set on the state's sockets, see twirc_set_socket_opts(); 0 leaves
+// an option at the system's default
+struct twirc_socket_opts
+{
+	int rcvbuf;                        // SO_RCVBUF: receive buffer (bytes)
+	int sndbuf;                        // SO_SNDBUF: send buffer (bytes)
+	int nodelay;                       // TCP_NODELAY: 1 to disable Nagle
+	int quickack;                      // TCP_QUICKACK: 1 to ACK right away
+	int keepalive;                     // SO_KEEPALIVE: 1 to send keepalives
+	int keepidle;                      // TCP_KEEPIDLE: idle time before (s)
+	int keepintvl;                     // TCP_KEEPINTVL: between probes (s)
+	int keepcnt;                       // TCP_KEEPCNT: probes before giving up
+	int busy_poll;                     // SO_BUSY_POLL: busy poll for (us)
+	int user_timeout;                  // TCP_USER_TIMEOUT: unacked data (ms)
+	int timestamps;                    // SO_TIMESTAMPNS: 1 for kernel stamps
+};
+
+// Histogram of durations, see TWIRC_HIST_BUCKETS and twirc_hist_percentile()
+struct twirc_hist
+{
+	uint64_t count;                    // Number of values
+	uint64_t sum;                      // Sum of all values
+	uint64_t max;                      // Biggest value
+	uint64_t buckets[TWIRC_HIST_BUCKETS]; // Number of values per bucket
+};
+
+// What a state has been up to, see twirc_get_stats()
+struct twirc_stats
+{
+	uint64_t bytes_recv;               // Bytes received
+	uint64_t bytes_sent;               // Bytes sent
+	uint64_t msgs_recv;                // Messages received
+	uint64_t msgs_sent;                // Messages queued for sending
+	uint64_t msgs_dropped;             // Received, but no one was interested
+	uint64_t msgs_parsed;              // Parsed (received or sent)
+	uint64_t recvs;                    // Reads from the socket (or io_uring)
+	uint64_t sends;                    // Writes to the socket (or io_uring)
+	uint64_t commands[TWIRC_CMD_COUNT + 1]; // Events per TWIRC_CMD_*, CTCP last
+	uint64_t allocs;                   // Allocations while parsing
+	size_t buf_high;                   // Most data in the inbound buffer
+	size_t out_high;                   // Most data in the outbound queue
+	twirc_hist_t parse_ns;             // Time to parse a message (ns)
+	twirc_hist_t callback_ns;          // Time spent in a callback (ns)
+	twirc_hist_t recv_to_cb_ns;        // From receiving to callback (rolling)
+	twirc_hist_t sent_to_cb_ns;        // From tmi-sent-ts to callback (rolling)
+	uint64_t clock_skewed;             // tmi-sent-ts was ahead of our clock
 };
 
 typedef void (*twirc_callback)(twirc_state_t *s, twirc_event_t *e);
+typedef void (*twirc_join_callback)(twirc_state_t *s, const char *chan, int result, size_t done, size_t total);
+typedef void (*twirc_interest_callback)(twirc_state_t *s, int fd, int interest, int timeout);
 
 struct twirc_callbacks
 {
@@ -221,6 +518,9 @@ twirc_login_t *twirc_get_login(twirc_state_t *s);
 twirc_tag_t   *twirc_get_tag_by_key(twirc_tag_t **tags, const char *key); // deprecated
 twirc_tag_t   *twirc_get_tag(twirc_tag_t **tags, const char *key);
 char const    *twirc_get_tag_value(twirc_tag_t **tags, const char *key);
+twirc_tag_t  **twirc_get_tags(twirc_event_t *evt);
+twirc_tag_t   *twirc_get_tag_id(twirc_event_t *evt, int id);
+char const    *twirc_get_tag_id_value(twirc_event_t *evt, int id);
 int            twirc_get_last_error(const twirc_state_t *s);
 
 // Twitc state status inforamtion
@@ -228,6 +528,74 @@ int twirc_is_connecting(const twirc_state_t *s);
 int twirc_is_logging_in(const twirc_state_t *s);
 int twirc_is_connected(const twirc_state_t *s);
 int twirc_is_logged_in(const twirc_state_t *s);
+int twirc_is_reconnecting(const twirc_state_t *s);
+
+// Parsing options
+void twirc_set_lazy_tags(twirc_state_t *s, int lazy);
+void twirc_set_zero_copy(twirc_state_t *s, int zero_copy);
+
+// Connection options
+void twirc_set_ip_type(twirc_state_t *s, int ip_type);
+void twirc_set_reconnect(twirc_state_t *s, unsigned min, unsigned max);
+void twirc_set_handover(twirc_state_t *s, int handover);
+
+// TLS encryption
+int twirc_set_tls(twirc_state_t *s, int tls, const char *ca_file);
+int twirc_get_ktls(const twirc_state_t *s);
+
+// Socket options
+void twirc_set_socket_opts(twirc_state_t *s, const twirc_socket_opts_t *opts);
+int  twirc_get_socket_opts(const twirc_state_t *s, twirc_socket_opts_t *opts);
+
+// Outbound queue
+void   twirc_set_queue_max(twirc_state_t *s, size_t max);
+size_t twirc_get_queue_len(const twirc_state_t *s);
+
+// Statistics
+int      twirc_get_stats(twirc_state_t *s, twirc_stats_t *stats);
+void     twirc_reset_stats(twirc_state_t *s);
+uint64_t twirc_hist_percentile(const twirc_hist_t *h, double p);
+
+// Pools of states sharing one epoll instance
+twirc_pool_t *twirc_pool_init();
+int  twirc_pool_add(twirc_pool_t *p, twirc_state_t *s);
+int  twirc_pool_remove(twirc_pool_t *p, twirc_state_t *s);
+int  twirc_pool_tick(twirc_pool_t *p, int timeout);
+int  twirc_pool_loop(twirc_pool_t *p);
+void twirc_pool_free(twirc_pool_t *p);
+int  twirc_pool_use_uring(twirc_pool_t *p);
+
+// Multi-threaded runtime, channels spread over worker threads
+twirc_runtime_t *twirc_runtime_init(int num_workers, int num_conns, const twirc_callbacks_t *cbs, void *ctx);
+int  twirc_runtime_start(twirc_runtime_t *rt, const char *host, const char *port, const char *nick, const char *pass);
+int  twirc_runtime_join(twirc_runtime_t *rt, const char *chan);
+int  twirc_runtime_part(twirc_runtime_t *rt, const char *chan);
+int  twirc_runtime_stop(twirc_runtime_t *rt);
+void twirc_runtime_free(twirc_runtime_t *rt);
+
+// Pipelines, calling callbacks on consumer threads
+twirc_pipeline_t *twirc_pipeline_init(size_t size, int num_threads, int policy);
+void   twirc_set_pipeline(twirc_state_t *s, twirc_pipeline_t *p);
+size_t twirc_pipeline_get_depth(twirc_pipeline_t *p);
+size_t twirc_pipeline_get_max_depth(twirc_pipeline_t *p);
+size_t twirc_pipeline_get_pushed(twirc_pipeline_t *p);
+size_t twirc_pipeline_get_dropped(twirc_pipeline_t *p);
+void   twirc_pipeline_free(twirc_pipeline_t *p);
+
+// External event loops (libuv, libev, ...)
+void twirc_set_external(twirc_state_t *s, twirc_interest_callback cb);
+int  twirc_get_fd(const twirc_state_t *s);
+int  twirc_get_interest(const twirc_state_t *s);
+int  twirc_get_timeout(const twirc_state_t *s);
+int  twirc_on_readable(twirc_state_t *s);
+int  twirc_on_writable(twirc_state_t *s);
+int  twirc_on_timer(twirc_state_t *s);
+
+// Resolver cache, shared by all states
+void twirc_dns_clear();
+
+// Rate limiting
+int    twirc_set_rate_limit(twirc_state_t *s, int bucket, unsigned limit, unsigned period);
 
 // Custom user-data
 void  twirc_set_context(twirc_state_t *s, void *ctx);
@@ -238,6 +606,7 @@ int twirc_cmd_raw(twirc_state_t *s, const char *msg);
 int twirc_cmd_pass(twirc_state_t *s, const char *pass);
 int twirc_cmd_nick(twirc_state_t *s, const char *nick);
 int twirc_cmd_join(twirc_state_t *s, const char *chan);
+int twirc_cmd_join_list(twirc_state_t *s, const char **chans, size_t num, twirc_join_callback cb);
 int twirc_cmd_part(twirc_state_t *s, const char *chan);
 int twirc_cmd_ping(twirc_state_t *s, const char *param);
 int twirc_cmd_pong(twirc_state_t *s, const char *param);
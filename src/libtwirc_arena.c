@@ -0,0 +1,158 @@
+#include <stdlib.h>     // NULL, malloc(), realloc(), free()
+#include <string.h>     // memcpy()
+#include "libtwirc_internal.h"
+
+/*
+ * The arena is a simple bump allocator that serves all memory needed while
+ * parsing and dispatching a message. Allocating means moving an offset, and
+ * everything allocated since a mark can be dropped at once by releasing that
+ * mark, which only resets the offset again. If a chunk runs out of space, a
+ * new, bigger chunk is put on top of it; memory that has been handed out is
+ * therefore never moved. Once we're back to the bottom of the arena, chunks
+ * are merged into one, so that the arena settles on a single chunk that is
+ * big enough for the messages we usually see.
+ */
+
+/*
+ * Rounds len up to the next multiple of the arena's alignment.
+ */
+static inline size_t
+libtwirc_arena_align(size_t len)
+{
+	return (len + (TWIRC_ARENA_ALIGN - 1)) & ~((size_t) TWIRC_ARENA_ALIGN - 1);
+}
+
+/*
+ * Allocates a new chunk that can hold at least size bytes and puts it on top
+ * of the arena. Returns 0 on success, -1 if we ran out of memory.
+ */
+static int
+libtwirc_arena_push(struct libtwirc_arena *a, size_t size)
+{
+	struct libtwirc_chunk *chunk = malloc(sizeof(struct libtwirc_chunk) + size);
+	if (chunk == NULL)
+	{
+		return -1;
+	}
+
+	chunk->prev = a->head;
+	chunk->size = size;
+	chunk->used = 0;
+	a->head = chunk;
+	a->pushes += 1;
+	return 0;
+}
+
+/*
+ * Initializes the arena with a single chunk of the given size.
+ * Returns 0 on success, -1 if we ran out of memory.
+ */
+static int
+libtwirc_arena_init(struct libtwirc_arena *a, size_t size)
+{
+	a->head = NULL;
+	return libtwirc_arena_push(a, libtwirc_arena_align(size));
+}
+
+/*
+ * Returns a pointer to len bytes of (uninitialized) memory from the arena or
+ * NULL if we ran out of memory. The memory stays valid until the arena is
+ * released to a mark that has been taken before this allocation was made.
+ */
+static void*
+libtwirc_arena_alloc(struct libtwirc_arena *a, size_t len)
+{
+	len = libtwirc_arena_align(len);
+
+	// Not enough space left in the current chunk, get a new one that
+	// is at least twice the size of the current one
+	if (a->head == NULL || a->head->size - a->head->used < len)
+	{
+		size_t size = a->head ? 2 * a->head->size : TWIRC_ARENA_SIZE;
+		if (libtwirc_arena_push(a, size < len ? 2 * len : size) == -1)
+		{
+			return NULL;
+		}
+	}
+
+	void *ptr = a->head->data + a->head->used;
+	a->head->used += len;
+	return ptr;
+}
+
+/*
+ * Copies len bytes of str into the arena and null terminates the copy.
+ * Returns a pointer to the copy or NULL if we ran out of memory.
+ */
+static char*
+libtwirc_arena_strndup(struct libtwirc_arena *a, const char *str, size_t len)
+{
+	char *dup = libtwirc_arena_alloc(a, len + 1);
+	if (dup == NULL)
+	{
+		return NULL;
+	}
+	memcpy(dup, str, len);
+	dup[len] = '\0';
+	return dup;
+}
+
+/*
+ * Returns a mark that represents the current fill level of the arena.
+ */
+static struct libtwirc_mark
+libtwirc_arena_mark(struct libtwirc_arena *a)
+{
+	struct libtwirc_mark mark = { a->head, a->head ? a->head->used : 0 };
+	return mark;
+}
+
+/*
+ * Releases everything that has been allocated from the arena since the mark
+ * was taken. Usually, this just resets the fill level of the current chunk.
+ * If additional chunks have been added in the meantime, they are free'd. If
+ * that leaves us with an empty arena, the bottom chunk will be grown so that
+ * it can hold all of that data next time.
+ */
+static void
+libtwirc_arena_release(struct libtwirc_arena *a, struct libtwirc_mark mark)
+{
+	size_t dropped = 0;
+	while (a->head != mark.chunk)
+	{
+		struct libtwirc_chunk *prev = a->head->prev;
+		dropped += a->head->size;
+		free(a->head);
+		a->head = prev;
+	}
+
+	if (a->head == NULL)
+	{
+		return;
+	}
+	a->head->used = mark.used;
+
+	// Nothing in use anymore, so we can grow the chunk without having to
+	// worry about any pointers to its data; if this fails, no big deal
+	if (dropped && mark.used == 0 && a->head->prev == NULL)
+	{
+		size_t size = a->head->size + dropped;
+		struct libtwirc_chunk *grown =
+			realloc(a->head, sizeof(struct libtwirc_chunk) + size);
+		if (grown != NULL)
+		{
+			grown->size = size;
+			a->head = grown;
+		}
+	}
+}
+
+/*
+ * Frees all chunks of the arena.
+ */
+static void
+libtwirc_arena_free(struct libtwirc_arena *a)
+{
+	struct libtwirc_mark bottom = { NULL, 0 };
+	libtwirc_arena_release(a, bottom);
+}
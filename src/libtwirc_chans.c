@@ -0,0 +1,147 @@
+#include <stdlib.h>     // NULL, malloc(), calloc(), free()
+#include <string.h>     // memcpy()
+#include <strings.h>    // strncasecmp()
+#include <ctype.h>      // tolower()
+#include "libtwirc_internal.h"
+
+/*
+ * The channel table keeps track of what we know about the channels we're
+ * dealing with (for example, whether we're a moderator there). It is a hash
+ * table with open addressing (linear probing), keyed by the channel name,
+ * including the leading '#'. Channel names are compared case-insensitively,
+ * as that's how Twitch treats them. Entries are never removed, which keeps
+ * probing simple; the number of channels a bot deals with is bounded anyway.
+ */
+
+/*
+ * Returns the hash (FNV-1a) of the lowercase version of name, which is len
+ * bytes long.
+ */
+static size_t
+libtwirc_chan_hash(const char *name, size_t len)
+{
+	size_t hash = 2166136261u;
+	for (size_t i = 0; i < len; ++i)
+	{
+		hash ^= (unsigned char) tolower((unsigned char) name[i]);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Returns 1 if the entry chan holds the channel name (len bytes long).
+ */
+static int
+libtwirc_chan_match(const struct libtwirc_chan *chan, const char *name, size_t len)
+{
+	return chan->len == len && strncasecmp(chan->name, name, len) == 0;
+}
+
+/*
+ * Doubles the size of the table and moves all entries over.
+ * Returns 0 on success, -1 if we ran out of memory.
+ */
+static int
+libtwirc_chans_grow(struct libtwirc_chans *t)
+{
+	size_t size = t->size ? 2 * t->size : TWIRC_NUM_CHANS;
+	struct libtwirc_chan *slots = calloc(size, sizeof(struct libtwirc_chan));
+	if (slots == NULL)
+	{
+		return -1;
+	}
+
+	for (size_t i = 0; i < t->size; ++i)
+	{
+		if (t->slots[i].name == NULL)
+		{
+			continue;
+		}
+		size_t j = libtwirc_chan_hash(t->slots[i].name, t->slots[i].len) & (size - 1);
+		while (slots[j].name != NULL)
+		{
+			j = (j + 1) & (size - 1);
+		}
+		slots[j] = t->slots[i];
+	}
+
+	free(t->slots);
+	t->slots = slots;
+	t->size  = size;
+	return 0;
+}
+
+/*
+ * Looks up the channel name (len bytes long, doesn't need to be terminated)
+ * in the table. If it isn't in there yet and create is set, it will be added
+ * with no flags set. Returns a pointer to the entry, which stays valid until
+ * the next entry is added, or NULL if the channel wasn't found (or we ran out
+ * of memory trying to add it).
+ */
+static struct libtwirc_chan*
+libtwirc_chans_find(struct libtwirc_chans *t, const char *name, size_t len, int create)
+{
+	size_t i = 0;
+	if (t->size)
+	{
+		i = libtwirc_chan_hash(name, len) & (t->size - 1);
+		while (t->slots[i].name != NULL)
+		{
+			if (libtwirc_chan_match(&t->slots[i], name, len))
+			{
+				return &t->slots[i];
+			}
+			i = (i + 1) & (t->size - 1);
+		}
+	}
+
+	if (!create)
+	{
+		return NULL;
+	}
+
+	// Keep the load factor below 3/4, so that probing stays cheap
+	if (4 * (t->used + 1) > 3 * t->size)
+	{
+		if (libtwirc_chans_grow(t) == -1)
+		{
+			return NULL;
+		}
+		i = libtwirc_chan_hash(name, len) & (t->size - 1);
+		while (t->slots[i].name != NULL)
+		{
+			i = (i + 1) & (t->size - 1);
+		}
+	}
+
+	char *dup = malloc(len + 1);
+	if (dup == NULL)
+	{
+		return NULL;
+	}
+	memcpy(dup, name, len);
+	dup[len] = '\0';
+
+	t->slots[i].name  = dup;
+	t->slots[i].len   = len;
+	t->slots[i].flags = 0;
+	t->used += 1;
+	return &t->slots[i];
+}
+
+/*
+ * Frees all entries of the table, as well as the table itself.
+ */
+static void
+libtwirc_chans_free(struct libtwirc_chans *t)
+{
+	for (size_t i = 0; i < t->size; ++i)
+	{
+		free(t->slots[i].name);
+	}
+	free(t->slots);
+	t->slots = NULL;
+	t->size  = 0;
+	t->used  = 0;
+}
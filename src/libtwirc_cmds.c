@@ -51,6 +51,35 @@ twirc_cmd_join(twirc_state_t *state, const char *chan)
 	return libtwirc_send(state, msg);
 }
 
+/*
+ * Request to join all num channels in chans, which is meant for joining a lot
+ * of channels at once. Channels will be joined in batches, as many at once as
+ * fit into one JOIN command, and only as fast as the JOIN rate limit allows.
+ * For every channel, cb (which can be NULL) will be called once the server 
+ * has confirmed the join (TWIRC_JOIN_OK) or once it failed (TWIRC_JOIN_FAILED
+ * or TWIRC_JOIN_TIMEDOUT), together with the number of channels done so far
+ * and the total number of channels. If this is called while channels from a
+ * previous call are still being joined, they will be added to that list and
+ * the new callback will be used from now on. The list of channels will be 
+ * copied, so it doesn't need to stay around. If the connection is lost, all
+ * channels that haven't been joined yet will be reported as failed, unless
+ * we're going to reconnect (see twirc_set_reconnect()), in which case they
+ * will be joined along with the channels we're rejoining.
+ * Returns 0 if the channels have been added successfully, -1 on error.
+ */
+int
+twirc_cmd_join_list(twirc_state_t *state, const char **chans, size_t num, twirc_join_callback cb)
+{
+	pthread_mutex_lock(&state->lock);
+	int res = libtwirc_joins_add(state, chans, num, cb);
+	if (res == 0)
+	{
+		res = libtwirc_rate_flush(state);
+	}
+	pthread_mutex_unlock(&state->lock);
+	return res;
+}
+
 /*
  * Leave (part) the specified channel.
  * Returns 0 if the command was sent successfully, -1 on error.
@@ -0,0 +1,278 @@
+#include <stdlib.h>     // NULL, malloc(), calloc(), free()
+#include <string.h>     // strcmp(), strdup(), memcpy()
+#include <unistd.h>     // read(), write()
+#include <pthread.h>    // pthread_create(), pthread_detach(), mutexes
+#include <netdb.h>      // getaddrinfo(), freeaddrinfo()
+#include "tcpsock.h"
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * Resolving the server's host name with getaddrinfo() blocks, possibly for
+ * seconds, which would freeze the event loop (and every other state handled
+ * by it). Instead, host names are looked up on a separate thread; once done,
+ * the thread signals the eventfd of every state waiting for the result, which
+ * is watched by the state's epoll instance (or reported to an external event
+ * loop), so the state can go on to connect from its own loop. Results are
+ * cached for TWIRC_DNS_TTL ms and shared by all states, and states asking for
+ * a host that is being looked up already simply wait for that lookup, so a
+ * mass reconnect only needs a single one.
+ */
+
+static struct libtwirc_dns libtwirc_dns_cache = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+/*
+ * Frees the cache entry e, which must not be in the cache anymore.
+ */
+static void
+libtwirc_dns_free(struct libtwirc_dns_entry *e)
+{
+	free(e->host);
+	free(e->port);
+	free(e->addrs);
+	free(e);
+}
+
+/*
+ * Removes all entries from the cache that have expired at time now (or all
+ * of them, if now is UINT64_MAX), except for lookups still in progress and
+ * those that states are waiting for. Must be called with the lock held.
+ */
+static void
+libtwirc_dns_purge(uint64_t now)
+{
+	struct libtwirc_dns_entry **prev = &libtwirc_dns_cache.head;
+	while (*prev != NULL)
+	{
+		struct libtwirc_dns_entry *e = *prev;
+		if (e->busy || e->waiters != NULL || e->expires > now)
+		{
+			prev = &e->next;
+			continue;
+		}
+		*prev = e->next;
+		libtwirc_dns_free(e);
+	}
+}
+
+/*
+ * The thread looking up the host of the cache entry arg. Stores the result
+ * in the entry, then wakes up all states waiting for it.
+ */
+static void*
+libtwirc_dns_run(void *arg)
+{
+	struct libtwirc_dns_entry *e = arg;
+
+	struct addrinfo hints = { 0 };
+	hints.ai_family   = e->family;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	struct addrinfo *info = NULL;
+	int error = getaddrinfo(e->host, e->port, &hints, &info);
+
+	// Copy the addresses, so we don't depend on getaddrinfo()'s memory
+	size_t num = 0;
+	for (struct addrinfo *ai = info; error == 0 && ai != NULL; ai = ai->ai_next)
+	{
+		++num;
+	}
+	struct libtwirc_addr *addrs = num ? calloc(num, sizeof(struct libtwirc_addr)) : NULL;
+	if (error == 0 && addrs == NULL)
+	{
+		error = EAI_MEMORY;
+	}
+	num = 0;
+	for (struct addrinfo *ai = info; error == 0 && ai != NULL; ai = ai->ai_next)
+	{
+		addrs[num].len = ai->ai_addrlen;
+		memcpy(&addrs[num++].addr, ai->ai_addr, ai->ai_addrlen);
+	}
+	if (info != NULL)
+	{
+		freeaddrinfo(info);
+	}
+
+	pthread_mutex_lock(&libtwirc_dns_cache.lock);
+	e->busy    = 0;
+	e->error   = error;
+	e->addrs   = addrs;
+	e->num     = num;
+	// Failed lookups aren't cached, the next connect will try again
+	e->expires = error ? 0 : libtwirc_now_ms() + TWIRC_DNS_TTL;
+
+	uint64_t one = 1;
+	for (twirc_state_t *s = e->waiters; s != NULL; s = s->dns_next)
+	{
+		write(s->dns_fd, &one, sizeof(one));
+	}
+	pthread_mutex_unlock(&libtwirc_dns_cache.lock);
+	return NULL;
+}
+
+/*
+ * Resolves host and port for the state s and, if the result is cached, goes
+ * on to connect right away. Otherwise, the host is looked up in the
+ * background (unless it is already) and libtwirc_dns_done() will connect once
+ * the state's dns_fd has been signalled. Returns 0 on success, -1 on error.
+ */
+static int
+libtwirc_dns_resolve(twirc_state_t *s, const char *host, const char *port)
+{
+	// If ip_type is neither IPv4 nor IPv6, we take addresses of both
+	int family = s->ip_type == TWIRC_IPV4 || s->ip_type == TWIRC_IPV6 ?
+		s->ip_type : AF_UNSPEC;
+
+	pthread_mutex_lock(&libtwirc_dns_cache.lock);
+	libtwirc_dns_purge(libtwirc_now_ms());
+
+	struct libtwirc_dns_entry *e = libtwirc_dns_cache.head;
+	while (e != NULL && (e->family != family ||
+	       strcmp(e->host, host) != 0 || strcmp(e->port, port) != 0))
+	{
+		e = e->next;
+	}
+
+	// Cached already, connect right away
+	if (e != NULL && !e->busy && e->error == 0)
+	{
+		size_t num = e->num;
+		struct libtwirc_addr *addrs = malloc(num * sizeof(struct libtwirc_addr));
+		if (addrs != NULL)
+		{
+			memcpy(addrs, e->addrs, num * sizeof(struct libtwirc_addr));
+		}
+		pthread_mutex_unlock(&libtwirc_dns_cache.lock);
+
+		if (addrs == NULL)
+		{
+			return libtwirc_oom(s);
+		}
+		return libtwirc_race_start(s, addrs, num);
+	}
+
+	// Not looked up yet (or the last lookup failed), start a lookup
+	if (e == NULL || !e->busy)
+	{
+		e = calloc(1, sizeof(struct libtwirc_dns_entry));
+		if (e != NULL)
+		{
+			e->host   = strdup(host);
+			e->port   = strdup(port);
+			e->family = family;
+			e->busy   = 1;
+		}
+		if (e == NULL || e->host == NULL || e->port == NULL)
+		{
+			pthread_mutex_unlock(&libtwirc_dns_cache.lock);
+			if (e != NULL)
+			{
+				libtwirc_dns_free(e);
+			}
+			return libtwirc_oom(s);
+		}
+
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, libtwirc_dns_run, e) != 0)
+		{
+			pthread_mutex_unlock(&libtwirc_dns_cache.lock);
+			libtwirc_dns_free(e);
+			s->error = TWIRC_ERR_DNS_RESOLVE;
+			return -1;
+		}
+		pthread_detach(thread);
+		e->next = libtwirc_dns_cache.head;
+		libtwirc_dns_cache.head = e;
+	}
+
+	// Wait for the lookup to be done
+	s->dns = e;
+	s->dns_next = e->waiters;
+	e->waiters = s;
+	pthread_mutex_unlock(&libtwirc_dns_cache.lock);
+
+	libtwirc_interest(s);
+	return 0;
+}
+
+/*
+ * Stops the state s from waiting for a lookup, if it does.
+ */
+static void
+libtwirc_dns_cancel(twirc_state_t *s)
+{
+	if (s->dns == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&libtwirc_dns_cache.lock);
+	twirc_state_t **prev = &s->dns->waiters;
+	while (*prev != s)
+	{
+		prev = &(*prev)->dns_next;
+	}
+	*prev = s->dns_next;
+	s->dns = NULL;
+	s->dns_next = NULL;
+	pthread_mutex_unlock(&libtwirc_dns_cache.lock);
+}
+
+/*
+ * Called when the state's dns_fd has been signalled: connects to what the
+ * host has been resolved to. If the lookup failed or we can't connect, the
+ * disconnect event handlers are called, as for any other failed connect.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+libtwirc_dns_done(twirc_state_t *s)
+{
+	uint64_t val;
+	if (read(s->dns_fd, &val, sizeof(val)) <= 0 || s->dns == NULL)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&libtwirc_dns_cache.lock);
+	struct libtwirc_dns_entry *e = s->dns;
+	if (e->busy)
+	{
+		pthread_mutex_unlock(&libtwirc_dns_cache.lock);
+		return 0;
+	}
+
+	size_t num = e->error ? 0 : e->num;
+	struct libtwirc_addr *addrs = num ? malloc(num * sizeof(struct libtwirc_addr)) : NULL;
+	if (addrs != NULL)
+	{
+		memcpy(addrs, e->addrs, num * sizeof(struct libtwirc_addr));
+	}
+	pthread_mutex_unlock(&libtwirc_dns_cache.lock);
+	libtwirc_dns_cancel(s);
+
+	if (num == 0)
+	{
+		s->error = TWIRC_ERR_DNS_RESOLVE;
+		return libtwirc_race_failed(s);
+	}
+	if (addrs == NULL)
+	{
+		libtwirc_oom(s);
+		return libtwirc_race_failed(s);
+	}
+	return libtwirc_race_start(s, addrs, num) == 0 ? 0 : libtwirc_race_failed(s);
+}
+
+/*
+ * Empties the resolver cache that is shared by all states, so that the next
+ * connect will look up its host again (for example, after the network has
+ * changed). Lookups that are still in progress are not affected.
+ */
+void
+twirc_dns_clear()
+{
+	pthread_mutex_lock(&libtwirc_dns_cache.lock);
+	libtwirc_dns_purge(UINT64_MAX);
+	pthread_mutex_unlock(&libtwirc_dns_cache.lock);
+}
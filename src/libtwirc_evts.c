@@ -1,5 +1,6 @@
 #include <stdlib.h>     // NULL, EXIT_FAILURE, EXIT_SUCCESS
 #include <string.h>     // strlen(), strerror()
+#include <strings.h>    // strcasecmp()
 #include "libtwirc.h"
 
 /*
@@ -49,6 +50,11 @@ static void
 libtwirc_on_welcome(twirc_state_t *s, twirc_event_t *evt)
 {
 	s->status |= TWIRC_STATUS_AUTHENTICATED;
+
+	// If we got here by reconnecting, get back into our channels; if
+	// we're taking over from another connection, get into its channels
+	libtwirc_reconnect_rejoin(s);
+	libtwirc_handover_join(s);
 }
 
 /*
@@ -75,8 +81,8 @@ libtwirc_on_globaluserstate(twirc_state_t *s, twirc_event_t *evt)
 	s->status |= TWIRC_STATUS_AUTHENTICATED;
 	
 	// Save the display-name and user-id in our login struct
-	twirc_tag_t *name = twirc_get_tag_by_key(evt->tags, "display-name");
-	twirc_tag_t *id   = twirc_get_tag_by_key(evt->tags, "user-id");
+	twirc_tag_t *name = twirc_get_tag_id(evt, TWIRC_TAG_DISPLAY_NAME);
+	twirc_tag_t *id   = twirc_get_tag_id(evt, TWIRC_TAG_USER_ID);
 	s->login.name = name ? strdup(name->value) : NULL;
 	s->login.id   = id   ? strdup(id->value)   : NULL;
 }
@@ -112,6 +118,19 @@ libtwirc_on_join(twirc_state_t *s, twirc_event_t *evt)
 	{
 		evt->channel = evt->params[0];
 	}
+
+	// It's us, let the bulk join planner know it worked out, and keep
+	// track of the channel, so we can rejoin it after reconnecting
+	if (evt->origin && s->login.nick && strcasecmp(evt->origin, s->login.nick) == 0)
+	{
+		libtwirc_joins_confirm(s, evt->channel, TWIRC_JOIN_OK);
+		struct libtwirc_chan *c = evt->channel ? 
+			libtwirc_chans_find(&s->chans, evt->channel, strlen(evt->channel), 1) : NULL;
+		if (c != NULL)
+		{
+			c->flags |= TWIRC_CHAN_JOINED;
+		}
+	}
 }
 
 /*
@@ -161,12 +180,12 @@ libtwirc_on_mode(twirc_state_t *s, twirc_event_t *evt)
 static void 
 libtwirc_on_names(twirc_state_t *s, twirc_event_t *evt)
 {
-	if (strcmp(evt->command, "353") == 0 && evt->num_params > 2)
+	if (evt->command_id == TWIRC_CMD_NAMREPLY && evt->num_params > 2)
 	{
 		evt->channel = evt->params[2];
 		return;
 	}
-	if (strcmp(evt->command, "366") == 0 && evt->num_params > 1)
+	if (evt->command_id == TWIRC_CMD_ENDOFNAMES && evt->num_params > 1)
 	{
 		evt->channel = evt->params[1];
 		return;
@@ -185,6 +204,16 @@ libtwirc_on_part(twirc_state_t *s, twirc_event_t *evt)
 	{
 		evt->channel = evt->params[0];
 	}
+
+	// It's us, no need to rejoin this one after reconnecting
+	if (evt->channel && evt->origin && s->login.nick && strcasecmp(evt->origin, s->login.nick) == 0)
+	{
+		struct libtwirc_chan *c = libtwirc_chans_find(&s->chans, evt->channel, strlen(evt->channel), 0);
+		if (c != NULL)
+		{
+			c->flags &= ~(TWIRC_CHAN_JOINED | TWIRC_CHAN_REJOIN);
+		}
+	}
 }
 
 /*
@@ -280,19 +309,19 @@ libtwirc_on_hosttarget(twirc_state_t *s, twirc_event_t *evt)
 	}
 
 	// Check if there is a space in the trailing parameter
-	char *sp = strstr(evt->params[evt->trailing], " ");
+	char *sp = strchr(evt->params[evt->trailing], ' ');
 	if (sp == NULL) { return; }
 	
-	// Extract the username from the trailing parameter
-	evt->target = strndup(evt->params[evt->trailing], 
-			sp - evt->params[evt->trailing] + 1);
-	
-	// If the username was "-", we set it to NULL for better indication
-	if (strcmp(evt->target, "-") == 0)
+	// If the username was "-", we leave target NULL for better indication
+	size_t len = sp - evt->params[evt->trailing];
+	if (len == 1 && evt->params[evt->trailing][0] == '-')
 	{
-		free(evt->target);
-		evt->target = NULL;
+		return;
 	}
+
+	// Extract the username from the trailing parameter; we copy it to the 
+	// arena, as the trailing parameter itself should stay intact
+	evt->target = libtwirc_arena_strndup(&s->arena, evt->params[evt->trailing], len);
 }
 
 /*
@@ -321,6 +350,10 @@ libtwirc_on_notice(twirc_state_t *s, twirc_event_t *evt)
 	{
 		evt->message = evt->params[evt->trailing];
 	}
+
+	// A NOTICE for a channel we're trying to join means we couldn't
+	// (e.g. msg_channel_suspended); if we did join, it's a no-op
+	libtwirc_joins_confirm(s, evt->channel, TWIRC_JOIN_FAILED);
 }
 
 /*
@@ -351,7 +384,12 @@ libtwirc_on_action(twirc_state_t *s, twirc_event_t *evt)
 static void
 libtwirc_on_reconnect(twirc_state_t *s, twirc_event_t *evt)
 {
-	// Probably nothing to do here
+	// Have a second connection take over before this one goes away or,
+	// if we'll reconnect anyway, don't wait for the server to close it
+	if (libtwirc_handover_start(s) == -1)
+	{
+		libtwirc_reconnect_now(s);
+	}
 }
 
 /*
@@ -441,6 +479,9 @@ libtwirc_on_roomstate(twirc_state_t *s, twirc_event_t *evt)
 	{
 		evt->channel = evt->params[0];
 	}
+
+	// We're getting this for every channel we join
+	libtwirc_joins_confirm(s, evt->channel, TWIRC_JOIN_OK);
 }
 
 /*
@@ -565,6 +606,30 @@ libtwirc_on_userstate(twirc_state_t *s, twirc_event_t *evt)
 	{
 		evt->channel = evt->params[0];
 	}
+	if (evt->channel == NULL)
+	{
+		return;
+	}
+
+	// Remember if we're a mod in this channel, as mods can send more 
+	// messages (see libtwirc_rate.c); the broadcaster counts as mod
+	struct libtwirc_chan *chan = 
+		libtwirc_chans_find(&s->chans, evt->channel, strlen(evt->channel), 1);
+	if (chan == NULL)
+	{
+		return;
+	}
+	char const *mod    = twirc_get_tag_id_value(evt, TWIRC_TAG_MOD);
+	char const *badges = twirc_get_tag_id_value(evt, TWIRC_TAG_BADGES);
+	if ((mod && strcmp(mod, "1") == 0) ||
+	    (badges && strstr(badges, "broadcaster/")))
+	{
+		chan->flags |= TWIRC_CHAN_MOD;
+	}
+	else
+	{
+		chan->flags &= ~TWIRC_CHAN_MOD;
+	}
 }
 
 /*
@@ -582,7 +647,7 @@ libtwirc_on_whisper(twirc_state_t *s, twirc_event_t *evt)
 {
 	if (evt->num_params > 0)
 	{
-		evt->target  = strdup(evt->params[0]);
+		evt->target  = evt->params[0];
 	}
 	if (evt->num_params > evt->trailing)
 	{
@@ -610,6 +675,9 @@ libtwirc_on_connect(twirc_state_t *s)
 	// Set status to connected (discarding all other flags)
 	s->status = TWIRC_STATUS_CONNECTED;
 
+	// No need to try any other addresses anymore
+	libtwirc_race_free(s);
+
 	// Request capabilities before login, so that we will receive the
 	// GLOBALUSERSTATE command on login in addition to the 001 (WELCOME)
 	libtwirc_capreq(s);
@@ -629,11 +697,53 @@ libtwirc_on_disconnect(twirc_state_t *s)
 	// Set status to disconnected (discarding all other flags)
 	s->status = TWIRC_STATUS_DISCONNECTED;
 	
+	// io_uring holds on to the socket until its requests are cancelled
+	if (s->uring_slot != -1)
+	{
+		libtwirc_uring_cancel(s->pool, s, 0);
+	}
+
+	// We might not even have a socket yet, but wait for the resolver or
+	// still be trying to connect
+	libtwirc_dns_cancel(s);
+	libtwirc_race_free(s);
+
+	// Let a handover to or from this connection know it's gone
+	libtwirc_handover_lost(s);
+	libtwirc_tls_free(s);
+
+	// Have an external event loop stop watching the socket before it's
+	// closed (some loops insist on that)
+	libtwirc_interest(s);
+
 	// Close the socket (this might fail as it might be closed already);
 	// we're not checking for that error and therefore we don't report 
 	// the error via s->error for two reasons: first, we kind of expect 
 	// this to fail; second: we don't want to override more meaningful 
-	// errors that might have occurred before 
+	// errors that might have occurred before; forget about it, so that
+	// connecting again doesn't try to watch it
 	tcpsock_close(s->socket_fd);
+	s->socket_fd = -1;
+
+	// Whatever is left of the last message can't be completed anymore;
+	// the next connection starts with an empty buffer
+	s->buf_len  = 0;
+	s->buf_scan = 0;
+	s->buf_skip = 0;
+	s->eof      = 0;
+	s->buffer[0] = '\0';
+
+	// Whatever was still queued can't be sent on this connection anymore
+	s->out_head = 0;
+	s->out_len  = 0;
+	libtwirc_rate_clear(s);
+
+	// Channels we didn't get into yet are rejoined with the others, if
+	// we're going to reconnect
+	libtwirc_joins_abort(s, s->reconnect_min && !s->quit);
+
+	// Come back later, if we're supposed to
+	libtwirc_reconnect_schedule(s);
+	libtwirc_interest(s);
 }
 
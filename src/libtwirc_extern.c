@@ -0,0 +1,216 @@
+#include <stdint.h>     // uint64_t
+#include <sys/epoll.h>  // EPOLLIN, EPOLLOUT, EPOLLRDHUP, EPOLLERR
+#include "tcpsock.h"
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * Instead of having twirc_tick() or a pool wait for events with an epoll
+ * instance of our own, a state can be driven by whatever event loop the
+ * application runs already (libuv, libev, its own reactor, ...). The loop
+ * watches the state's socket for what the state is interested in (reading,
+ * writing or both) and sets a timer for the rate limiter, then tells the
+ * state when something happened by calling twirc_on_readable(),
+ * twirc_on_writable() or twirc_on_timer(). Whenever the socket, the interest
+ * or the timer change, the state calls the interest callback, so the loop can
+ * update its watchers. Such a state has no epoll instance and no timerfd.
+ */
+
+/*
+ * Calls the state's interest callback, if it has one, if its socket, its
+ * interest or the timer have changed since the last time.
+ */
+static void
+libtwirc_interest(twirc_state_t *s)
+{
+	if (s->interest_cb == NULL)
+	{
+		return;
+	}
+
+	int fd = twirc_get_fd(s);
+	int interest = twirc_get_interest(s);
+	if (fd == s->ext_fd && interest == s->ext_interest && s->timer_due == s->ext_due)
+	{
+		return;
+	}
+	s->ext_fd = fd;
+	s->ext_interest = interest;
+	s->ext_due = s->timer_due;
+	s->interest_cb(s, fd, interest, twirc_get_timeout(s));
+}
+
+/*
+ * Has the state s driven by an external event loop from now on, see above.
+ * This needs to be done before the state is connected. The callback cb (can
+ * be NULL, if the loop asks for the interest itself after every call) will be
+ * called with the socket, the interest (TWIRC_WANT_* flags, 0 meaning that
+ * the socket doesn't need to be watched at all) and the number of ms until
+ * twirc_on_timer() should be called (-1 if never) whenever they change. The
+ * callback may be called from within any of the twirc_on_*() functions, as
+ * well as when connecting or sending (for example, from within callbacks).
+ */
+void
+twirc_set_external(twirc_state_t *s, twirc_interest_callback cb)
+{
+	s->external = 1;
+	s->interest_cb = cb;
+	s->ext_fd = -1;
+	s->ext_interest = 0;
+	s->ext_due = 0;
+}
+
+/*
+ * Returns the state's socket, which the event loop should watch, or -1 if
+ * there is none (not connected). While the host is being resolved, this is
+ * an eventfd instead, which will become readable once that is done.
+ */
+int
+twirc_get_fd(const twirc_state_t *s)
+{
+	if (s->dns != NULL)
+	{
+		return s->dns_fd;
+	}
+	return s->status == TWIRC_STATUS_DISCONNECTED ? -1 : s->socket_fd;
+}
+
+/*
+ * Returns what the state needs its socket watched for, as a combination of
+ * the TWIRC_WANT_* flags: writing while connecting, or while there is data
+ * waiting to be sent, and reading once connected. Returns 0 if the socket
+ * doesn't need to be watched (not connected).
+ */
+int
+twirc_get_interest(const twirc_state_t *s)
+{
+	if (s->dns != NULL)
+	{
+		return TWIRC_WANT_READ;
+	}
+	if (s->status == TWIRC_STATUS_DISCONNECTED || s->socket_fd == -1)
+	{
+		return 0;
+	}
+	if ((s->status & TWIRC_STATUS_CONNECTING) && s->ssl != NULL)
+	{
+		// The TLS handshake wants to hear back from the server
+		return libtwirc_tls_want_write(s) ? TWIRC_WANT_WRITE : TWIRC_WANT_READ;
+	}
+	if (s->status & TWIRC_STATUS_CONNECTING)
+	{
+		return TWIRC_WANT_WRITE;
+	}
+	return TWIRC_WANT_READ | (s->out_head < s->out_len ? TWIRC_WANT_WRITE : 0);
+}
+
+/*
+ * Returns the number of milliseconds until twirc_on_timer() should be called,
+ * because rate limited messages can be sent then (or joins time out), 0 if
+ * it should be called right away or -1 if there is nothing to wait for.
+ */
+int
+twirc_get_timeout(const twirc_state_t *s)
+{
+	if (s->timer_due == 0)
+	{
+		return -1;
+	}
+	uint64_t now = libtwirc_now_ms();
+	return s->timer_due > now ? (int) (s->timer_due - now) : 0;
+}
+
+/*
+ * To be called by the event loop when the state's socket is readable.
+ * Returns 0 on success, -1 if the connection has been lost or not enough
+ * memory was available to process the incoming data (check the error).
+ */
+int
+twirc_on_readable(twirc_state_t *s)
+{
+	// The host has been resolved, go on to connect
+	if (s->dns != NULL)
+	{
+		pthread_mutex_lock(&s->lock);
+		int res = libtwirc_dns_done(s);
+		libtwirc_interest(s);
+		pthread_mutex_unlock(&s->lock);
+		return res;
+	}
+
+	// Some loops report a failed connect as readable; find out if it was,
+	// before a recv() gets to swallow the error
+	if (s->status & TWIRC_STATUS_CONNECTING)
+	{
+		return twirc_on_writable(s);
+	}
+
+	pthread_mutex_lock(&s->lock);
+
+	struct epoll_event epev = { 0 };
+	epev.events = EPOLLIN;
+	int res = libtwirc_handle_event(s, &epev);
+
+	// An event loop won't tell us about the peer closing the connection
+	// (what EPOLLRDHUP does), but we can tell from what recv() returned
+	if (res == 0 && s->eof && twirc_is_connected(s))
+	{
+		epev.events = EPOLLRDHUP;
+		res = libtwirc_handle_event(s, &epev);
+	}
+
+	libtwirc_interest(s);
+	pthread_mutex_unlock(&s->lock);
+	return res;
+}
+
+/*
+ * To be called by the event loop when the state's socket is writable.
+ * Returns 0 on success, -1 if the connection failed or has been lost.
+ */
+int
+twirc_on_writable(twirc_state_t *s)
+{
+	pthread_mutex_lock(&s->lock);
+
+	// A socket that failed to connect is writable as well (what would
+	// be EPOLLERR with epoll); if there are more addresses, try the next
+	int res = 0;
+	struct epoll_event epev = { 0 };
+	epev.events = EPOLLOUT;
+	if ((s->status & TWIRC_STATUS_CONNECTING) && tcpsock_status(s->socket_fd) == -1)
+	{
+		epev.events = EPOLLERR;
+		if (s->race.num > 0)
+		{
+			tcpsock_close(s->socket_fd);
+			s->socket_fd = -1;
+			s->race.active = 0;
+			res = libtwirc_race_pump(s) == 0 ? 0 : libtwirc_race_failed(s);
+			epev.events = 0;
+		}
+	}
+	if (epev.events)
+	{
+		res = libtwirc_handle_event(s, &epev);
+	}
+
+	libtwirc_interest(s);
+	pthread_mutex_unlock(&s->lock);
+	return res;
+}
+
+/*
+ * To be called by the event loop once the timeout the state asked for (see
+ * twirc_get_timeout()) has passed. Sends rate limited messages that can be
+ * sent now, or reconnects. Returns 0 on success, -1 if connecting failed.
+ */
+int
+twirc_on_timer(twirc_state_t *s)
+{
+	pthread_mutex_lock(&s->lock);
+	int res = libtwirc_timer(s);
+	libtwirc_interest(s);
+	pthread_mutex_unlock(&s->lock);
+	return res;
+}
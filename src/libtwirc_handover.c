@@ -0,0 +1,465 @@
+#include <stdlib.h>     // NULL, calloc(), malloc(), free()
+#include <string.h>     // memchr()
+#include <stdint.h>     // uint64_t, UINT64_MAX
+#include <sys/epoll.h>  // epoll_ctl()
+#include "tcpsock.h"
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * When Twitch is about to restart a server, it sends RECONNECT; reconnecting
+ * then loses everything that is sent in between closing the old connection
+ * and having rejoined all channels on the new one. If enabled (see
+ * twirc_set_handover()), a state instead opens a second connection (using a
+ * state of its own, the shadow) while the old one keeps delivering, logs in
+ * and joins all channels we're in. Only then do the two switch: the state
+ * takes over the shadow's socket and buffers, and the old connection is
+ * closed. Rate limits are per account, so the shadow's messages count 
+ * against the state's limits all along. While both are up, and for
+ * TWIRC_HANDOVER_GRACE ms after the switch, messages with an id tag are only
+ * delivered once, no matter which connection they came in on; other messages
+ * of the shadow (its login and joins, for example) aren't delivered at all.
+ * If the old connection goes away before the new one is ready, we give up on
+ * the new one and reconnect as usual (see twirc_set_reconnect()). The shadow
+ * is watched by the same epoll instance as the state, so this doesn't work
+ * for states driven by an external event loop, which only watch one socket.
+ */
+
+// Number of slots of the set of ids seen, see libtwirc_handover_seen()
+#define TWIRC_HANDOVER_SLOTS (2 * TWIRC_HANDOVER_IDS)
+
+// Swaps the given member of the states a and b
+#define TWIRC_HANDOVER_SWAP(a, b, type, member) \
+	{ type tmp = (a)->member; (a)->member = (b)->member; (b)->member = tmp; }
+
+/*
+ * Removes the hash from the index of ids the state s has seen. Entries that
+ * have been pushed past its slot (linear probing) are moved back, so that
+ * lookups still find them without having to skip over deleted slots.
+ */
+static void
+libtwirc_handover_forget(twirc_state_t *s, uint64_t hash)
+{
+	uint64_t *set = s->seen.set;
+	size_t mask = TWIRC_HANDOVER_SLOTS - 1;
+
+	size_t i = hash & mask;
+	while (set[i] != hash)
+	{
+		if (set[i] == 0)
+		{
+			return;
+		}
+		i = (i + 1) & mask;
+	}
+	set[i] = 0;
+
+	for (size_t j = (i + 1) & mask; set[j] != 0; j = (j + 1) & mask)
+	{
+		// Only move entries whose home slot isn't between the gap and them
+		size_t home = set[j] & mask;
+		if (((j - home) & mask) >= ((j - i) & mask))
+		{
+			set[i] = set[j];
+			set[j] = 0;
+			i = j;
+		}
+	}
+}
+
+/*
+ * Returns 1 if a message with the given id (from the id tag) has been seen
+ * by the state s recently, otherwise 0, remembering it for next time. Only
+ * the last TWIRC_HANDOVER_IDS ids are kept; as both connections deliver the
+ * same messages within moments of each other, that's plenty. They're kept in
+ * order of arrival, so we know which one to forget next, and in a hash set
+ * with twice as many slots, so that looking them up doesn't take long.
+ */
+static int
+libtwirc_handover_seen(twirc_state_t *s, const char *id)
+{
+	// FNV-1a; 0 marks an empty slot
+	uint64_t hash = 14695981039346656037u;
+	for (const char *c = id; *c; ++c)
+	{
+		hash ^= (unsigned char) *c;
+		hash *= 1099511628211u;
+	}
+	hash = hash ? hash : 1;
+
+	uint64_t *set = s->seen.set;
+	size_t mask = TWIRC_HANDOVER_SLOTS - 1;
+	for (size_t i = hash & mask; set[i] != 0; i = (i + 1) & mask)
+	{
+		if (set[i] == hash)
+		{
+			return 1;
+		}
+	}
+
+	// Make room by forgetting the oldest id, whose place we're taking
+	if (s->seen.ids[s->seen.next] != 0)
+	{
+		libtwirc_handover_forget(s, s->seen.ids[s->seen.next]);
+	}
+	s->seen.ids[s->seen.next] = hash;
+	s->seen.next = (s->seen.next + 1) % TWIRC_HANDOVER_IDS;
+
+	size_t i = hash & mask;
+	while (set[i] != 0)
+	{
+		i = (i + 1) & mask;
+	}
+	set[i] = hash;
+	return 0;
+}
+
+/*
+ * Decides whether the event evt (NULL for connect and disconnect) of the
+ * state s, which is either taking part in a handover or has just done so,
+ * should be delivered to the user. Returns 1 if so, otherwise 0.
+ */
+static int
+libtwirc_handover_pass(twirc_state_t *s, twirc_event_t *evt)
+{
+	twirc_state_t *p = s->primary ? s->primary : s;
+	const char *id = evt ? twirc_get_tag_id_value(evt, TWIRC_TAG_ID) : NULL;
+
+	// The shadow only brings messages the old connection might miss
+	if (s->primary)
+	{
+		return id != NULL && p->seen.until && !libtwirc_handover_seen(p, id);
+	}
+
+	if (p->handover_state == TWIRC_HANDOVER_IDLE && libtwirc_now_ms() >= p->seen.until)
+	{
+		p->seen.until = 0;
+	}
+	return id == NULL || p->seen.until == 0 || !libtwirc_handover_seen(p, id);
+}
+
+/*
+ * Gives up on the shadow of the state s, if a handover is in progress,
+ * closing its connection. The shadow itself is kept around for the next
+ * handover, as events for it might still be waiting to be handled.
+ */
+static void
+libtwirc_handover_drop(twirc_state_t *s)
+{
+	twirc_state_t *sh = s->shadow;
+	if (sh == NULL || s->handover_state == TWIRC_HANDOVER_IDLE)
+	{
+		return;
+	}
+	s->handover_state = TWIRC_HANDOVER_IDLE;
+	s->seen.until = libtwirc_now_ms() + TWIRC_HANDOVER_GRACE;
+
+	pthread_mutex_lock(&sh->lock);
+	libtwirc_unwatch(sh, sh->epfd);
+	libtwirc_dns_cancel(sh);
+	libtwirc_race_free(sh);
+	libtwirc_tls_free(sh);
+	if (sh->socket_fd != -1)
+	{
+		tcpsock_close(sh->socket_fd);
+		sh->socket_fd = -1;
+	}
+	sh->status = TWIRC_STATUS_DISCONNECTED;
+	libtwirc_rate_clear(sh);
+	libtwirc_joins_free(sh);
+	pthread_mutex_unlock(&sh->lock);
+}
+
+/*
+ * Starts a handover for the state s, if enabled, by connecting its shadow.
+ * Returns 0 if the handover is in progress, -1 if there won't be one (in
+ * which case the caller should fall back to reconnecting).
+ */
+static int
+libtwirc_handover_start(twirc_state_t *s)
+{
+	if (!s->handover || s->external || !twirc_is_logged_in(s))
+	{
+		return -1;
+	}
+	if (s->handover_state != TWIRC_HANDOVER_IDLE)
+	{
+		return 0;
+	}
+
+	if (s->seen.ids == NULL)
+	{
+		// The ids and the set of them, in one go
+		s->seen.ids = calloc(TWIRC_HANDOVER_IDS + TWIRC_HANDOVER_SLOTS, sizeof(uint64_t));
+		if (s->seen.ids == NULL)
+		{
+			return libtwirc_oom(s);
+		}
+		s->seen.set = s->seen.ids + TWIRC_HANDOVER_IDS;
+	}
+	if (s->shadow == NULL)
+	{
+		s->shadow = twirc_init();
+		if (s->shadow == NULL)
+		{
+			return libtwirc_oom(s);
+		}
+		s->shadow->primary = s;
+	}
+
+	// Whatever the shadow was left with by the last handover
+	twirc_state_t *sh = s->shadow;
+	sh->buf_len  = 0;
+	sh->buf_scan = 0;
+	sh->buf_skip = 0;
+	sh->out_head = 0;
+	sh->out_len  = 0;
+	sh->eof      = 0;
+	libtwirc_chans_free(&sh->chans);
+
+	// The shadow delivers to the same callbacks and shares our epoll
+	// instance; rate limits are per account, so it is charged to our
+	// buckets (see libtwirc_rate_bucket())
+	sh->cbs       = s->cbs;
+	sh->context   = s->context;
+	sh->ip_type   = s->ip_type;
+	sh->sockopts  = s->sockopts;
+	sh->lazy_tags = s->lazy_tags;
+	sh->zero_copy = s->zero_copy;
+	sh->epfd      = s->epfd;
+	libtwirc_tls_copy(sh, s);
+
+	s->handover_state = TWIRC_HANDOVER_CONNECTING;
+	s->seen.until = UINT64_MAX;
+	if (twirc_connect(sh, s->login.host, s->login.port, s->login.nick, s->login.pass) == -1)
+	{
+		libtwirc_handover_drop(s);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Lets the state s know that its shadow is ready to take over, which it will
+ * once its timer goes off (which we make happen right away); the shadow might
+ * still be in the middle of handling its data.
+ */
+static void
+libtwirc_handover_ready(twirc_state_t *sh)
+{
+	twirc_state_t *s = sh->primary;
+	if (s->shadow != sh || s->handover_state != TWIRC_HANDOVER_CONNECTING)
+	{
+		return;
+	}
+	s->handover_state = TWIRC_HANDOVER_READY;
+	libtwirc_rate_arm(s, 1);
+}
+
+/*
+ * Join callback of the shadow; once all channels are done, it's ready.
+ */
+static void
+libtwirc_handover_joined(twirc_state_t *sh, const char *chan, int result, size_t done, size_t total)
+{
+	if (done == total && sh->primary)
+	{
+		libtwirc_handover_ready(sh);
+	}
+}
+
+/*
+ * Called when the state s has logged in. If it is a shadow, joins all
+ * channels its state is in.
+ */
+static void
+libtwirc_handover_join(twirc_state_t *sh)
+{
+	twirc_state_t *s = sh->primary;
+	if (s == NULL || s->shadow != sh || s->handover_state != TWIRC_HANDOVER_CONNECTING)
+	{
+		return;
+	}
+
+	const char **names = malloc(s->chans.used * sizeof(char*));
+	size_t num = 0;
+	for (size_t i = 0; names != NULL && i < s->chans.size; ++i)
+	{
+		struct libtwirc_chan *c = &s->chans.slots[i];
+		if (c->name != NULL && (c->flags & TWIRC_CHAN_JOINED))
+		{
+			names[num++] = c->name;
+		}
+	}
+	if (num == 0 || twirc_cmd_join_list(sh, names, num, libtwirc_handover_joined) == -1)
+	{
+		libtwirc_handover_ready(sh);
+	}
+	free(names);
+}
+
+/*
+ * Switches the state s over to the connection of its shadow, once that is
+ * ready. Unsent messages of the old connection are sent on the new one;
+ * channels the shadow failed to join are joined again, as after reconnecting.
+ */
+static void
+libtwirc_handover_pump(twirc_state_t *s)
+{
+	if (s->handover_state != TWIRC_HANDOVER_READY)
+	{
+		return;
+	}
+	twirc_state_t *sh = s->shadow;
+	pthread_mutex_lock(&sh->lock);
+
+	// io_uring holds on to the old socket until its requests are cancelled
+	if (s->uring_slot != -1)
+	{
+		libtwirc_uring_detach(s->pool, s);
+	}
+	struct epoll_event eev = { 0 };
+	if (s->socket_fd != -1)
+	{
+		epoll_ctl(s->epfd, EPOLL_CTL_DEL, s->socket_fd, &eev);
+	}
+	libtwirc_unwatch(sh, sh->epfd);
+
+	// Trade connections; the rate limits are ours already
+	TWIRC_HANDOVER_SWAP(s, sh, int, socket_fd);
+	TWIRC_HANDOVER_SWAP(s, sh, struct ssl_st*, ssl);
+	TWIRC_HANDOVER_SWAP(s, sh, int, ktls);
+	TWIRC_HANDOVER_SWAP(s, sh, char*, buffer);
+	TWIRC_HANDOVER_SWAP(s, sh, size_t, buf_size);
+	TWIRC_HANDOVER_SWAP(s, sh, size_t, buf_len);
+	TWIRC_HANDOVER_SWAP(s, sh, size_t, buf_scan);
+	TWIRC_HANDOVER_SWAP(s, sh, int, buf_skip);
+	TWIRC_HANDOVER_SWAP(s, sh, char*, out);
+	TWIRC_HANDOVER_SWAP(s, sh, size_t, out_size);
+	TWIRC_HANDOVER_SWAP(s, sh, size_t, out_head);
+	TWIRC_HANDOVER_SWAP(s, sh, size_t, out_len);
+	TWIRC_HANDOVER_SWAP(s, sh, int, eof);
+	s->status = sh->status;
+
+	// Complete lines that didn't make it out on the old connection; the
+	// outgoing event has been dispatched for them already
+	char *line = sh->out + sh->out_head;
+	char *end  = sh->out + sh->out_len;
+	if (sh->out_head > 0 && sh->out[sh->out_head - 1] != '\n')
+	{
+		char *lf = memchr(line, '\n', end - line);
+		line = lf ? lf + 1 : end;
+	}
+	while (line < end)
+	{
+		char *lf = memchr(line, '\n', end - line);
+		if (lf == NULL)
+		{
+			break;
+		}
+		size_t len = lf - line;
+		libtwirc_enqueue(s, line, (len && line[len - 1] == '\r') ? len - 1 : len);
+		line = lf + 1;
+	}
+
+	// Channels the shadow didn't get into
+	for (size_t i = 0; i < s->chans.size; ++i)
+	{
+		struct libtwirc_chan *c = &s->chans.slots[i];
+		if (c->name == NULL || !(c->flags & TWIRC_CHAN_JOINED))
+		{
+			continue;
+		}
+		struct libtwirc_chan *shc = libtwirc_chans_find(&sh->chans, c->name, c->len, 0);
+		if (shc == NULL || !(shc->flags & TWIRC_CHAN_JOINED))
+		{
+			c->flags &= ~TWIRC_CHAN_JOINED;
+			c->flags |= TWIRC_CHAN_REJOIN;
+		}
+	}
+
+	// Close the old connection, which the shadow holds now
+	libtwirc_tls_free(sh);
+	tcpsock_close(sh->socket_fd);
+	sh->socket_fd = -1;
+	sh->status = TWIRC_STATUS_DISCONNECTED;
+	sh->out_head = 0;
+	sh->out_len  = 0;
+	libtwirc_rate_clear(sh);
+	libtwirc_joins_free(sh);
+	pthread_mutex_unlock(&sh->lock);
+
+	s->handover_state = TWIRC_HANDOVER_IDLE;
+	s->seen.until = libtwirc_now_ms() + TWIRC_HANDOVER_GRACE;
+	if (s->pool && s->pool->uring && !s->tls)
+	{
+		libtwirc_uring_attach(s->pool, s);
+	}
+	libtwirc_watch(s, s->epfd);
+	libtwirc_reconnect_rejoin(s);
+}
+
+/*
+ * Lowers wait to 1 ms if the state's shadow is ready to take over, so that
+ * the rate limiter doesn't push its timer past that.
+ */
+static void
+libtwirc_handover_wait(twirc_state_t *s, uint64_t *wait)
+{
+	if (s->handover_state == TWIRC_HANDOVER_READY)
+	{
+		*wait = 1;
+	}
+}
+
+/*
+ * Called when the state s lost its connection. If the old connection of a
+ * handover goes away first, the new one is given up on (and we reconnect as
+ * usual); if the new one fails, the old one carries on.
+ */
+static void
+libtwirc_handover_lost(twirc_state_t *s)
+{
+	if (s->shadow)
+	{
+		libtwirc_handover_drop(s);
+	}
+	else if (s->primary && s->primary->shadow == s &&
+	         s->primary->handover_state != TWIRC_HANDOVER_IDLE)
+	{
+		s->primary->handover_state = TWIRC_HANDOVER_IDLE;
+		s->primary->seen.until = libtwirc_now_ms() + TWIRC_HANDOVER_GRACE;
+	}
+}
+
+/*
+ * Frees the shadow of the state s, if it has one, see above.
+ */
+static void
+libtwirc_handover_free(twirc_state_t *s)
+{
+	if (s->shadow == NULL)
+	{
+		return;
+	}
+	libtwirc_handover_drop(s);
+
+	// The epoll instance is ours, not the shadow's
+	s->shadow->epfd = -1;
+	twirc_free(s->shadow);
+	s->shadow = NULL;
+	free(s->seen.ids);
+	s->seen.ids = NULL;
+	s->seen.set = NULL;
+	s->seen.until = 0;
+}
+
+/*
+ * Enables (handover = 1) or disables (handover = 0) make-before-break
+ * handling of RECONNECT for the state s, see above. Disabled by default.
+ */
+void
+twirc_set_handover(twirc_state_t *s, int handover)
+{
+	s->handover = handover;
+}
@@ -1,22 +1,393 @@
 #ifndef LIBTWIRC_INTERNAL_H
 #define LIBTWIRC_INTERNAL_H
 
+#include <stdint.h>     // uint64_t
+#include <time.h>       // struct timespec
+#include <signal.h>     // sigset_t
+#include <pthread.h>    // pthread_t, pthread_mutex_t
+#include <sys/epoll.h>  // struct epoll_event
+#include <sys/types.h>  // ssize_t
+#include <sys/socket.h> // socklen_t, struct sockaddr_storage
+#ifndef TWIRC_NO_URING
+#include <linux/io_uring.h> // struct io_uring_*
+#endif
 #include "libtwirc.h"
 
 /*
  * Structures
  */
 
+// Alignment of all memory handed out by the arena
+#define TWIRC_ARENA_ALIGN (sizeof(void*))
+
+struct libtwirc_chunk
+{
+	struct libtwirc_chunk *prev;       // Chunk below this one, if any
+	size_t size;                       // Usable size of data, in bytes
+	size_t used;                       // Bytes of data handed out
+	char data[];                       // The memory handed out
+};
+
+struct libtwirc_arena
+{
+	struct libtwirc_chunk *head;       // Chunk we're allocating from
+	size_t pushes;                     // Chunks allocated so far
+};
+
+struct libtwirc_mark
+{
+	struct libtwirc_chunk *chunk;      // Head of the arena at the time
+	size_t used;                       // Fill level of the head chunk
+};
+
+// Returns the callback at byte offset off within the state's callbacks
+#define LIBTWIRC_CALLBACK(s, off) (*(twirc_callback *) ((char *) &(s)->cbs + (off)))
+
+struct libtwirc_dispatch
+{
+	void (*handler)(twirc_state_t *s, twirc_event_t *evt); // Internal
+	size_t callback;                   // Offset of the user callback
+};
+
+// Flags of the channel table's entries
+#define TWIRC_CHAN_MOD 0x01                // We're a mod (or the broadcaster)
+#define TWIRC_CHAN_JOINING 0x02            // Waiting for JOIN to be confirmed
+#define TWIRC_CHAN_JOINED  0x04            // We're in it
+#define TWIRC_CHAN_REJOIN  0x08            // To be joined again on reconnect
+
+struct libtwirc_chan
+{
+	char *name;                        // Channel name, including the '#'
+	size_t len;                        // Length of name
+	int flags;                         // TWIRC_CHAN_* flags
+};
+
+struct libtwirc_chans
+{
+	struct libtwirc_chan *slots;       // Entries (name is NULL if unused)
+	size_t size;                       // Number of slots (power of two)
+	size_t used;                       // Number of slots in use
+};
+
+struct libtwirc_seen
+{
+	uint64_t *ids;                     // Hashes of the last ids seen
+	uint64_t *set;                     // The same, as a hash set
+	size_t next;                       // Slot for the next one
+	uint64_t until;                    // Deduplicate until (ms), or 0
+};
+
+// Latencies recorded within one window of TWIRC_STATS_WINDOW ms, see
+// libtwirc_stats_window()
+struct libtwirc_window
+{
+	uint64_t epoch;                    // Window number (time / window size)
+	twirc_hist_t recv_to_cb_ns;        // From receiving to the callback (ns)
+	twirc_hist_t sent_to_cb_ns;        // From tmi-sent-ts to the callback (ns)
+};
+
+// Phases of a handover to a second connection
+#define TWIRC_HANDOVER_IDLE       0        // None in progress
+#define TWIRC_HANDOVER_CONNECTING 1        // Shadow logging in and joining
+#define TWIRC_HANDOVER_READY      2        // Shadow ready to take over
+
+struct libtwirc_bucket
+{
+	unsigned limit;                    // Messages allowed per period
+	unsigned period;                   // Length of the period, in ms
+	unsigned next;                     // Index of the oldest stamp
+	uint64_t *stamps;                  // When the last messages were sent
+};
+
+struct libtwirc_pending
+{
+	struct libtwirc_pending *next;     // Next message in line
+	int buckets;                       // Buckets to charge (bitmask)
+	unsigned cost;                     // Number of messages it counts as
+	size_t len;                        // Length of msg
+	char msg[];                        // The message, without "\r\n"
+};
+
+struct libtwirc_joins
+{
+	char **names;                      // Channels to join
+	uint64_t *sent;                    // When their JOIN has been sent
+	size_t num;                        // Number of channels
+	size_t size;                       // Number of slots in names/sent
+	size_t next;                       // Next channel to send a JOIN for
+	size_t oldest;                     // Oldest channel not yet done
+	size_t done;                       // Number of channels reported
+	twirc_join_callback cb;            // Where to report to
+};
+
+// Kinds of files a watch can be about
+#define TWIRC_WATCH_SOCKET 0               // The IRC connection
+#define TWIRC_WATCH_TIMER  1               // The rate limiter's timer
+#define TWIRC_WATCH_WAKE   2               // A runtime worker's mailbox
+#define TWIRC_WATCH_DNS    3               // Host name has been resolved
+#define TWIRC_WATCH_ATTEMPT 4              // Attempt to connect somewhere
+
+struct libtwirc_watch
+{
+	twirc_state_t *state;              // State the file belongs to
+	int kind;                          // TWIRC_WATCH_* 
+};
+
+struct libtwirc_addr
+{
+	socklen_t len;                     // Length of addr
+	struct sockaddr_storage addr;      // Address to connect to
+};
+
+struct libtwirc_dns_entry
+{
+	struct libtwirc_dns_entry *next;   // Next entry in the cache
+	char *host;                        // Host name that was looked up
+	char *port;                        // Port (or service) that was looked up
+	int family;                        // Address family that was asked for
+	int busy;                          // Lookup still in progress?
+	int error;                         // What getaddrinfo() returned
+	uint64_t expires;                  // When to look it up again (ms)
+	struct libtwirc_addr *addrs;       // What the host resolved to
+	size_t num;                        // Number of addrs
+	twirc_state_t *waiters;            // States waiting for the lookup
+};
+
+struct libtwirc_dns
+{
+	pthread_mutex_t lock;              // Protects everything (and waiters)
+	struct libtwirc_dns_entry *head;   // All cached entries
+};
+
+struct libtwirc_attempt
+{
+	int fd;                            // Socket connecting, or -1
+	struct libtwirc_watch watch;       // epoll data for fd
+};
+
+struct libtwirc_race
+{
+	struct libtwirc_addr *addrs;       // Addresses to try, in order
+	size_t num;                        // Number of addrs (0 if not racing)
+	size_t next;                       // Next address to try
+	size_t active;                     // Attempts in progress
+	uint64_t next_at;                  // When to start the next one (ms)
+	struct libtwirc_attempt attempts[TWIRC_CONNECT_ATTEMPTS];
+};
+
+struct libtwirc_uring_slot
+{
+	twirc_state_t *state;              // State using the slot, if any
+	int inflight;                      // Requests not completed yet
+	int armed;                         // Is a recv pending?
+	int dirty;                         // Waiting to be sent?
+	char *sending;                     // Copy of the data being sent
+	size_t send_size;                  // Size of sending, in bytes
+	size_t send_len;                   // Bytes being sent (0 if none)
+};
+
+#ifndef TWIRC_NO_URING
+struct libtwirc_uring
+{
+	int fd;                            // io_uring file descriptor
+	void *sq_ring;                     // Submission queue ring (mapped)
+	size_t sq_ring_size;
+	void *cq_ring;                     // Completion queue ring (mapped)
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;         // Submission queue entries (mapped)
+	size_t sqes_size;
+	unsigned *sq_head;                 // Within sq_ring
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *cq_head;                 // Within cq_ring
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned to_submit;                // Entries not submitted yet
+	struct io_uring_buf_ring *br;      // Buffers provided to the kernel
+	unsigned short br_tail;            // Tail of br
+	char *bufs;                        // Memory of the buffers
+	int multishot;                     // Is multishot recv supported?
+	int polling;                       // Is the epoll instance watched?
+	struct libtwirc_uring_slot *slots; // One per state
+	size_t num_slots;                  // Number of slots
+	size_t *dirty;                     // Slots with data to send
+	size_t num_dirty;                  // Number of slots in dirty
+	size_t size_dirty;                 // Number of elements in dirty
+	struct io_uring_cqe *backlog;      // Completions put aside
+	size_t backlog_head;               // First one not handled yet
+	size_t backlog_len;                // Number of elements used
+	size_t backlog_size;               // Number of elements in backlog
+};
+#endif
+
+struct twirc_pool
+{
+	int epfd;                          // epoll file descriptor
+	struct libtwirc_uring *uring;      // io_uring, if used instead of epoll
+	twirc_state_t **states;            // States in this pool
+	size_t num;                        // Number of states
+	size_t size;                       // Number of slots in states
+	struct epoll_event events[TWIRC_POOL_EVENTS]; // Events being handled
+	int num_events;                    // Number of events in events
+	int cur_event;                     // Event being handled right now
+};
+
+// Size of a cache line; keeps data of producers and consumers apart
+#define TWIRC_CACHE_LINE 64
+
+struct libtwirc_record
+{
+	twirc_state_t *state;              // State the event belongs to
+	twirc_callback cb;                 // Callback to call
+	twirc_event_t *evt;                // Copy of the event (or NULL)
+};
+
+struct libtwirc_slot
+{
+	size_t seq;                        // Sequence number (atomic)
+	struct libtwirc_record *rec;       // Record in this slot
+};
+
+struct twirc_pipeline
+{
+	struct libtwirc_slot *slots;       // Ring buffer
+	size_t mask;                       // Number of slots minus one
+	int policy;                        // TWIRC_OVERFLOW_*
+	char pad0[TWIRC_CACHE_LINE];
+	size_t head;                       // Next position to push (atomic)
+	char pad1[TWIRC_CACHE_LINE - sizeof(size_t)];
+	size_t tail;                       // Next position to pop (atomic)
+	char pad2[TWIRC_CACHE_LINE - sizeof(size_t)];
+	size_t pushed;                     // Events pushed (atomic)
+	size_t dropped;                    // Events dropped (atomic)
+	size_t max_depth;                  // Highest depth seen (atomic)
+	int waiting;                       // Consumers asleep (atomic)
+	int stop;                          // Consumers should stop
+	pthread_mutex_t lock;              // For consumers to sleep on
+	pthread_cond_t wake;               // Wakes up sleeping consumers
+	pthread_t *threads;                // Consumer threads
+	int num_threads;                   // Number of consumer threads
+};
+
+// Commands that can be sent to a runtime's workers
+#define TWIRC_RUNTIME_JOIN 0               // Join a channel
+#define TWIRC_RUNTIME_PART 1               // Leave a channel
+
+struct libtwirc_cmd
+{
+	struct libtwirc_cmd *next;         // Next command in the mailbox
+	int op;                            // TWIRC_RUNTIME_*
+	int conn;                          // Index of the connection
+	char chan[];                       // Channel to join/part
+};
+
+struct libtwirc_conn
+{
+	twirc_state_t *state;              // The connection
+	char **joins;                      // Channels waiting to be joined
+	size_t num;                        // Number of channels in joins
+	size_t size;                       // Number of slots in joins
+};
+
+struct libtwirc_worker
+{
+	twirc_runtime_t *rt;               // Runtime the worker belongs to
+	int id;                            // Index of the worker
+	pthread_t thread;                  // The worker thread
+	int started;                       // Has the thread been started?
+	twirc_pool_t *pool;                // Pool with all connections
+	struct libtwirc_conn *conns;       // Connections (num_conns)
+	int wake_fd;                       // eventfd to wake the worker
+	struct libtwirc_watch wake_watch;  // epoll data for wake_fd
+	pthread_mutex_t lock;              // Protects the mailbox
+	struct libtwirc_cmd *cmds;         // Mailbox
+	struct libtwirc_cmd **cmds_tail;   // Where to append to the mailbox
+};
+
+struct twirc_runtime
+{
+	struct libtwirc_worker *workers;   // Worker threads
+	int num_workers;                   // Number of workers
+	int num_conns;                     // Connections per worker
+	int stop;                          // Workers should stop (atomic)
+	char *host;                        // Login data for all connections
+	char *port;
+	char *nick;
+	char *pass;
+};
+
 struct twirc_state
 {
 	int status : 8;                    // Connection/login status
 	int ip_type;                       // IP type, IPv4 or IPv6
+	twirc_socket_opts_t sockopts;      // Options for sockets we create
 	int socket_fd;                     // TCP socket file descriptor
 	char *buffer;                      // IRC message buffer
+	size_t buf_size;                   // Size of buffer, in bytes
+	size_t buf_len;                    // Bytes of data in buffer
+	size_t buf_scan;                   // Bytes known to hold no '\n'
+	int buf_skip;                      // Skipping an oversized message?
+	char *out;                         // Outbound queue
+	size_t out_size;                   // Size of out, in bytes
+	size_t out_head;                   // Bytes of out already sent
+	size_t out_len;                    // Bytes of data in out
+	size_t out_max;                    // Queue no more than this
+	struct libtwirc_bucket rate[TWIRC_RATE_COUNT]; // Rate limits
+	struct libtwirc_pending *pend_head; // Messages held back by rate limits
+	struct libtwirc_pending **pend_tail; // Where to append the next one
+	size_t pend_len;                   // Bytes of pending messages
+	int pend_busy;                     // Sending pending messages?
+	int timer_fd;                      // timerfd for the rate limiter
+	uint64_t timer_due;                // When the timer goes off (ms), or 0
+	int dns_fd;                        // eventfd, signalled once resolved
+	struct libtwirc_dns_entry *dns;    // Lookup we're waiting for, if any
+	twirc_state_t *dns_next;           // Next state waiting for it
+	struct libtwirc_race race;         // Connect attempts in progress
+	unsigned reconnect_min;            // Reconnect within (ms), 0 if disabled
+	unsigned reconnect_max;            // Longest delay to reconnect (ms)
+	unsigned reconnect_tries;          // Attempts since we last logged in
+	uint64_t reconnect_at;             // When to reconnect (ms), or 0
+	int quit;                          // Disconnected on purpose?
+	int handover;                      // Make before break on RECONNECT?
+	int handover_state;                // TWIRC_HANDOVER_* phase
+	twirc_state_t *shadow;             // Connection to take over from us
+	twirc_state_t *primary;            // State we'd take over from (shadow)
+	struct libtwirc_seen seen;         // Ids of messages delivered recently
+	int tls;                           // Connect with TLS?
+	struct ssl_ctx_st *tls_ctx;        // Own TLS context (SSL_CTX), if any
+	struct ssl_st *ssl;                // TLS session (SSL), once connected
+	int ktls;                          // TWIRC_KTLS_* done by the kernel
+	struct libtwirc_chans chans;       // What we know about channels
+	struct libtwirc_joins joins;       // Bulk join planner
+	struct libtwirc_arena arena;       // Memory for parsed messages
+	int lazy_tags;                     // Split tags only when requested?
+	int zero_copy;                     // Parse in the receive buffer?
+	unsigned long subs;                // Commands we need to parse (bits)
 	twirc_login_t login;               // IRC login data 
 	twirc_callbacks_t cbs;             // Event callbacks
 	int epfd;                          // epoll file descriptor
+	struct libtwirc_watch sock_watch;  // epoll data for socket_fd
+	struct libtwirc_watch timer_watch; // epoll data for timer_fd
+	struct libtwirc_watch dns_watch;   // epoll data for dns_fd
+	twirc_pool_t *pool;                // Pool we're part of, if any
+	int uring_slot;                    // Slot in the pool's io_uring, or -1
+	twirc_pipeline_t *pipeline;        // Where callbacks go, if anywhere
+	int external;                      // Driven by an external event loop?
+	twirc_interest_callback interest_cb; // Tells the loop what to watch
+	int ext_fd;                        // Socket last reported to the loop
+	int ext_interest;                  // Interest last reported to the loop
+	uint64_t ext_due;                  // Timer last reported to the loop
+	int eof;                           // Has the peer closed the connection?
+	uint64_t recv_ns;                  // When we last received data (ns)
+	pthread_mutex_t lock;              // Held while handling events (recursive)
 	int error;                         // Last error that occured
+#ifndef TWIRC_NO_STATS
+	twirc_stats_t stats;               // What we've been up to
+	struct libtwirc_window windows[2]; // Latencies, this and the last window
+#endif
 	void *context;                     // Pointer to user data
 };
 
@@ -25,8 +396,74 @@ struct twirc_state
  */
 
 static int libtwirc_send(twirc_state_t *s, const char *msg);
+static int libtwirc_flush(twirc_state_t *s);
+static int libtwirc_queue(twirc_state_t *s, const char *msg, size_t len);
+static int libtwirc_enqueue(twirc_state_t *s, const char *msg, size_t len);
+static int libtwirc_oom(twirc_state_t *s);
+static int libtwirc_joins_pump(twirc_state_t *s, uint64_t now, uint64_t *wait);
+static int libtwirc_watch(twirc_state_t *s, int epfd);
+static void libtwirc_unwatch(twirc_state_t *s, int epfd);
+static int libtwirc_handle_watch(struct epoll_event *epev);
+static void libtwirc_sigset(sigset_t *sigset);
 static int libtwirc_recv(twirc_state_t *s, char *buf, size_t len);
 static int libtwirc_auth(twirc_state_t *s);
 static int libtwirc_capreq(twirc_state_t *s);
+static char *libtwirc_arena_strndup(struct libtwirc_arena *a, const char *str, size_t len);
+static int libtwirc_split_tags(struct libtwirc_arena *a, twirc_event_t *evt, int lazy);
+static void libtwirc_unescape_tag(twirc_event_t *evt, size_t idx);
+static int libtwirc_reserve(twirc_state_t *s, size_t len);
+static int libtwirc_process_buffer(twirc_state_t *s);
+static void libtwirc_callback(twirc_state_t *s, twirc_callback cb, twirc_event_t *evt);
+static void libtwirc_on_disconnect(twirc_state_t *s);
+static int libtwirc_uring_flush(twirc_state_t *s);
+static int libtwirc_uring_attach(twirc_pool_t *p, twirc_state_t *s);
+static void libtwirc_uring_cancel(twirc_pool_t *p, twirc_state_t *s, int keep);
+static void libtwirc_uring_detach(twirc_pool_t *p, twirc_state_t *s);
+static int libtwirc_uring_tick(twirc_pool_t *p, int timeout);
+static void libtwirc_uring_free(struct libtwirc_uring *u);
+static int libtwirc_handle_event(twirc_state_t *s, struct epoll_event *epev);
+static void libtwirc_interest(twirc_state_t *s);
+static int libtwirc_dns_resolve(twirc_state_t *s, const char *host, const char *port);
+static int libtwirc_dns_done(twirc_state_t *s);
+static void libtwirc_dns_cancel(twirc_state_t *s);
+static int libtwirc_race_start(twirc_state_t *s, struct libtwirc_addr *addrs, size_t num);
+static int libtwirc_race_pump(twirc_state_t *s);
+static void libtwirc_race_wait(twirc_state_t *s, uint64_t now, uint64_t *wait);
+static int libtwirc_race_event(struct libtwirc_watch *w, struct epoll_event *epev);
+static int libtwirc_race_failed(twirc_state_t *s);
+static void libtwirc_race_free(twirc_state_t *s);
+static void libtwirc_reconnect_schedule(twirc_state_t *s);
+static void libtwirc_reconnect_pump(twirc_state_t *s);
+static void libtwirc_reconnect_wait(twirc_state_t *s, uint64_t now, uint64_t *wait);
+static void libtwirc_reconnect_rejoin(twirc_state_t *s);
+static void libtwirc_reconnect_now(twirc_state_t *s);
+static int libtwirc_timer(twirc_state_t *s);
+static int libtwirc_handover_pass(twirc_state_t *s, twirc_event_t *evt);
+static void libtwirc_handover_drop(twirc_state_t *s);
+static int libtwirc_handover_start(twirc_state_t *s);
+static void libtwirc_handover_join(twirc_state_t *sh);
+static void libtwirc_handover_pump(twirc_state_t *s);
+static void libtwirc_handover_wait(twirc_state_t *s, uint64_t *wait);
+static void libtwirc_handover_lost(twirc_state_t *s);
+static void libtwirc_handover_free(twirc_state_t *s);
+static int libtwirc_tls_handshake(twirc_state_t *s);
+static ssize_t libtwirc_tls_recv(twirc_state_t *s, char *buf, size_t len);
+static ssize_t libtwirc_tls_send(twirc_state_t *s, const char *buf, size_t len);
+static int libtwirc_tls_want_write(const twirc_state_t *s);
+static void libtwirc_tls_free(twirc_state_t *s);
+static void libtwirc_tls_copy(twirc_state_t *s, const twirc_state_t *from);
+static void libtwirc_sockopts_apply(twirc_state_t *s, int fd);
+static void libtwirc_sockopts_rearm(twirc_state_t *s);
+static uint64_t libtwirc_sockopts_stamp(const struct timespec *ts);
+static uint64_t libtwirc_stats_now();
+static void libtwirc_stats_recv(twirc_state_t *s, ssize_t res);
+static void libtwirc_stats_send(twirc_state_t *s, ssize_t res);
+static void libtwirc_stats_buffer(twirc_state_t *s);
+static void libtwirc_stats_queue(twirc_state_t *s);
+static void libtwirc_stats_msg(twirc_state_t *s, int outbound, int dropped);
+static void libtwirc_stats_parsed(twirc_state_t *s, uint64_t t0, size_t allocs);
+static void libtwirc_stats_command(twirc_state_t *s, int id);
+static void libtwirc_stats_callback(twirc_state_t *s, uint64_t t0);
+static void libtwirc_stats_latency(twirc_state_t *s, twirc_event_t *evt, uint64_t now);
 
 #endif
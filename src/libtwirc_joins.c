@@ -0,0 +1,319 @@
+#include <stdlib.h>     // NULL, malloc(), realloc(), free()
+#include <string.h>     // strlen(), memcpy()
+#include <stdint.h>     // uint64_t
+#include "libtwirc_internal.h"
+
+/*
+ * The bulk join planner takes care of joining a large number of channels.
+ * Instead of sending one JOIN per channel, we pack as many channels into one
+ * comma-separated "JOIN #a,#b,..." as the message size and the JOIN rate
+ * limit (see libtwirc_rate.c) allow. The next JOIN is only put together once
+ * the limit allows for more channels to be joined, so we never queue up more
+ * than we can send. Every channel then waits for the server to confirm the
+ * join, which it does with a ROOMSTATE (or our own JOIN coming back). If the
+ * server sends a NOTICE for the channel instead, or nothing at all for
+ * TWIRC_JOIN_TIMEOUT milliseconds, the join failed. Either way, the user's
+ * callback learns about it, together with the progress of the whole plan.
+ */
+
+/*
+ * Reports the result of joining chan to the user's callback, if any.
+ */
+static void
+libtwirc_joins_report(twirc_state_t *s, const char *chan, int result)
+{
+	struct libtwirc_joins *j = &s->joins;
+	j->done += 1;
+	if (j->cb)
+	{
+		j->cb(s, chan, result, j->done, j->num);
+	}
+}
+
+/*
+ * Frees all memory of the plan and resets it, so a new one can be started.
+ */
+static void
+libtwirc_joins_free(twirc_state_t *s)
+{
+	struct libtwirc_joins *j = &s->joins;
+	for (size_t i = 0; i < j->num; ++i)
+	{
+		free(j->names[i]);
+	}
+	free(j->names);
+	free(j->sent);
+	memset(j, 0, sizeof(struct libtwirc_joins));
+}
+
+/*
+ * Gives up on the plan, for example because the connection has been lost.
+ * All channels that haven't been joined yet (or that we're still waiting on)
+ * are marked to be rejoined on reconnect if rejoin is set, otherwise they're
+ * reported as failed. The plan is reset first, so that the callback can start
+ * a new one.
+ */
+static void
+libtwirc_joins_abort(twirc_state_t *s, int rejoin)
+{
+	struct libtwirc_joins j = s->joins;
+	memset(&s->joins, 0, sizeof(struct libtwirc_joins));
+
+	for (size_t i = j.oldest; i < j.num; ++i)
+	{
+		const char *name = j.names[i];
+		int create = rejoin && i >= j.next;
+		struct libtwirc_chan *c = libtwirc_chans_find(&s->chans, name, strlen(name), create);
+
+		// Sent ones we're not waiting on anymore have been reported
+		if (i < j.next && (c == NULL || !(c->flags & TWIRC_CHAN_JOINING)))
+		{
+			continue;
+		}
+		if (c != NULL)
+		{
+			c->flags &= ~TWIRC_CHAN_JOINING;
+		}
+
+		// They're as good as channels we were in, see libtwirc_reconnect.c
+		if (rejoin && c != NULL)
+		{
+			c->flags |= TWIRC_CHAN_REJOIN;
+			continue;
+		}
+
+		j.done += 1;
+		if (j.cb)
+		{
+			j.cb(s, name, TWIRC_JOIN_FAILED, j.done, j.num);
+		}
+	}
+
+	for (size_t i = 0; i < j.num; ++i)
+	{
+		free(j.names[i]);
+	}
+	free(j.names);
+	free(j.sent);
+}
+
+/*
+ * Adds num channels to the plan (starting a new one if there is none), all
+ * of which will be reported to cb. Channel names without the leading '#'
+ * will get one. Returns 0 on success, -1 if we ran out of memory.
+ */
+static int
+libtwirc_joins_add(twirc_state_t *s, const char **chans, size_t num, twirc_join_callback cb)
+{
+	struct libtwirc_joins *j = &s->joins;
+
+	if (j->num + num > j->size)
+	{
+		size_t size = j->size ? j->size : TWIRC_NUM_CHANS;
+		while (size < j->num + num)
+		{
+			size *= 2;
+		}
+		char **names = realloc(j->names, size * sizeof(char*));
+		if (names == NULL)
+		{
+			return libtwirc_oom(s);
+		}
+		j->names = names;
+		uint64_t *sent = realloc(j->sent, size * sizeof(uint64_t));
+		if (sent == NULL)
+		{
+			return libtwirc_oom(s);
+		}
+		j->sent = sent;
+		j->size = size;
+	}
+
+	for (size_t i = 0; i < num; ++i)
+	{
+		int hash = chans[i][0] != '#';
+		size_t len = strlen(chans[i]);
+		char *name = malloc(hash + len + 1);
+		if (name == NULL)
+		{
+			return libtwirc_oom(s);
+		}
+		name[0] = '#';
+		memcpy(name + hash, chans[i], len + 1);
+		j->names[j->num] = name;
+		j->sent[j->num] = 0;
+		j->num += 1;
+	}
+
+	j->cb = cb;
+	return 0;
+}
+
+/*
+ * Marks chan as joined (TWIRC_JOIN_OK) or failed (TWIRC_JOIN_FAILED) and
+ * reports it, if it is a channel of the plan that we're waiting for.
+ */
+static void
+libtwirc_joins_confirm(twirc_state_t *s, const char *chan, int result)
+{
+	if (s->joins.num == 0 || chan == NULL)
+	{
+		return;
+	}
+
+	struct libtwirc_chan *c = libtwirc_chans_find(&s->chans, chan, strlen(chan), 0);
+	if (c == NULL || !(c->flags & TWIRC_CHAN_JOINING))
+	{
+		return;
+	}
+	c->flags &= ~TWIRC_CHAN_JOINING;
+	libtwirc_joins_report(s, chan, result);
+}
+
+/*
+ * Does the planning, called whenever the rate limiter checks on its pending
+ * messages (at time now). Reports channels whose join has timed out and, if
+ * the JOIN rate limit allows it, sends the next JOIN. If there is anything
+ * to wait for, wait will be lowered to the number of milliseconds until then
+ * (unless it is lower already, 0 meaning not set). Names too long to fit
+ * into a JOIN are reported as failed right away. If the JOIN can't be sent,
+ * its channels are put back, to be tried again after TWIRC_JOIN_RETRY ms.
+ * Returns 1 if the plan has moved on (another JOIN has been sent, or channels
+ * have been given up on), 0 otherwise.
+ */
+static int
+libtwirc_joins_pump(twirc_state_t *s, uint64_t now, uint64_t *wait)
+{
+	struct libtwirc_joins *j = &s->joins;
+	if (j->num == 0)
+	{
+		return 0;
+	}
+
+	// Check the channels we've sent a JOIN for, oldest first
+	while (j->oldest < j->next)
+	{
+		const char *name = j->names[j->oldest];
+		struct libtwirc_chan *c = libtwirc_chans_find(&s->chans, name, strlen(name), 0);
+		if (c && (c->flags & TWIRC_CHAN_JOINING))
+		{
+			uint64_t due = j->sent[j->oldest] + TWIRC_JOIN_TIMEOUT;
+			if (due > now)
+			{
+				*wait = (*wait == 0 || due - now < *wait) ? due - now : *wait;
+				break;
+			}
+			c->flags &= ~TWIRC_CHAN_JOINING;
+			libtwirc_joins_report(s, name, TWIRC_JOIN_TIMEDOUT);
+		}
+		j->oldest += 1;
+	}
+
+	// All channels have been dealt with, the plan is done
+	if (j->oldest == j->num)
+	{
+		libtwirc_joins_free(s);
+		return 0;
+	}
+
+	if (j->next == j->num)
+	{
+		return 0;
+	}
+
+	// Don't add to JOINs still waiting on the rate limit (could be ours,
+	// which hasn't been sent yet, or the user's); we'll be back after
+	for (struct libtwirc_pending *p = s->pend_head; p != NULL; p = p->next)
+	{
+		if (p->buckets & TWIRC_RATE_MASK_JOIN)
+		{
+			return 0;
+		}
+	}
+
+	struct libtwirc_bucket *b = libtwirc_rate_bucket(s, TWIRC_RATE_JOIN);
+	unsigned slots = libtwirc_bucket_free(b, now);
+	if (slots == 0)
+	{
+		uint64_t ms = libtwirc_bucket_wait(b, 1, now);
+		*wait = (*wait == 0 || ms < *wait) ? ms : *wait;
+		return 0;
+	}
+
+	// Put together a JOIN with as many channels as we're allowed to join
+	// and that fit into one message
+	char line[TWIRC_JOIN_LINE + 1] = "JOIN ";
+	size_t len = 5;
+	size_t first = j->next;
+	unsigned added = 0;
+	while (j->next < j->num && added < slots)
+	{
+		const char *name = j->names[j->next];
+		size_t name_len = strlen(name);
+
+		// A name that doesn't even fit on its own can't be a channel;
+		// it's dealt with before the next JOIN, so that the channels
+		// of this one stay in one piece (see below)
+		if (5 + name_len > TWIRC_JOIN_LINE)
+		{
+			if (added > 0)
+			{
+				break;
+			}
+			j->sent[j->next] = now;
+			j->next += 1;
+			libtwirc_joins_report(s, name, TWIRC_JOIN_FAILED);
+			continue;
+		}
+
+		size_t sep = added > 0;
+		if (len + sep + name_len > TWIRC_JOIN_LINE)
+		{
+			break;
+		}
+
+		struct libtwirc_chan *c = libtwirc_chans_find(&s->chans, name, strlen(name), 1);
+		if (c == NULL)
+		{
+			break;
+		}
+		c->flags |= TWIRC_CHAN_JOINING;
+		j->sent[j->next] = now;
+
+		if (sep)
+		{
+			line[len++] = ',';
+		}
+		memcpy(line + len, name, name_len);
+		len += name_len;
+		j->next += 1;
+		added += 1;
+	}
+	line[len] = '\0';
+
+	// Even if there was nothing to join, we might have given up on some
+	if (added == 0)
+	{
+		return j->next > first;
+	}
+	if (libtwirc_send(s, line) == 0)
+	{
+		return 1;
+	}
+
+	// The JOIN never left (the queue might be full), so we'd wait for the
+	// server in vain; take the channels back and try again in a bit
+	for (size_t i = j->next - added; i < j->next; ++i)
+	{
+		const char *name = j->names[i];
+		struct libtwirc_chan *c = libtwirc_chans_find(&s->chans, name, strlen(name), 0);
+		if (c != NULL)
+		{
+			c->flags &= ~TWIRC_CHAN_JOINING;
+		}
+		j->sent[i] = 0;
+	}
+	j->next -= added;
+	*wait = (*wait == 0 || TWIRC_JOIN_RETRY < *wait) ? TWIRC_JOIN_RETRY : *wait;
+	return 0;
+}
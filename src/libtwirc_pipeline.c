@@ -0,0 +1,466 @@
+#include <stdlib.h>     // NULL, malloc(), calloc(), free()
+#include <string.h>     // strlen(), memcpy()
+#include <stdint.h>     // intptr_t
+#include <pthread.h>    // pthread_create(), pthread_join(), mutexes
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * A pipeline takes the user's callbacks off the thread that reads from the
+ * socket. Instead of calling them right away, every event is copied into a
+ * self-contained record, which is pushed onto a bounded ring buffer. Consumer
+ * threads pop the records and call the callbacks. A slow callback therefore
+ * doesn't hold up reading (and answering PINGs), it only makes the ring fill
+ * up; what happens once it's full is up to the pipeline's overflow policy.
+ * Our own event handlers still run on the reading thread, as they keep track
+ * of the state. The ring is lock-free, with a sequence number per slot, so
+ * that any number of threads (several states on several threads, say) can
+ * push and any number of consumers can pop. Consumers only take a lock to go
+ * to sleep when there is nothing to do. Callbacks that send something take
+ * the state's lock, which the reading thread holds while it handles events.
+ */
+
+/*
+ * Returns the number of bytes needed to copy str, 0 if it is NULL.
+ */
+static size_t
+libtwirc_record_len(const char *str)
+{
+	return str ? strlen(str) + 1 : 0;
+}
+
+/*
+ * Copies str to *pos, advancing *pos past the copy. Returns the copy, or NULL
+ * if str is NULL.
+ */
+static char*
+libtwirc_record_str(char **pos, const char *str)
+{
+	if (str == NULL)
+	{
+		return NULL;
+	}
+	size_t len = strlen(str) + 1;
+	char *copy = memcpy(*pos, str, len);
+	*pos += len;
+	return copy;
+}
+
+/*
+ * Returns a record that holds cb, as well as a copy of evt (which can be NULL)
+ * with all of its strings and arrays, in one block of memory, so it stays
+ * valid after the state has moved on. Returns NULL if we ran out of memory.
+ */
+static struct libtwirc_record*
+libtwirc_record_new(twirc_state_t *s, twirc_callback cb, twirc_event_t *evt)
+{
+	size_t size = sizeof(struct libtwirc_record);
+	if (evt)
+	{
+		// The consumer can't split the tags on the state's arena, so
+		// that needs to happen here, if tags are parsed lazily
+		twirc_get_tags(evt);
+
+		size += sizeof(twirc_event_t);
+		size += (evt->num_params + 1) * sizeof(char*);
+		size += (evt->num_tags + 1) * sizeof(twirc_tag_t*);
+		size += evt->num_tags * sizeof(twirc_tag_t);
+		size += libtwirc_record_len(evt->raw);
+		size += libtwirc_record_len(evt->prefix);
+		size += libtwirc_record_len(evt->command);
+		size += libtwirc_record_len(evt->origin);
+		size += libtwirc_record_len(evt->channel);
+		size += libtwirc_record_len(evt->target);
+		size += libtwirc_record_len(evt->message);
+		size += libtwirc_record_len(evt->ctcp);
+		for (size_t i = 0; i < evt->num_params; ++i)
+		{
+			size += libtwirc_record_len(evt->params[i]);
+		}
+		for (size_t i = 0; evt->tags && i < evt->num_tags; ++i)
+		{
+			size += libtwirc_record_len(evt->tags[i]->key);
+			size += libtwirc_record_len(evt->tags[i]->value);
+		}
+	}
+
+	struct libtwirc_record *rec = malloc(size);
+	if (rec == NULL)
+	{
+		return NULL;
+	}
+	rec->state = s;
+	rec->cb    = cb;
+	rec->evt   = NULL;
+	if (evt == NULL)
+	{
+		return rec;
+	}
+
+	// The event comes first, then the arrays (all pointer-aligned), then
+	// the strings
+	twirc_event_t *copy = (twirc_event_t *) (rec + 1);
+	*copy = *evt;
+	copy->tag_block   = NULL;
+	copy->tag_escaped = NULL;
+
+	copy->params = (char **) (copy + 1);
+	twirc_tag_t **tags = (twirc_tag_t **) (copy->params + evt->num_params + 1);
+	twirc_tag_t *tag = (twirc_tag_t *) (tags + evt->num_tags + 1);
+	char *pos = (char *) (tag + evt->num_tags);
+
+	copy->raw     = libtwirc_record_str(&pos, evt->raw);
+	copy->prefix  = libtwirc_record_str(&pos, evt->prefix);
+	copy->command = libtwirc_record_str(&pos, evt->command);
+	copy->origin  = libtwirc_record_str(&pos, evt->origin);
+	copy->channel = libtwirc_record_str(&pos, evt->channel);
+	copy->target  = libtwirc_record_str(&pos, evt->target);
+	copy->message = libtwirc_record_str(&pos, evt->message);
+	copy->ctcp    = libtwirc_record_str(&pos, evt->ctcp);
+	for (size_t i = 0; i < evt->num_params; ++i)
+	{
+		copy->params[i] = libtwirc_record_str(&pos, evt->params[i]);
+	}
+	copy->params[evt->num_params] = NULL;
+
+	copy->tags = NULL;
+	if (evt->tags)
+	{
+		for (size_t i = 0; i < evt->num_tags; ++i)
+		{
+			tag[i].key   = libtwirc_record_str(&pos, evt->tags[i]->key);
+			tag[i].value = libtwirc_record_str(&pos, evt->tags[i]->value);
+			tags[i] = &tag[i];
+		}
+		tags[evt->num_tags] = NULL;
+		copy->tags = tags;
+	}
+	copy->tag_list = copy->tags;
+
+	rec->evt = copy;
+	return rec;
+}
+
+/*
+ * Puts rec into the next free slot of the ring. Returns 0 on success, -1 if
+ * the ring is full.
+ */
+static int
+libtwirc_ring_push(twirc_pipeline_t *p, struct libtwirc_record *rec)
+{
+	size_t pos = __atomic_load_n(&p->head, __ATOMIC_RELAXED);
+	struct libtwirc_slot *slot;
+	while (1)
+	{
+		slot = &p->slots[pos & p->mask];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+		// The slot is free; claim it, unless someone beat us to it
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&p->head, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		// The slot still holds a record from one lap ago, we're full
+		else if (diff < 0)
+		{
+			return -1;
+		}
+		else
+		{
+			pos = __atomic_load_n(&p->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->rec = rec;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Takes the oldest record out of the ring. Returns NULL if it is empty.
+ */
+static struct libtwirc_record*
+libtwirc_ring_pop(twirc_pipeline_t *p)
+{
+	size_t pos = __atomic_load_n(&p->tail, __ATOMIC_RELAXED);
+	struct libtwirc_slot *slot;
+	while (1)
+	{
+		slot = &p->slots[pos & p->mask];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+		// The slot holds a record; take it, unless someone beat us
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&p->tail, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		// Nothing has been pushed into this slot yet, we're empty
+		else if (diff < 0)
+		{
+			return NULL;
+		}
+		else
+		{
+			pos = __atomic_load_n(&p->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	struct libtwirc_record *rec = slot->rec;
+	__atomic_store_n(&slot->seq, pos + p->mask + 1, __ATOMIC_RELEASE);
+	return rec;
+}
+
+/*
+ * Hands the callback cb, to be called with s and a copy of evt, over to the
+ * pipeline p; what happens if it is full depends on the overflow policy.
+ * Returns 0 if the record has been pushed (or dropped), -1 if the caller
+ * should call cb itself (TWIRC_OVERFLOW_INLINE, or we ran out of memory).
+ */
+static int
+libtwirc_pipeline_push(twirc_pipeline_t *p, twirc_state_t *s, twirc_callback cb, twirc_event_t *evt)
+{
+	struct libtwirc_record *rec = libtwirc_record_new(s, cb, evt);
+	if (rec == NULL)
+	{
+		return -1;
+	}
+
+	while (libtwirc_ring_push(p, rec) == -1)
+	{
+		if (p->policy == TWIRC_OVERFLOW_INLINE)
+		{
+			free(rec);
+			return -1;
+		}
+		if (p->policy == TWIRC_OVERFLOW_DROP_NEWEST)
+		{
+			__atomic_add_fetch(&p->dropped, 1, __ATOMIC_RELAXED);
+			free(rec);
+			return 0;
+		}
+
+		// TWIRC_OVERFLOW_DROP_OLDEST: make room, then try again; a
+		// consumer might make room before we do, which is fine as well
+		struct libtwirc_record *old = libtwirc_ring_pop(p);
+		if (old)
+		{
+			__atomic_add_fetch(&p->dropped, 1, __ATOMIC_RELAXED);
+			free(old);
+		}
+	}
+	__atomic_add_fetch(&p->pushed, 1, __ATOMIC_RELAXED);
+
+	// Remember how deep the queue got
+	size_t depth = twirc_pipeline_get_depth(p);
+	size_t max = __atomic_load_n(&p->max_depth, __ATOMIC_RELAXED);
+	while (depth > max && !__atomic_compare_exchange_n(&p->max_depth, &max, depth, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+		// max has been updated, try again
+	}
+
+	// Wake up a consumer, if any are sleeping; the fence makes sure that
+	// a consumer that is about to sleep either sees our record or is
+	// seen by us (it checks the ring after announcing that it waits)
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&p->waiting, __ATOMIC_RELAXED) > 0)
+	{
+		pthread_mutex_lock(&p->lock);
+		pthread_cond_signal(&p->wake);
+		pthread_mutex_unlock(&p->lock);
+	}
+	return 0;
+}
+
+/*
+ * Waits for the next record and returns it. Returns NULL once the pipeline
+ * has been asked to stop and the ring is empty.
+ */
+static struct libtwirc_record*
+libtwirc_pipeline_pop(twirc_pipeline_t *p)
+{
+	struct libtwirc_record *rec = libtwirc_ring_pop(p);
+	if (rec)
+	{
+		return rec;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	__atomic_add_fetch(&p->waiting, 1, __ATOMIC_SEQ_CST);
+	while ((rec = libtwirc_ring_pop(p)) == NULL && !p->stop)
+	{
+		pthread_cond_wait(&p->wake, &p->lock);
+	}
+	__atomic_sub_fetch(&p->waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&p->lock);
+	return rec;
+}
+
+/*
+ * A consumer thread: calls the callbacks of all records it can get its hands
+ * on, until the pipeline is stopped and there are none left.
+ */
+static void*
+libtwirc_pipeline_run(void *arg)
+{
+	twirc_pipeline_t *p = arg;
+	struct libtwirc_record *rec;
+	while ((rec = libtwirc_pipeline_pop(p)) != NULL)
+	{
+		libtwirc_stats_latency(rec->state, rec->evt, libtwirc_stats_now());
+		rec->cb(rec->state, rec->evt);
+		free(rec);
+	}
+	return NULL;
+}
+
+/*
+ * Returns a pointer to a new pipeline, which can hold up to size events (will
+ * be rounded up to a power of two; 0 means TWIRC_PIPELINE_SIZE) and has
+ * num_threads consumer threads that call the callbacks. policy decides what
+ * happens to events that come in while the pipeline is full, see the
+ * TWIRC_OVERFLOW_* constants. Returns NULL if any errors occur.
+ */
+twirc_pipeline_t*
+twirc_pipeline_init(size_t size, int num_threads, int policy)
+{
+	if (num_threads < 1)
+	{
+		return NULL;
+	}
+
+	twirc_pipeline_t *p = calloc(1, sizeof(twirc_pipeline_t));
+	if (p == NULL) { return NULL; }
+
+	size_t slots = 2;
+	while (slots < (size ? size : TWIRC_PIPELINE_SIZE))
+	{
+		slots *= 2;
+	}
+	p->slots = malloc(slots * sizeof(struct libtwirc_slot));
+	p->threads = calloc(num_threads, sizeof(pthread_t));
+	if (p->slots == NULL || p->threads == NULL)
+	{
+		free(p->slots);
+		free(p->threads);
+		free(p);
+		return NULL;
+	}
+	for (size_t i = 0; i < slots; ++i)
+	{
+		p->slots[i].seq = i;
+		p->slots[i].rec = NULL;
+	}
+	p->mask   = slots - 1;
+	p->policy = policy;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+
+	for (int i = 0; i < num_threads; ++i)
+	{
+		if (pthread_create(&p->threads[i], NULL, libtwirc_pipeline_run, p) != 0)
+		{
+			twirc_pipeline_free(p);
+			return NULL;
+		}
+		p->num_threads += 1;
+	}
+	return p;
+}
+
+/*
+ * Has the callbacks of the state s called by the consumer threads of the
+ * pipeline p, or right away again if p is NULL. This should be done before
+ * the state is connected. Several states can share one pipeline. Callbacks
+ * will then be called on other threads and (with more than one consumer) in
+ * no particular order; events handed to them are copies that belong to the
+ * callback, so they stay valid even after the callback returned. Sending is
+ * safe from any thread, the state takes care of locking.
+ */
+void
+twirc_set_pipeline(twirc_state_t *s, twirc_pipeline_t *p)
+{
+	s->pipeline = p;
+}
+
+/*
+ * Returns the number of events that are waiting to be handed to callbacks.
+ */
+size_t
+twirc_pipeline_get_depth(twirc_pipeline_t *p)
+{
+	size_t head = __atomic_load_n(&p->head, __ATOMIC_RELAXED);
+	size_t tail = __atomic_load_n(&p->tail, __ATOMIC_RELAXED);
+	return head > tail ? head - tail : 0;
+}
+
+/*
+ * Returns the highest number of events that have been waiting at once.
+ */
+size_t
+twirc_pipeline_get_max_depth(twirc_pipeline_t *p)
+{
+	return __atomic_load_n(&p->max_depth, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the number of events that have been pushed into the pipeline.
+ */
+size_t
+twirc_pipeline_get_pushed(twirc_pipeline_t *p)
+{
+	return __atomic_load_n(&p->pushed, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the number of events that have been dropped, as the pipeline was
+ * full (with TWIRC_OVERFLOW_DROP_NEWEST or TWIRC_OVERFLOW_DROP_OLDEST).
+ */
+size_t
+twirc_pipeline_get_dropped(twirc_pipeline_t *p)
+{
+	return __atomic_load_n(&p->dropped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Waits for the consumers to handle all events that are still waiting, then
+ * stops them and frees the pipeline. The states that used the pipeline must
+ * not be connected anymore (or have their pipeline set to NULL) and must not
+ * be free'd before this has been done, as waiting events still refer to them.
+ */
+void
+twirc_pipeline_free(twirc_pipeline_t *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+
+	for (int i = 0; i < p->num_threads; ++i)
+	{
+		pthread_join(p->threads[i], NULL);
+	}
+
+	// Only left if there never were any consumers
+	struct libtwirc_record *rec;
+	while ((rec = libtwirc_ring_pop(p)) != NULL)
+	{
+		free(rec);
+	}
+
+	pthread_cond_destroy(&p->wake);
+	pthread_mutex_destroy(&p->lock);
+	free(p->threads);
+	free(p->slots);
+	free(p);
+}
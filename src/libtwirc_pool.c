@@ -0,0 +1,235 @@
+#include <stdlib.h>     // NULL, malloc(), realloc(), free()
+#include <string.h>     // memset()
+#include <unistd.h>     // close()
+#include <sys/epoll.h>  // epoll_create(), epoll_pwait()
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * A pool drives any number of states with one epoll instance, so that a
+ * single thread can run hundreds of connections with one epoll_pwait() call
+ * per tick, instead of one epoll instance and one loop per connection. Every
+ * epoll event carries a pointer to a watch, which tells us what state (and
+ * which of its files) it is about, so it can be handed to the right state.
+ */
+
+/*
+ * Returns a pointer to a new, empty pool or NULL if an error occured.
+ */
+twirc_pool_t*
+twirc_pool_init()
+{
+	twirc_pool_t *p = malloc(sizeof(twirc_pool_t));
+	if (p == NULL) { return NULL; }
+	memset(p, 0, sizeof(twirc_pool_t));
+
+	p->epfd = epoll_create(1);
+	if (p->epfd < 0)
+	{
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+/*
+ * Adds the state s to the pool p. This can be done before or after the state
+ * has been connected; from then on, the state will use the pool's epoll
+ * instance and its events will be handled by twirc_pool_tick(). A state can
+ * only be part of one pool; if it is part of another pool, it will be moved.
+ * Returns 0 on success, -1 on error (check the state's error).
+ */
+int
+twirc_pool_add(twirc_pool_t *p, twirc_state_t *s)
+{
+	if (s->pool == p)
+	{
+		return 0;
+	}
+	if (s->pool && twirc_pool_remove(s->pool, s) == -1)
+	{
+		return -1;
+	}
+
+	// A handover in progress is watched by the epoll instance we leave
+	libtwirc_handover_drop(s);
+
+	if (p->num == p->size)
+	{
+		size_t size = p->size ? 2 * p->size : TWIRC_NUM_CHANS;
+		twirc_state_t **states = realloc(p->states, size * sizeof(twirc_state_t*));
+		if (states == NULL)
+		{
+			return libtwirc_oom(s);
+		}
+		p->states = states;
+		p->size   = size;
+	}
+
+	// With io_uring, the socket gets a slot in the ring instead of EPOLLIN
+	// (unless it carries TLS, which the ring couldn't decrypt)
+	if (p->uring && !s->tls && libtwirc_uring_attach(p, s) == -1)
+	{
+		return -1;
+	}
+
+	if (libtwirc_watch(s, p->epfd) == -1)
+	{
+		// Don't leave anything behind in the pool's epoll instance or
+		// ring, the state isn't part of the pool after all
+		libtwirc_unwatch(s, p->epfd);
+		if (s->uring_slot != -1)
+		{
+			libtwirc_uring_detach(p, s);
+		}
+		return -1;
+	}
+
+	// The state's own epoll instance isn't needed anymore
+	if (s->epfd != -1)
+	{
+		close(s->epfd);
+	}
+	s->epfd = p->epfd;
+	s->pool = p;
+	p->states[p->num++] = s;
+	return 0;
+}
+
+/*
+ * Removes the state s from the pool p. The state gets its own epoll instance
+ * again, so it can be driven by twirc_tick() afterwards. This can be done
+ * from within a callback, even one of the state that is being removed.
+ * Returns 0 on success, -1 on error (state not in pool or epoll error).
+ */
+int
+twirc_pool_remove(twirc_pool_t *p, twirc_state_t *s)
+{
+	size_t i = 0;
+	while (i < p->num && p->states[i] != s)
+	{
+		++i;
+	}
+	if (i == p->num)
+	{
+		return -1;
+	}
+	p->states[i] = p->states[--p->num];
+
+	libtwirc_handover_drop(s);
+	libtwirc_unwatch(s, p->epfd);
+	if (s->uring_slot != -1)
+	{
+		libtwirc_uring_detach(p, s);
+	}
+
+	// Forget about events of this state that are still to be handled
+	for (int e = p->cur_event + 1; e < p->num_events; ++e)
+	{
+		struct libtwirc_watch *w = p->events[e].data.ptr;
+		if (w && w->state == s)
+		{
+			p->events[e].data.ptr = NULL;
+		}
+	}
+
+	s->pool = NULL;
+	s->epfd = epoll_create(1);
+	if (s->epfd < 0)
+	{
+		s->error = TWIRC_ERR_EPOLL_CREATE;
+		return -1;
+	}
+	return libtwirc_watch(s, s->epfd);
+}
+
+/*
+ * Waits timeout milliseconds for events to happen on any of the connections
+ * of the pool and handles up to TWIRC_POOL_EVENTS of them, each by the state
+ * it belongs to. If a connection is lost, its state will call its disconnect
+ * callback, as usual, but the pool will carry on with the other states.
+ * Returns 0 if all events have been handled, -1 if epoll_pwait() failed (see
+ * errno; for example, EINTR if a signal has been caught).
+ */
+int
+twirc_pool_tick(twirc_pool_t *p, int timeout)
+{
+	if (p->uring)
+	{
+		return libtwirc_uring_tick(p, timeout);
+	}
+
+	// Block the same signals twirc_tick() does
+	sigset_t sigset;
+	libtwirc_sigset(&sigset);
+
+	int num_events = epoll_pwait(p->epfd, p->events, TWIRC_POOL_EVENTS, timeout, &sigset);
+	if (num_events == -1)
+	{
+		return -1;
+	}
+
+	p->num_events = num_events;
+	for (p->cur_event = 0; p->cur_event < p->num_events; ++p->cur_event)
+	{
+		libtwirc_handle_watch(&p->events[p->cur_event]);
+	}
+	p->num_events = 0;
+	p->cur_event  = 0;
+	return 0;
+}
+
+/*
+ * Runs a loop that waits for and processes events of all states in the pool
+ * until none of them is connected (or connecting, or waiting to reconnect)
+ * anymore, or twirc_pool_tick() returned -1. Returns the number of states
+ * that are still connected.
+ */
+int
+twirc_pool_loop(twirc_pool_t *p)
+{
+	int active = 0;
+	do
+	{
+		active = 0;
+		for (size_t i = 0; i < p->num; ++i)
+		{
+			twirc_state_t *s = p->states[i];
+			active += s->status != TWIRC_STATUS_DISCONNECTED || twirc_is_reconnecting(s);
+		}
+	}
+	while (active && twirc_pool_tick(p, -1) == 0);
+
+	int connected = 0;
+	for (size_t i = 0; i < p->num; ++i)
+	{
+		connected += twirc_is_connected(p->states[i]);
+	}
+	return connected;
+}
+
+/*
+ * Frees the pool. The states in it are not free'd, but they are removed from
+ * the pool. They can't be driven by twirc_tick() until they've been connected
+ * again (or have been added to another pool).
+ */
+void
+twirc_pool_free(twirc_pool_t *p)
+{
+	for (size_t i = 0; i < p->num; ++i)
+	{
+		if (p->states[i]->uring_slot != -1)
+		{
+			libtwirc_uring_detach(p, p->states[i]);
+		}
+		p->states[i]->pool = NULL;
+		p->states[i]->epfd = -1;
+	}
+	if (p->uring)
+	{
+		libtwirc_uring_free(p->uring);
+	}
+	close(p->epfd);
+	free(p->states);
+	free(p);
+}
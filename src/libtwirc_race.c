@@ -0,0 +1,272 @@
+#include <stdlib.h>     // NULL, malloc(), free()
+#include <string.h>     // memcpy()
+#include <stddef.h>     // offsetof()
+#include <sys/epoll.h>  // epoll_ctl()
+#include <sys/socket.h> // getpeername()
+#include "tcpsock.h"
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * Connecting to the first address a host resolves to only works out if that
+ * address does; if it's unreachable, or just slow, we'd wait for the kernel
+ * to give up on it, which takes minutes. Instead, we try all addresses,
+ * alternating between IPv6 and IPv4, and start the next attempt every
+ * TWIRC_CONNECT_DELAY ms (or as soon as one fails), without giving up on the
+ * ones in progress (up to TWIRC_CONNECT_ATTEMPTS at once). The first socket
+ * to connect wins and becomes the state's socket, all others are closed (see
+ * RFC 8305, "Happy Eyeballs"). Attempts are watched by the state's epoll
+ * instance; the rate limiter's timer tells us when to start the next one. As
+ * an external event loop only watches the one socket, states driven by one
+ * try the addresses one after the other.
+ */
+
+/*
+ * Reorders the num addresses addrs so that address families alternate,
+ * starting with the family of the first one, but otherwise keeps the order
+ * that getaddrinfo() sorted them in (by preference).
+ */
+static void
+libtwirc_race_sort(struct libtwirc_addr *addrs, size_t num)
+{
+	struct libtwirc_addr *sorted = malloc(num * sizeof(struct libtwirc_addr));
+	if (sorted == NULL)
+	{
+		// Not a problem, we'll just have to try them as they are
+		return;
+	}
+
+	int first = addrs[0].addr.ss_family;
+	size_t same  = 0; // Next address of the first family
+	size_t other = 0; // Next address of any other family
+	for (size_t i = 0; i < num; ++i)
+	{
+		while (same < num && addrs[same].addr.ss_family != first)
+		{
+			++same;
+		}
+		while (other < num && addrs[other].addr.ss_family == first)
+		{
+			++other;
+		}
+		int pick_same = (i % 2 == 0 && same < num) || other == num;
+		sorted[i] = pick_same ? addrs[same++] : addrs[other++];
+	}
+
+	memcpy(addrs, sorted, num * sizeof(struct libtwirc_addr));
+	free(sorted);
+}
+
+/*
+ * Starts an attempt to connect to the next address, using a free attempt
+ * slot. Returns 0 if the connection is in progress, -1 if the attempt failed
+ * right away.
+ */
+static int
+libtwirc_race_attempt(twirc_state_t *s)
+{
+	struct libtwirc_race *r = &s->race;
+	struct libtwirc_addr *a = &r->addrs[r->next];
+	r->next += 1;
+
+	struct libtwirc_attempt *at = r->attempts;
+	while (at->fd != -1)
+	{
+		++at;
+	}
+
+	int fd = tcpsock_create(a->addr.ss_family, TCPSOCK_NONBLOCK);
+	if (fd == -1)
+	{
+		return -1;
+	}
+	libtwirc_sockopts_apply(s, fd);
+	if (tcpsock_connect_addr(fd, (const struct sockaddr *) &a->addr, a->len) == -1)
+	{
+		tcpsock_close(fd);
+		return -1;
+	}
+
+	// An external event loop gets to watch the attempt as the socket
+	if (s->external)
+	{
+		s->socket_fd = fd;
+	}
+	else
+	{
+		struct epoll_event eev = { 0 };
+		eev.data.ptr = &at->watch;
+		eev.events = EPOLLOUT | EPOLLET;
+		if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &eev) == -1)
+		{
+			tcpsock_close(fd);
+			return -1;
+		}
+		at->fd = fd;
+	}
+
+	r->active += 1;
+	r->next_at = libtwirc_now_ms() + TWIRC_CONNECT_DELAY;
+	return 0;
+}
+
+/*
+ * Starts the next attempt(s), if it's time for that: if there is no attempt
+ * in progress, or the last one has been going for TWIRC_CONNECT_DELAY ms.
+ * Returns 0 on success, -1 if all attempts have failed (the error will be
+ * set to TWIRC_ERR_SOCKET_CONNECT).
+ */
+static int
+libtwirc_race_pump(twirc_state_t *s)
+{
+	struct libtwirc_race *r = &s->race;
+	if (r->num == 0)
+	{
+		return 0;
+	}
+
+	uint64_t now = libtwirc_now_ms();
+	while (r->next < r->num && (r->active == 0 || (!s->external &&
+	       r->active < TWIRC_CONNECT_ATTEMPTS && now >= r->next_at)))
+	{
+		libtwirc_race_attempt(s);
+	}
+
+	if (r->active == 0)
+	{
+		libtwirc_race_free(s);
+		s->error = TWIRC_ERR_SOCKET_CONNECT;
+		return -1;
+	}
+
+	// Have the timer go off for the next attempt, unless it will earlier
+	if (!s->external && r->next < r->num && r->active < TWIRC_CONNECT_ATTEMPTS)
+	{
+		if (s->timer_due == 0 || r->next_at < s->timer_due)
+		{
+			libtwirc_rate_arm(s, r->next_at - now);
+		}
+	}
+	libtwirc_interest(s);
+	return 0;
+}
+
+/*
+ * Lowers wait to the number of ms until the next attempt should be started,
+ * unless it is lower already (0 meaning no wait has been set yet), so that
+ * the rate limiter doesn't push its timer past that.
+ */
+static void
+libtwirc_race_wait(twirc_state_t *s, uint64_t now, uint64_t *wait)
+{
+	struct libtwirc_race *r = &s->race;
+	if (r->num == 0 || s->external || r->next == r->num ||
+	    r->active == TWIRC_CONNECT_ATTEMPTS)
+	{
+		return;
+	}
+	uint64_t ms = r->next_at > now ? r->next_at - now : 1;
+	*wait = (*wait == 0 || ms < *wait) ? ms : *wait;
+}
+
+/*
+ * Starts connecting the state s to the num addresses addrs, which we take
+ * ownership of. Returns 0 on success (at least one attempt is in progress),
+ * -1 if all attempts have failed right away.
+ */
+static int
+libtwirc_race_start(twirc_state_t *s, struct libtwirc_addr *addrs, size_t num)
+{
+	libtwirc_race_free(s);
+	libtwirc_race_sort(addrs, num);
+	s->race.addrs = addrs;
+	s->race.num   = num;
+	return libtwirc_race_pump(s);
+}
+
+/*
+ * Handles the epoll event epev of an attempt (the watch w). If it failed,
+ * the next one is started right away; if it connected, its socket becomes
+ * the state's socket and all other attempts are given up on. Returns 0 on
+ * success, -1 if all attempts have failed.
+ */
+static int
+libtwirc_race_event(struct libtwirc_watch *w, struct epoll_event *epev)
+{
+	struct libtwirc_attempt *at = (struct libtwirc_attempt *)
+		((char *) w - offsetof(struct libtwirc_attempt, watch));
+	twirc_state_t *s = w->state;
+
+	// Given up on already
+	if (s->race.num == 0 || at->fd == -1)
+	{
+		return 0;
+	}
+
+	if ((epev->events & (EPOLLERR | EPOLLHUP)) || tcpsock_status(at->fd) == -1)
+	{
+		tcpsock_close(at->fd);
+		at->fd = -1;
+		s->race.active -= 1;
+		return libtwirc_race_pump(s) == 0 ? 0 : libtwirc_race_failed(s);
+	}
+
+	// The event might have been meant for an attempt that used the same
+	// slot before (and has been given up on since), so make sure
+	struct sockaddr_storage peer;
+	socklen_t len = sizeof(peer);
+	if (getpeername(at->fd, (struct sockaddr *) &peer, &len) == -1)
+	{
+		return 0;
+	}
+
+	// We have a winner; it's going to be watched like any state's socket,
+	// which will report it as writable and have us go on from there
+	int fd = at->fd;
+	struct epoll_event eev = { 0 };
+	epoll_ctl(s->epfd, EPOLL_CTL_DEL, fd, &eev);
+	at->fd = -1;
+	libtwirc_race_free(s);
+
+	s->socket_fd = fd;
+	if (libtwirc_watch(s, s->epfd) == -1)
+	{
+		return libtwirc_race_failed(s);
+	}
+	return 0;
+}
+
+/*
+ * Calls the disconnect event handlers for a state that couldn't connect to
+ * any of the addresses. Returns -1.
+ */
+static int
+libtwirc_race_failed(twirc_state_t *s)
+{
+	libtwirc_on_disconnect(s);
+	libtwirc_callback(s, s->cbs.disconnect, NULL);
+	return -1;
+}
+
+/*
+ * Gives up on all attempts that are still in progress.
+ */
+static void
+libtwirc_race_free(twirc_state_t *s)
+{
+	struct libtwirc_race *r = &s->race;
+	for (size_t i = 0; i < TWIRC_CONNECT_ATTEMPTS; ++i)
+	{
+		if (r->attempts[i].fd != -1)
+		{
+			tcpsock_close(r->attempts[i].fd);
+			r->attempts[i].fd = -1;
+		}
+	}
+	free(r->addrs);
+	r->addrs   = NULL;
+	r->num     = 0;
+	r->next    = 0;
+	r->active  = 0;
+	r->next_at = 0;
+}
@@ -0,0 +1,560 @@
+#include <stdlib.h>     // NULL, malloc(), calloc(), free()
+#include <string.h>     // memcpy(), strncmp()
+#include <stdint.h>     // uint64_t
+#include <limits.h>     // UINT_MAX
+#include <time.h>       // clock_gettime()
+#include <sys/timerfd.h>// timerfd_settime()
+#include "libtwirc_internal.h"
+
+/*
+ * Twitch mutes accounts that send too many messages for 30 minutes, hence we
+ * pace outgoing messages ourselves. Every kind of limit (see TWIRC_RATE_* in
+ * libtwirc.h) is tracked by a bucket that allows limit messages within any
+ * period of time. Note that this is a sliding window rather than a classic
+ * token bucket, which would refill while a burst is being sent and could let
+ * almost twice as many messages through within one period - exactly what we
+ * want to avoid. For every bucket, we remember when the last limit messages
+ * have been sent; a new message can go out once the oldest of those is more
+ * than period milliseconds in the past.
+ *
+ * Every message is charged to a set of buckets: chat messages to channels
+ * where we're a moderator count against the moderator limit, all other chat
+ * messages count against both the regular and the moderator limit, as the
+ * latter is the total for all channels. Whispers and JOINs have their own
+ * limits; a JOIN counts once for every channel, and one for more channels
+ * than the limit allows is split into several JOINs that do fit. Everything
+ * else (PONG, PART, CAP, ...) is sent right away, unless messages are being
+ * held back already; then it waits behind them, so that the order is kept.
+ * Only PONGs always go out right away.
+ * Messages that can't be sent yet are queued, in order, and sent once the
+ * state's timerfd (which is part of the epoll set) tells us it's time.
+ */
+
+// Default limits for all buckets, see TWIRC_RATE_*
+static const unsigned libtwirc_rate_defaults[TWIRC_RATE_COUNT][2] =
+{
+	[TWIRC_RATE_CHAT]        = {  20, 30000 },
+	[TWIRC_RATE_MOD]         = { 100, 30000 },
+	[TWIRC_RATE_JOIN]        = {  20, 10000 },
+	[TWIRC_RATE_WHISPER]     = {   3,  1000 },
+	[TWIRC_RATE_WHISPER_MIN] = { 100, 60000 },
+};
+
+// Buckets that a message will be charged to, depending on its kind
+#define TWIRC_RATE_MASK_CHAT    ((1 << TWIRC_RATE_CHAT) | (1 << TWIRC_RATE_MOD))
+#define TWIRC_RATE_MASK_MOD     (1 << TWIRC_RATE_MOD)
+#define TWIRC_RATE_MASK_JOIN    (1 << TWIRC_RATE_JOIN)
+#define TWIRC_RATE_MASK_WHISPER ((1 << TWIRC_RATE_WHISPER) | (1 << TWIRC_RATE_WHISPER_MIN))
+
+/*
+ * Returns the current time of the monotonic clock, in milliseconds.
+ */
+static uint64_t
+libtwirc_now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Returns the current time of the monotonic clock, in nanoseconds.
+ */
+static uint64_t
+libtwirc_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Sets the limit of the given bucket to limit messages per period (in ms).
+ * A limit of 0 disables the bucket. This forgets about all messages that
+ * have been sent before. Returns 0 on success, -1 if we ran out of memory.
+ */
+static int
+libtwirc_bucket_set(struct libtwirc_bucket *b, unsigned limit, unsigned period)
+{
+	uint64_t *stamps = NULL;
+	if (limit)
+	{
+		stamps = calloc(limit, sizeof(uint64_t));
+		if (stamps == NULL)
+		{
+			return -1;
+		}
+	}
+
+	free(b->stamps);
+	b->stamps = stamps;
+	b->limit  = limit;
+	b->period = period;
+	b->next   = 0;
+	return 0;
+}
+
+/*
+ * Returns the number of milliseconds until cost messages can be charged to
+ * the bucket, which will be 0 if they can be sent right away. The cost must
+ * not be more than the bucket's limit (see libtwirc_rate_split()).
+ */
+static uint64_t
+libtwirc_bucket_wait(const struct libtwirc_bucket *b, unsigned cost, uint64_t now)
+{
+	if (b->limit == 0)
+	{
+		return 0;
+	}
+
+	// We need the cost oldest entries to be out of the window; a zero
+	// stamp means that slot hasn't been used yet
+	uint64_t stamp = b->stamps[(b->next + cost - 1) % b->limit];
+	if (stamp == 0 || now - stamp >= b->period)
+	{
+		return 0;
+	}
+	return b->period - (now - stamp);
+}
+
+/*
+ * Returns the number of messages that can be charged to the bucket right now,
+ * or UINT_MAX if the bucket is disabled.
+ */
+static unsigned
+libtwirc_bucket_free(const struct libtwirc_bucket *b, uint64_t now)
+{
+	if (b->limit == 0)
+	{
+		return UINT_MAX;
+	}
+
+	// Stamps are ordered from oldest to newest, starting at next
+	unsigned num = 0;
+	while (num < b->limit)
+	{
+		uint64_t stamp = b->stamps[(b->next + num) % b->limit];
+		if (stamp != 0 && now - stamp < b->period)
+		{
+			break;
+		}
+		++num;
+	}
+	return num;
+}
+
+/*
+ * Charges cost messages, sent at time now, to the bucket. The cost must not
+ * be more than the bucket's limit.
+ */
+static void
+libtwirc_bucket_take(struct libtwirc_bucket *b, unsigned cost, uint64_t now)
+{
+	if (b->limit == 0)
+	{
+		return;
+	}
+	for (unsigned i = 0; i < cost; ++i)
+	{
+		b->stamps[b->next] = now;
+		b->next = (b->next + 1) % b->limit;
+	}
+}
+
+/*
+ * Returns the bucket for the limit i (see TWIRC_RATE_*) that messages sent by
+ * the state s are charged to. Limits are per account, so while a shadow is
+ * logging in for a handover (see libtwirc_handover.c), its messages are 
+ * charged to the buckets of the state it's standing in for.
+ */
+static struct libtwirc_bucket*
+libtwirc_rate_bucket(twirc_state_t *s, int i)
+{
+	return s->primary ? &s->primary->rate[i] : &s->rate[i];
+}
+
+/*
+ * Initializes all buckets of the state with their default limits.
+ * Returns 0 on success, -1 if we ran out of memory.
+ */
+static int
+libtwirc_rate_init(twirc_state_t *s)
+{
+	s->pend_tail = &s->pend_head;
+	for (int i = 0; i < TWIRC_RATE_COUNT; ++i)
+	{
+		if (libtwirc_bucket_set(&s->rate[i],
+			libtwirc_rate_defaults[i][0], libtwirc_rate_defaults[i][1]) == -1)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Figures out which buckets the raw IRC message msg (len bytes) needs to be
+ * charged to and returns them as a bitmask (0 means it isn't rate limited).
+ * The number of messages it counts as is returned in cost; that's 1 except
+ * for JOINs, where every channel counts.
+ */
+static int
+libtwirc_rate_class(twirc_state_t *s, const char *msg, size_t len, unsigned *cost)
+{
+	const char *end = msg + len;
+	*cost = 1;
+
+	if (len > 5 && strncmp(msg, "JOIN ", 5) == 0)
+	{
+		for (const char *c = msg + 5; c < end && *c != ' '; ++c)
+		{
+			*cost += *c == ',';
+		}
+		return TWIRC_RATE_MASK_JOIN;
+	}
+
+	if (len > 8 && strncmp(msg, "PRIVMSG ", 8) == 0)
+	{
+		const char *chan = msg + 8;
+		const char *text = memchr(chan, ' ', end - chan);
+		if (text == NULL)
+		{
+			return TWIRC_RATE_MASK_CHAT;
+		}
+		size_t chan_len = text - chan;
+		text += (end - text > 1 && text[1] == ':') ? 2 : 1;
+
+		// Whispers are sent as chat commands ("/w <user> <msg>")
+		if (end - text > 3 && (text[0] == '/' || text[0] == '.') &&
+		    strncmp(text + 1, "w ", 2) == 0)
+		{
+			return TWIRC_RATE_MASK_WHISPER;
+		}
+
+		struct libtwirc_chan *c = libtwirc_chans_find(&s->chans, chan, chan_len, 0);
+		return c && (c->flags & TWIRC_CHAN_MOD) ? TWIRC_RATE_MASK_MOD : TWIRC_RATE_MASK_CHAT;
+	}
+
+	return 0;
+}
+
+/*
+ * Arms the state's timer to go off in ms milliseconds, or disarms it if ms
+ * is 0.
+ */
+static void
+libtwirc_rate_arm(twirc_state_t *s, uint64_t ms)
+{
+	// Remembered for external event loops, see twirc_get_timeout()
+	s->timer_due = ms ? libtwirc_now_ms() + ms : 0;
+	if (s->timer_fd == -1)
+	{
+		return;
+	}
+	struct itimerspec its = { 0 };
+	its.it_value.tv_sec  = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	timerfd_settime(s->timer_fd, 0, &its, NULL);
+}
+
+/*
+ * Returns the lowest limit of all (enabled) buckets in the bitmask buckets,
+ * or UINT_MAX if there is none.
+ */
+static unsigned
+libtwirc_rate_limit(twirc_state_t *s, int buckets)
+{
+	unsigned limit = UINT_MAX;
+	for (int i = 0; i < TWIRC_RATE_COUNT; ++i)
+	{
+		const struct libtwirc_bucket *b = libtwirc_rate_bucket(s, i);
+		if ((buckets & (1 << i)) && b->limit && b->limit < limit)
+		{
+			limit = b->limit;
+		}
+	}
+	return limit;
+}
+
+/*
+ * Replaces the pending JOIN *pp, which costs more than the limit max of its
+ * buckets and could therefore never be sent without breaking it, with as
+ * many JOINs as it takes for none of them to join more than max channels.
+ * Whatever follows the list of channels is kept for every one of them.
+ * Returns 0 on success, -1 if we ran out of memory (the JOIN is left as is).
+ */
+static int
+libtwirc_rate_split(twirc_state_t *s, struct libtwirc_pending **pp, unsigned max)
+{
+	struct libtwirc_pending *p = *pp;
+	struct libtwirc_pending *head = NULL;
+	struct libtwirc_pending **tail = &head;
+	size_t len = 0;
+
+	const char *end  = p->msg + p->len;
+	const char *chan = p->msg + 5;
+	const char *rest = memchr(chan, ' ', end - chan);
+	rest = rest ? rest : end;
+
+	while (chan < rest)
+	{
+		// Find the end of the next max channels
+		const char *next = chan;
+		unsigned num = 1;
+		while (next < rest)
+		{
+			if (*next == ',')
+			{
+				if (num == max)
+				{
+					break;
+				}
+				++num;
+			}
+			++next;
+		}
+
+		size_t chans_len = next - chan;
+		size_t piece_len = 5 + chans_len + (end - rest);
+		struct libtwirc_pending *q = malloc(sizeof(struct libtwirc_pending) + piece_len + 1);
+		if (q == NULL)
+		{
+			while (head != NULL)
+			{
+				q = head;
+				head = q->next;
+				free(q);
+			}
+			return libtwirc_oom(s);
+		}
+		q->next    = NULL;
+		q->buckets = p->buckets;
+		q->cost    = num;
+		q->len     = piece_len;
+		memcpy(q->msg, "JOIN ", 5);
+		memcpy(q->msg + 5, chan, chans_len);
+		memcpy(q->msg + 5 + chans_len, rest, end - rest);
+		q->msg[piece_len] = '\0';
+
+		*tail = q;
+		tail  = &q->next;
+		len  += piece_len;
+		chan  = next + 1;
+	}
+
+	if (head == NULL)
+	{
+		return 0;
+	}
+
+	// Put the pieces where the JOIN was
+	*tail = p->next;
+	if (p->next == NULL)
+	{
+		s->pend_tail = tail;
+	}
+	*pp = head;
+	s->pend_len += len;
+	s->pend_len -= p->len;
+	free(p);
+	return 0;
+}
+
+/*
+ * Goes through the list of pending messages once and sends all that the rate
+ * limits allow us to send at time now, in order. Messages that are charged 
+ * to a bucket that an earlier pending message is still waiting for have to
+ * wait as well, so their order is kept; messages that aren't charged to any
+ * bucket wait for every earlier one. If messages had to be held back, 
+ * wait will be lowered to the number of milliseconds until the next one can
+ * go out, unless it is lower already (0 meaning no wait has been set yet).
+ * Returns 0 on success, -1 if an error occured while sending.
+ */
+static int
+libtwirc_rate_pass(twirc_state_t *s, uint64_t now, uint64_t *wait)
+{
+	int blocked = 0;
+	int ret = 0;
+
+	struct libtwirc_pending **pp = &s->pend_head;
+	while (*pp != NULL)
+	{
+		struct libtwirc_pending *p = *pp;
+		if (p->buckets & blocked)
+		{
+			pp = &p->next;
+			continue;
+		}
+
+		// Messages that aren't rate limited (no buckets) wait for all
+		// messages before them, and everything after them waits as well
+		if (p->buckets == 0 && blocked)
+		{
+			blocked = ~0;
+			pp = &p->next;
+			continue;
+		}
+
+		// A JOIN for more channels than the limit allows at once would
+		// never go out (or break the limit), so it becomes several
+		unsigned max = libtwirc_rate_limit(s, p->buckets);
+		if (p->cost > max)
+		{
+			if (libtwirc_rate_split(s, pp, max) == -1)
+			{
+				// Better not to send it than to get muted
+				*pp = p->next;
+				if (*pp == NULL)
+				{
+					s->pend_tail = pp;
+				}
+				s->pend_len -= p->len;
+				free(p);
+				ret = -1;
+				continue;
+			}
+			p = *pp;
+		}
+
+		// Find out how long the strictest of its buckets wants us to wait
+		uint64_t ms = 0;
+		for (int i = 0; i < TWIRC_RATE_COUNT; ++i)
+		{
+			if (p->buckets & (1 << i))
+			{
+				uint64_t w = libtwirc_bucket_wait(libtwirc_rate_bucket(s, i), p->cost, now);
+				ms = w > ms ? w : ms;
+			}
+		}
+		if (ms)
+		{
+			blocked |= p->buckets;
+			*wait = (*wait == 0 || ms < *wait) ? ms : *wait;
+			pp = &p->next;
+			continue;
+		}
+
+		for (int i = 0; i < TWIRC_RATE_COUNT; ++i)
+		{
+			if (p->buckets & (1 << i))
+			{
+				libtwirc_bucket_take(libtwirc_rate_bucket(s, i), p->cost, now);
+			}
+		}
+
+		// Unlink the message before sending, as sending might append more
+		*pp = p->next;
+		if (*pp == NULL)
+		{
+			s->pend_tail = pp;
+		}
+		s->pend_len -= p->len;
+
+		if (libtwirc_queue(s, p->msg, p->len) == -1)
+		{
+			ret = -1;
+		}
+		free(p);
+	}
+	return ret;
+}
+
+/*
+ * Sends all pending messages that the rate limits allow us to send right
+ * now, lets the bulk join planner add its next JOINs, and arms the timer for
+ * when the next message will be allowed (or a join will time out). Returns 0
+ * on success, -1 if an error occured while sending.
+ */
+static int
+libtwirc_rate_flush(twirc_state_t *s)
+{
+	// Messages queued from within callbacks of the messages we're sending
+	// will be appended to the list and picked up by libtwirc_rate_pass()
+	if (s->pend_busy)
+	{
+		return 0;
+	}
+	s->pend_busy = 1;
+
+	uint64_t now = libtwirc_now_ms();
+	uint64_t wait = 0;
+	int ret = 0;
+
+	// Whenever the bulk join planner adds another JOIN, go again
+	int joined = 0;
+	do
+	{
+		joined = libtwirc_joins_pump(s, now, &wait);
+		if (libtwirc_rate_pass(s, now, &wait) == -1)
+		{
+			ret = -1;
+		}
+	}
+	while (joined);
+
+	// Don't let the timer miss the next connect attempt, reconnect or
+	// handover
+	libtwirc_race_wait(s, now, &wait);
+	libtwirc_reconnect_wait(s, now, &wait);
+	libtwirc_handover_wait(s, &wait);
+	libtwirc_rate_arm(s, wait);
+	s->pend_busy = 0;
+	return ret;
+}
+
+/*
+ * Adds the message msg (len bytes) to the list of pending messages, charged
+ * to the given buckets, and sends as many pending messages as possible.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+libtwirc_rate_send(twirc_state_t *s, const char *msg, size_t len, int buckets, unsigned cost)
+{
+	struct libtwirc_pending *p = malloc(sizeof(struct libtwirc_pending) + len + 1);
+	if (p == NULL)
+	{
+		return libtwirc_oom(s);
+	}
+	p->next    = NULL;
+	p->buckets = buckets;
+	p->cost    = cost;
+	p->len     = len;
+	memcpy(p->msg, msg, len);
+	p->msg[len] = '\0';
+
+	*s->pend_tail = p;
+	s->pend_tail  = &p->next;
+	s->pend_len  += len;
+
+	return libtwirc_rate_flush(s);
+}
+
+/*
+ * Drops all pending messages, for example because we lost the connection.
+ */
+static void
+libtwirc_rate_clear(twirc_state_t *s)
+{
+	while (s->pend_head != NULL)
+	{
+		struct libtwirc_pending *p = s->pend_head;
+		s->pend_head = p->next;
+		free(p);
+	}
+	s->pend_tail = &s->pend_head;
+	s->pend_len  = 0;
+	libtwirc_rate_arm(s, 0);
+}
+
+/*
+ * Drops all pending messages and frees the memory of all buckets.
+ */
+static void
+libtwirc_rate_free(twirc_state_t *s)
+{
+	libtwirc_rate_clear(s);
+	for (int i = 0; i < TWIRC_RATE_COUNT; ++i)
+	{
+		libtwirc_bucket_set(&s->rate[i], 0, 0);
+	}
+}
@@ -0,0 +1,165 @@
+#include <stdlib.h>     // NULL, malloc(), free(), rand()
+#include <sys/socket.h> // shutdown()
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * If enabled (see twirc_set_reconnect()), a state that loses its connection
+ * for whatever reason, other than twirc_disconnect(), connects again on its
+ * own. The first attempt is made within reconnect_min ms, every failed one
+ * doubles that, up to reconnect_max ms. The actual delay is picked at random
+ * between 0 and that ("full jitter"), so that the states of a fleet that lost
+ * their connections at the same time don't all come back at once. Once logged
+ * in again, the state rejoins all channels it was in, which the channel table
+ * keeps track of, at the pace of the bulk join planner; so do the channels
+ * a bulk join hadn't gotten to yet. The timer that tells
+ * us when to reconnect is the rate limiter's, which has nothing else to do
+ * while we're disconnected anyway.
+ */
+
+/*
+ * Schedules a reconnect, if enabled, and remembers the channels to rejoin.
+ * Called whenever the connection has been lost.
+ */
+static void
+libtwirc_reconnect_schedule(twirc_state_t *s)
+{
+	if (s->reconnect_min == 0 || s->quit)
+	{
+		return;
+	}
+
+	// Channels we were in are the ones we'll want to be in again
+	for (size_t i = 0; i < s->chans.size; ++i)
+	{
+		struct libtwirc_chan *c = &s->chans.slots[i];
+		if (c->name != NULL && (c->flags & TWIRC_CHAN_JOINED))
+		{
+			c->flags &= ~TWIRC_CHAN_JOINED;
+			c->flags |= TWIRC_CHAN_REJOIN;
+		}
+	}
+
+	// Double the delay with every attempt, without overflowing
+	uint64_t max = s->reconnect_min;
+	for (unsigned i = 0; i < s->reconnect_tries && max < s->reconnect_max; ++i)
+	{
+		max *= 2;
+	}
+	max = max < s->reconnect_max ? max : s->reconnect_max;
+
+	uint64_t delay = (uint64_t) rand() % (max + 1);
+	s->reconnect_tries += 1;
+	s->reconnect_at = libtwirc_now_ms() + delay;
+	libtwirc_rate_arm(s, delay ? delay : 1);
+}
+
+/*
+ * Reconnects, if it's time for that. If that fails right away, the next
+ * attempt is scheduled; otherwise, failing will be noticed as usual.
+ */
+static void
+libtwirc_reconnect_pump(twirc_state_t *s)
+{
+	if (s->reconnect_at == 0 || libtwirc_now_ms() < s->reconnect_at)
+	{
+		return;
+	}
+	s->reconnect_at = 0;
+
+	if (twirc_connect(s, s->login.host, s->login.port, s->login.nick, s->login.pass) == -1)
+	{
+		libtwirc_reconnect_schedule(s);
+	}
+}
+
+/*
+ * Lowers wait to the number of ms until we should reconnect, unless it is
+ * lower already (0 meaning no wait has been set yet).
+ */
+static void
+libtwirc_reconnect_wait(twirc_state_t *s, uint64_t now, uint64_t *wait)
+{
+	if (s->reconnect_at == 0)
+	{
+		return;
+	}
+	uint64_t ms = s->reconnect_at > now ? s->reconnect_at - now : 1;
+	*wait = (*wait == 0 || ms < *wait) ? ms : *wait;
+}
+
+/*
+ * Rejoins all channels we were in before the connection was lost. Called
+ * once we're logged in.
+ */
+static void
+libtwirc_reconnect_rejoin(twirc_state_t *s)
+{
+	// We made it, so the next outage starts over with short delays
+	s->reconnect_tries = 0;
+
+	const char **names = malloc(s->chans.used * sizeof(char*));
+	if (names == NULL)
+	{
+		return;
+	}
+
+	size_t num = 0;
+	for (size_t i = 0; i < s->chans.size; ++i)
+	{
+		struct libtwirc_chan *c = &s->chans.slots[i];
+		if (c->name != NULL && (c->flags & TWIRC_CHAN_REJOIN))
+		{
+			c->flags &= ~TWIRC_CHAN_REJOIN;
+			names[num++] = c->name;
+		}
+	}
+	if (num > 0)
+	{
+		twirc_cmd_join_list(s, names, num, NULL);
+	}
+	free(names);
+}
+
+/*
+ * The server asked us to reconnect, as it is about to go down. Closes our
+ * end of the connection, which will be noticed like any other lost
+ * connection, so that we reconnect right away. Only if enabled.
+ */
+static void
+libtwirc_reconnect_now(twirc_state_t *s)
+{
+	if (s->reconnect_min == 0)
+	{
+		return;
+	}
+	s->reconnect_tries = 0;
+	shutdown(s->socket_fd, SHUT_RDWR);
+}
+
+/*
+ * Enables automatic reconnects, with delays starting at min ms (within which
+ * the first attempt will be made) and going up to max ms, see above. A min of
+ * 0 disables automatic reconnects, which is the default. For a start,
+ * TWIRC_RECONNECT_MIN and TWIRC_RECONNECT_MAX should do nicely.
+ */
+void
+twirc_set_reconnect(twirc_state_t *s, unsigned min, unsigned max)
+{
+	s->reconnect_min = min;
+	s->reconnect_max = max > min ? max : min;
+	if (min == 0)
+	{
+		s->reconnect_at = 0;
+	}
+}
+
+/*
+ * Returns 1 if the state has lost its connection and is waiting to reconnect
+ * (see twirc_set_reconnect()), otherwise 0.
+ */
+int
+twirc_is_reconnecting(const twirc_state_t *s)
+{
+	return s->reconnect_at != 0;
+}
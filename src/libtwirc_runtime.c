@@ -0,0 +1,395 @@
+#include <stdlib.h>     // NULL, malloc(), calloc(), realloc(), free()
+#include <string.h>     // strlen(), memcpy(), strcasecmp()
+#include <unistd.h>     // read(), write(), close(), sysconf()
+#include <pthread.h>    // pthread_create(), pthread_join(), mutexes
+#include <sched.h>      // cpu_set_t, CPU_ZERO(), CPU_SET()
+#include <sys/eventfd.h>// eventfd()
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * The runtime spreads a large number of channels over several threads. Each
+ * worker thread runs its own pool (and therefore its own epoll instance) with
+ * its own connections and is pinned to a core; workers share nothing, so they
+ * never need to synchronize with each other. Every channel is assigned to a
+ * worker, and to one of its connections, by the hash of its name. The only
+ * way into a worker is its mailbox: a list of commands (join or part some
+ * channel), protected by a mutex, plus an eventfd that wakes the worker up.
+ * All callbacks run on the worker thread of the state they belong to.
+ */
+
+/*
+ * Joins all channels that are waiting for the given connection, if it is
+ * ready for that (logged in). Called by the worker after every tick.
+ */
+static void
+libtwirc_conn_join(struct libtwirc_conn *c)
+{
+	if (c->num == 0 || !twirc_is_logged_in(c->state))
+	{
+		return;
+	}
+	twirc_cmd_join_list(c->state, (const char **) c->joins, c->num, NULL);
+	for (size_t i = 0; i < c->num; ++i)
+	{
+		free(c->joins[i]);
+	}
+	c->num = 0;
+}
+
+/*
+ * Carries out the command cmd on the worker's thread.
+ */
+static void
+libtwirc_worker_exec(struct libtwirc_worker *w, struct libtwirc_cmd *cmd)
+{
+	struct libtwirc_conn *c = &w->conns[cmd->conn];
+
+	if (cmd->op == TWIRC_RUNTIME_PART)
+	{
+		// Maybe we haven't even gotten to join it yet
+		for (size_t i = 0; i < c->num; ++i)
+		{
+			if (strcasecmp(c->joins[i], cmd->chan) == 0)
+			{
+				free(c->joins[i]);
+				c->joins[i] = c->joins[--c->num];
+				return;
+			}
+		}
+		twirc_cmd_part(c->state, cmd->chan);
+		return;
+	}
+
+	// Collect the channels, so they can be joined in bulk once we can
+	if (c->num == c->size)
+	{
+		size_t size = c->size ? 2 * c->size : TWIRC_NUM_CHANS;
+		char **joins = realloc(c->joins, size * sizeof(char*));
+		if (joins == NULL)
+		{
+			return;
+		}
+		c->joins = joins;
+		c->size  = size;
+	}
+	char *chan = strdup(cmd->chan);
+	if (chan != NULL)
+	{
+		c->joins[c->num++] = chan;
+	}
+}
+
+/*
+ * Takes all commands out of the worker's mailbox and carries them out.
+ */
+static void
+libtwirc_worker_drain(struct libtwirc_worker *w)
+{
+	uint64_t val;
+	if (read(w->wake_fd, &val, sizeof(val)) <= 0)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	struct libtwirc_cmd *cmds = w->cmds;
+	w->cmds = NULL;
+	w->cmds_tail = &w->cmds;
+	pthread_mutex_unlock(&w->lock);
+
+	while (cmds != NULL)
+	{
+		struct libtwirc_cmd *next = cmds->next;
+		libtwirc_worker_exec(w, cmds);
+		free(cmds);
+		cmds = next;
+	}
+}
+
+/*
+ * The worker thread: connects all of the worker's states, then handles their
+ * events, as well as the commands sent to the worker, until asked to stop.
+ */
+static void*
+libtwirc_worker_run(void *arg)
+{
+	struct libtwirc_worker *w = arg;
+	twirc_runtime_t *rt = w->rt;
+
+	// Pin ourselves to a core; if that doesn't work, we run anyway
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores > 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->id % cores, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+	}
+
+	for (int i = 0; i < rt->num_conns; ++i)
+	{
+		twirc_state_t *s = w->conns[i].state;
+		twirc_pool_add(w->pool, s);
+		if (rt->nick)
+		{
+			twirc_connect(s, rt->host, rt->port, rt->nick, rt->pass);
+		}
+		else
+		{
+			twirc_connect_anon(s, rt->host, rt->port);
+		}
+	}
+
+	while (!__atomic_load_n(&rt->stop, __ATOMIC_ACQUIRE))
+	{
+		twirc_pool_tick(w->pool, -1);
+		libtwirc_worker_drain(w);
+		for (int i = 0; i < rt->num_conns; ++i)
+		{
+			libtwirc_conn_join(&w->conns[i]);
+		}
+	}
+
+	for (int i = 0; i < rt->num_conns; ++i)
+	{
+		if (twirc_is_connected(w->conns[i].state))
+		{
+			twirc_disconnect(w->conns[i].state);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Returns a pointer to a new runtime with num_workers worker threads (one per
+ * core being a good choice), each of which will run num_conns connections.
+ * Every state will be set up with a copy of the callbacks cbs (can be NULL)
+ * and the context ctx. The threads will only be started by
+ * twirc_runtime_start(). Returns NULL if any errors occur.
+ */
+twirc_runtime_t*
+twirc_runtime_init(int num_workers, int num_conns, const twirc_callbacks_t *cbs, void *ctx)
+{
+	if (num_workers < 1 || num_conns < 1)
+	{
+		return NULL;
+	}
+
+	twirc_runtime_t *rt = calloc(1, sizeof(twirc_runtime_t));
+	if (rt == NULL) { return NULL; }
+	rt->num_conns = num_conns;
+
+	rt->workers = calloc(num_workers, sizeof(struct libtwirc_worker));
+	if (rt->workers == NULL)
+	{
+		free(rt);
+		return NULL;
+	}
+
+	for (int i = 0; i < num_workers; ++i)
+	{
+		struct libtwirc_worker *w = &rt->workers[i];
+		w->rt = rt;
+		w->id = i;
+		w->cmds_tail = &w->cmds;
+		w->wake_fd = -1;
+		pthread_mutex_init(&w->lock, NULL);
+		rt->num_workers += 1;
+
+		w->pool = twirc_pool_init();
+		w->conns = calloc(num_conns, sizeof(struct libtwirc_conn));
+		w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (w->pool == NULL || w->conns == NULL || w->wake_fd == -1)
+		{
+			twirc_runtime_free(rt);
+			return NULL;
+		}
+
+		// Have the pool's epoll wake us up when we've got mail
+		struct epoll_event eev = { 0 };
+		w->wake_watch.kind = TWIRC_WATCH_WAKE;
+		eev.data.ptr = &w->wake_watch;
+		eev.events = EPOLLIN;
+		if (epoll_ctl(w->pool->epfd, EPOLL_CTL_ADD, w->wake_fd, &eev) == -1)
+		{
+			twirc_runtime_free(rt);
+			return NULL;
+		}
+
+		for (int j = 0; j < num_conns; ++j)
+		{
+			twirc_state_t *s = twirc_init();
+			if (s == NULL)
+			{
+				twirc_runtime_free(rt);
+				return NULL;
+			}
+			if (cbs)
+			{
+				s->cbs = *cbs;
+			}
+			s->context = ctx;
+			w->conns[j].state = s;
+		}
+	}
+	return rt;
+}
+
+/*
+ * Starts all worker threads, each of which will connect all of its states to
+ * the given server, using the given credentials (if nick is NULL, we connect
+ * anonymously). Returns 0 on success, -1 if not all threads could be started.
+ */
+int
+twirc_runtime_start(twirc_runtime_t *rt, const char *host, const char *port, const char *nick, const char *pass)
+{
+	rt->host = strdup(host);
+	rt->port = strdup(port);
+	rt->nick = nick ? strdup(nick) : NULL;
+	rt->pass = pass ? strdup(pass) : NULL;
+
+	for (int i = 0; i < rt->num_workers; ++i)
+	{
+		struct libtwirc_worker *w = &rt->workers[i];
+		if (pthread_create(&w->thread, NULL, libtwirc_worker_run, w) != 0)
+		{
+			twirc_runtime_stop(rt);
+			return -1;
+		}
+		w->started = 1;
+	}
+	return 0;
+}
+
+/*
+ * Puts a command into the mailbox of the worker that is responsible for chan
+ * and wakes it up. Returns 0 on success, -1 if we ran out of memory.
+ */
+static int
+libtwirc_runtime_post(twirc_runtime_t *rt, int op, const char *chan)
+{
+	// Channels are assigned to workers (and their connections) by hash
+	size_t len  = strlen(chan);
+	size_t hash = libtwirc_chan_hash(chan, len);
+	struct libtwirc_worker *w = &rt->workers[hash % rt->num_workers];
+
+	struct libtwirc_cmd *cmd = malloc(sizeof(struct libtwirc_cmd) + len + 1);
+	if (cmd == NULL)
+	{
+		return -1;
+	}
+	cmd->next = NULL;
+	cmd->op   = op;
+	cmd->conn = (hash / rt->num_workers) % rt->num_conns;
+	memcpy(cmd->chan, chan, len + 1);
+
+	pthread_mutex_lock(&w->lock);
+	*w->cmds_tail = cmd;
+	w->cmds_tail  = &cmd->next;
+	pthread_mutex_unlock(&w->lock);
+
+	uint64_t one = 1;
+	return write(w->wake_fd, &one, sizeof(one)) == sizeof(one) ? 0 : -1;
+}
+
+/*
+ * Joins the channel chan (including the leading '#') on whatever connection
+ * it is assigned to. This can be called from any thread, at any time; the
+ * channel will be joined once the connection is logged in.
+ * Returns 0 on success, -1 on error.
+ */
+int
+twirc_runtime_join(twirc_runtime_t *rt, const char *chan)
+{
+	return libtwirc_runtime_post(rt, TWIRC_RUNTIME_JOIN, chan);
+}
+
+/*
+ * Leaves the channel chan. This can be called from any thread, at any time.
+ * Returns 0 on success, -1 on error.
+ */
+int
+twirc_runtime_part(twirc_runtime_t *rt, const char *chan)
+{
+	return libtwirc_runtime_post(rt, TWIRC_RUNTIME_PART, chan);
+}
+
+/*
+ * Asks all worker threads to disconnect and stop, then waits for them to do
+ * so. Can be called from any thread but the workers. Returns 0 on success.
+ */
+int
+twirc_runtime_stop(twirc_runtime_t *rt)
+{
+	__atomic_store_n(&rt->stop, 1, __ATOMIC_RELEASE);
+
+	uint64_t one = 1;
+	for (int i = 0; i < rt->num_workers; ++i)
+	{
+		if (rt->workers[i].wake_fd != -1)
+		{
+			write(rt->workers[i].wake_fd, &one, sizeof(one));
+		}
+	}
+	for (int i = 0; i < rt->num_workers; ++i)
+	{
+		if (rt->workers[i].started)
+		{
+			pthread_join(rt->workers[i].thread, NULL);
+			rt->workers[i].started = 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Stops the runtime, if it is still running, and frees it, including all of
+ * its states.
+ */
+void
+twirc_runtime_free(twirc_runtime_t *rt)
+{
+	twirc_runtime_stop(rt);
+
+	for (int i = 0; i < rt->num_workers; ++i)
+	{
+		struct libtwirc_worker *w = &rt->workers[i];
+		for (int j = 0; w->conns && j < rt->num_conns; ++j)
+		{
+			struct libtwirc_conn *c = &w->conns[j];
+			for (size_t k = 0; k < c->num; ++k)
+			{
+				free(c->joins[k]);
+			}
+			free(c->joins);
+			if (c->state)
+			{
+				twirc_free(c->state);
+			}
+		}
+		while (w->cmds != NULL)
+		{
+			struct libtwirc_cmd *next = w->cmds->next;
+			free(w->cmds);
+			w->cmds = next;
+		}
+		if (w->pool)
+		{
+			twirc_pool_free(w->pool);
+		}
+		if (w->wake_fd != -1)
+		{
+			close(w->wake_fd);
+		}
+		free(w->conns);
+		pthread_mutex_destroy(&w->lock);
+	}
+
+	free(rt->workers);
+	free(rt->host);
+	free(rt->port);
+	free(rt->nick);
+	free(rt->pass);
+	free(rt);
+}
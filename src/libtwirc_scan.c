@@ -0,0 +1,185 @@
+#include <stddef.h>     // NULL, size_t
+#include "libtwirc_internal.h"
+
+/*
+ * Byte scanning for the parser. The hot loops of the parser all boil down to
+ * "find the next of these delimiters" (' ', ';', '=', '\\', ...) and "count
+ * the occurrences of this delimiter". On x86, we do this 16 (SSE2) or 32
+ * (AVX2) bytes at a time, picking the best implementation the CPU supports at
+ * runtime. Everywhere else, or for the last few bytes, we fall back to plain
+ * byte-by-byte loops. Note that we never read beyond end, so the buffers we
+ * scan don't need any padding.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TWIRC_SCAN_X86
+#include <immintrin.h>  // SSE2 and AVX2 intrinsics
+#endif
+
+/*
+ * Returns a pointer to the first occurrence of a, b or c in the range from p
+ * to end (exclusive), or end if none of them was found.
+ */
+static char*
+libtwirc_scan_scalar(char *p, char *end, char a, char b, char c)
+{
+	for (; p < end; ++p)
+	{
+		if (*p == a || *p == b || *p == c)
+		{
+			return p;
+		}
+	}
+	return end;
+}
+
+/*
+ * Returns the number of occurrences of c in the range from p to end.
+ */
+static size_t
+libtwirc_count_scalar(char *p, char *end, char c)
+{
+	size_t num = 0;
+	for (; p < end; ++p)
+	{
+		num += *p == c;
+	}
+	return num;
+}
+
+#ifdef TWIRC_SCAN_X86
+
+__attribute__((target("sse2")))
+static char*
+libtwirc_scan_sse2(char *p, char *end, char a, char b, char c)
+{
+	__m128i va = _mm_set1_epi8(a);
+	__m128i vb = _mm_set1_epi8(b);
+	__m128i vc = _mm_set1_epi8(c);
+
+	for (; end - p >= 16; p += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, va),
+				_mm_or_si128(_mm_cmpeq_epi8(v, vb), _mm_cmpeq_epi8(v, vc)));
+		int mask = _mm_movemask_epi8(m);
+		if (mask)
+		{
+			return p + __builtin_ctz(mask);
+		}
+	}
+	return libtwirc_scan_scalar(p, end, a, b, c);
+}
+
+__attribute__((target("sse2")))
+static size_t
+libtwirc_count_sse2(char *p, char *end, char c)
+{
+	__m128i vc = _mm_set1_epi8(c);
+	size_t num = 0;
+
+	for (; end - p >= 16; p += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		num += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, vc)));
+	}
+	return num + libtwirc_count_scalar(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static char*
+libtwirc_scan_avx2(char *p, char *end, char a, char b, char c)
+{
+	__m256i va = _mm256_set1_epi8(a);
+	__m256i vb = _mm256_set1_epi8(b);
+	__m256i vc = _mm256_set1_epi8(c);
+
+	for (; end - p >= 32; p += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *) p);
+		__m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, vb), _mm256_cmpeq_epi8(v, vc)));
+		unsigned mask = (unsigned) _mm256_movemask_epi8(m);
+		if (mask)
+		{
+			return p + __builtin_ctz(mask);
+		}
+	}
+	return libtwirc_scan_sse2(p, end, a, b, c);
+}
+
+__attribute__((target("avx2")))
+static size_t
+libtwirc_count_avx2(char *p, char *end, char c)
+{
+	__m256i vc = _mm256_set1_epi8(c);
+	size_t num = 0;
+
+	for (; end - p >= 32; p += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *) p);
+		num += __builtin_popcount((unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vc)));
+	}
+	return num + libtwirc_count_sse2(p, end, c);
+}
+
+#endif /* TWIRC_SCAN_X86 */
+
+// The implementations in use, chosen by libtwirc_scan_init()
+static char  *(*libtwirc_scan_impl)(char *, char *, char, char, char) = libtwirc_scan_scalar;
+static size_t (*libtwirc_count_impl)(char *, char *, char) = libtwirc_count_scalar;
+
+/*
+ * Picks the fastest scanning implementation supported by the CPU we're on.
+ * This is called from twirc_init(), so the choice has been made before any
+ * data is being parsed. Calling it more than once is harmless.
+ */
+static void
+libtwirc_scan_init()
+{
+#ifdef TWIRC_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		libtwirc_scan_impl  = libtwirc_scan_avx2;
+		libtwirc_count_impl = libtwirc_count_avx2;
+		return;
+	}
+	if (__builtin_cpu_supports("sse2"))
+	{
+		libtwirc_scan_impl  = libtwirc_scan_sse2;
+		libtwirc_count_impl = libtwirc_count_sse2;
+		return;
+	}
+#endif
+	libtwirc_scan_impl  = libtwirc_scan_scalar;
+	libtwirc_count_impl = libtwirc_count_scalar;
+}
+
+/*
+ * Returns a pointer to the first occurrence of c between p and end, or end.
+ */
+static inline char*
+libtwirc_scan1(char *p, char *end, char c)
+{
+	return libtwirc_scan_impl(p, end, c, c, c);
+}
+
+/*
+ * Returns a pointer to the first occurrence of a or b between p and end, or
+ * end if neither of them could be found.
+ */
+static inline char*
+libtwirc_scan2(char *p, char *end, char a, char b)
+{
+	return libtwirc_scan_impl(p, end, a, b, b);
+}
+
+/*
+ * Returns the number of occurrences of c between p and end.
+ */
+static inline size_t
+libtwirc_count(char *p, char *end, char c)
+{
+	return libtwirc_count_impl(p, end, c);
+}
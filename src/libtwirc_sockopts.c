@@ -0,0 +1,161 @@
+#include <string.h>     // memset()
+#include <sys/socket.h> // setsockopt(), getsockopt(), SO_*
+#include <netinet/in.h> // IPPROTO_TCP
+#include <netinet/tcp.h> // TCP_*
+#include <time.h>       // clock_gettime()
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * The socket options of twirc_set_socket_opts() are set on every socket we
+ * create to connect, before connect() is called, so that the receive buffer
+ * size has a say in the window scaling negotiated with the server. Options
+ * that are 0 are left alone, so the system's defaults apply. Failing to set
+ * an option (for example, raising SO_BUSY_POLL without CAP_NET_ADMIN) doesn't
+ * keep us from connecting; twirc_get_socket_opts() tells what the kernel went
+ * with. TCP_QUICKACK doesn't stick (the kernel falls back to delayed ACKs on
+ * its own), so it is set again every time we've been reading from the socket.
+ * With timestamps enabled (SO_TIMESTAMPNS), we read with recvmsg(), which
+ * also tells us when the kernel received the data, before we even got around
+ * to reading it; that time is what the messages completed by the data are
+ * stamped with (see twirc_event_t), instead of the time of the read. TCP only
+ * reports one stamp per read, that of the last segment read, so messages
+ * that came in earlier segments of the same read get that one as well. With
+ * TLS, where OpenSSL does the reading, and with io_uring, messages are still
+ * stamped with the time of the read.
+ */
+
+/*
+ * Sets the integer option opt of level to val, unless val is 0.
+ */
+static void
+libtwirc_sockopts_set(int fd, int level, int opt, int val)
+{
+	if (val != 0)
+	{
+		setsockopt(fd, level, opt, &val, sizeof(val));
+	}
+}
+
+/*
+ * Returns the value of the integer option opt of level, or 0 if it couldn't
+ * be queried.
+ */
+static int
+libtwirc_sockopts_get(int fd, int level, int opt)
+{
+	int val = 0;
+	socklen_t len = sizeof(val);
+	if (getsockopt(fd, level, opt, &val, &len) == -1)
+	{
+		return 0;
+	}
+	return val;
+}
+
+/*
+ * Sets the state's socket options on the socket fd.
+ */
+static void
+libtwirc_sockopts_apply(twirc_state_t *s, int fd)
+{
+	twirc_socket_opts_t *o = &s->sockopts;
+	libtwirc_sockopts_set(fd, SOL_SOCKET, SO_RCVBUF, o->rcvbuf);
+	libtwirc_sockopts_set(fd, SOL_SOCKET, SO_SNDBUF, o->sndbuf);
+	libtwirc_sockopts_set(fd, SOL_SOCKET, SO_KEEPALIVE, o->keepalive);
+	libtwirc_sockopts_set(fd, SOL_SOCKET, SO_TIMESTAMPNS, o->timestamps);
+#ifdef SO_BUSY_POLL
+	libtwirc_sockopts_set(fd, SOL_SOCKET, SO_BUSY_POLL, o->busy_poll);
+#endif
+	libtwirc_sockopts_set(fd, IPPROTO_TCP, TCP_NODELAY, o->nodelay);
+	libtwirc_sockopts_set(fd, IPPROTO_TCP, TCP_QUICKACK, o->quickack);
+	libtwirc_sockopts_set(fd, IPPROTO_TCP, TCP_KEEPIDLE, o->keepidle);
+	libtwirc_sockopts_set(fd, IPPROTO_TCP, TCP_KEEPINTVL, o->keepintvl);
+	libtwirc_sockopts_set(fd, IPPROTO_TCP, TCP_KEEPCNT, o->keepcnt);
+	libtwirc_sockopts_set(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, o->user_timeout);
+}
+
+/*
+ * Sets TCP_QUICKACK on the state's socket again, if enabled. To be called
+ * after reading from it.
+ */
+static void
+libtwirc_sockopts_rearm(twirc_state_t *s)
+{
+	if (s->sockopts.quickack && s->socket_fd != -1)
+	{
+		libtwirc_sockopts_set(s->socket_fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+	}
+}
+
+/*
+ * Returns the time the kernel received data at, as reported in ts (by
+ * tcpsock_receive_ts(), CLOCK_REALTIME), on our monotonic clock, in ns. If
+ * ts is zero (no time reported), returns the current time instead.
+ */
+static uint64_t
+libtwirc_sockopts_stamp(const struct timespec *ts)
+{
+	uint64_t now = libtwirc_now_ns();
+	if (ts->tv_sec == 0 && ts->tv_nsec == 0)
+	{
+		return now;
+	}
+
+	// How long ago that was, going by the wall clock
+	struct timespec real;
+	clock_gettime(CLOCK_REALTIME, &real);
+	uint64_t then = (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+	uint64_t wall = (uint64_t) real.tv_sec * 1000000000 + real.tv_nsec;
+	uint64_t ago  = wall > then ? wall - then : 0;
+	return now > ago ? now - ago : now;
+}
+
+/*
+ * Sets the socket options opts, see twirc_socket_opts_t, for all connections
+ * the state s makes from now on. If it's connected (or connecting) already,
+ * they're set on its socket right away, too, although buffer sizes might
+ * not fully take effect until the next connection.
+ */
+void
+twirc_set_socket_opts(twirc_state_t *s, const twirc_socket_opts_t *opts)
+{
+	s->sockopts = *opts;
+	if (s->socket_fd != -1 && s->status != TWIRC_STATUS_DISCONNECTED)
+	{
+		libtwirc_sockopts_apply(s, s->socket_fd);
+	}
+}
+
+/*
+ * Fills opts with the effective socket options of the state's socket, as
+ * the kernel reports them (which isn't necessarily what has been asked for:
+ * Linux doubles buffer sizes for its own bookkeeping, for example, and some
+ * options need privileges). Returns 0 on success, -1 if the state doesn't
+ * have a socket (isn't connected).
+ */
+int
+twirc_get_socket_opts(const twirc_state_t *s, twirc_socket_opts_t *opts)
+{
+	memset(opts, 0, sizeof(twirc_socket_opts_t));
+	int fd = s->socket_fd;
+	if (fd == -1 || s->status == TWIRC_STATUS_DISCONNECTED)
+	{
+		return -1;
+	}
+
+	opts->rcvbuf       = libtwirc_sockopts_get(fd, SOL_SOCKET, SO_RCVBUF);
+	opts->sndbuf       = libtwirc_sockopts_get(fd, SOL_SOCKET, SO_SNDBUF);
+	opts->keepalive    = libtwirc_sockopts_get(fd, SOL_SOCKET, SO_KEEPALIVE);
+	opts->timestamps   = libtwirc_sockopts_get(fd, SOL_SOCKET, SO_TIMESTAMPNS);
+#ifdef SO_BUSY_POLL
+	opts->busy_poll    = libtwirc_sockopts_get(fd, SOL_SOCKET, SO_BUSY_POLL);
+#endif
+	opts->nodelay      = libtwirc_sockopts_get(fd, IPPROTO_TCP, TCP_NODELAY);
+	opts->quickack     = libtwirc_sockopts_get(fd, IPPROTO_TCP, TCP_QUICKACK);
+	opts->keepidle     = libtwirc_sockopts_get(fd, IPPROTO_TCP, TCP_KEEPIDLE);
+	opts->keepintvl    = libtwirc_sockopts_get(fd, IPPROTO_TCP, TCP_KEEPINTVL);
+	opts->keepcnt      = libtwirc_sockopts_get(fd, IPPROTO_TCP, TCP_KEEPCNT);
+	opts->user_timeout = libtwirc_sockopts_get(fd, IPPROTO_TCP, TCP_USER_TIMEOUT);
+	return 0;
+}
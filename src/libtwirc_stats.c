@@ -0,0 +1,477 @@
+#include <stdint.h>     // uint64_t
+#include <stdlib.h>     // strtoull()
+#include <string.h>     // memset(), memcpy(), strchr(), strncmp()
+#include <stddef.h>     // offsetof()
+#include <pthread.h>    // pthread_mutex_lock()
+#include <time.h>       // clock_gettime()
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * Every state keeps count of what it does: data and messages received and
+ * sent, reads from the socket, messages per command, how full its buffers
+ * got, how often parsing had to allocate, and how long parsing messages and
+ * running the user's callbacks took. All of it is plain increments (the
+ * state is only ever handled by one thread at a time) plus a few reads of the
+ * clock per message, which don't even leave user space, so it is meant to be
+ * left on in production. Every message received is stamped with the time it
+ * came in (see twirc_event_t); once its callback is about to be called, we
+ * record how long it took from there, and from the server sending it (its
+ * tmi-sent-ts tag). The first tells how far behind our own processing is
+ * (including the wait in a pipeline), the second adds the network to that.
+ * Those two only cover the last TWIRC_STATS_WINDOW to twice that many ms:
+ * there are two windows, one filling up while the other holds the last one,
+ * and whichever is older is started over once a new window begins.
+ * Durations are kept in histograms whose buckets get wider as the values get
+ * bigger, so that every value is known to within 1/TWIRC_HIST_SUB of itself,
+ * no matter how big (like HDR histograms do). Build with TWIRC_NO_STATS to
+ * leave all of it out.
+ */
+
+/*
+ * Returns the lowest value that goes into the bucket with index idx.
+ */
+static uint64_t
+libtwirc_hist_value(size_t idx)
+{
+	if (idx < TWIRC_HIST_SUB)
+	{
+		return idx;
+	}
+	int shift = (int) (idx / TWIRC_HIST_SUB) - 1;
+	return (uint64_t) (TWIRC_HIST_SUB + idx % TWIRC_HIST_SUB) << shift;
+}
+
+/*
+ * Returns the value below which p percent (0 to 100) of the values in the
+ * histogram h are, to within the precision of its buckets (the highest value
+ * of a bucket is reported, so that we never understate), or 0 if it is empty.
+ */
+uint64_t
+twirc_hist_percentile(const twirc_hist_t *h, double p)
+{
+	if (h->count == 0)
+	{
+		return 0;
+	}
+
+	uint64_t rank = (uint64_t) (p / 100.0 * h->count + 0.5);
+	rank = rank < 1 ? 1 : (rank > h->count ? h->count : rank);
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < TWIRC_HIST_BUCKETS; ++i)
+	{
+		seen += h->buckets[i];
+		if (seen >= rank)
+		{
+			// No value is bigger than the biggest one we've seen
+			uint64_t upper = i + 1 < TWIRC_HIST_BUCKETS ? libtwirc_hist_value(i + 1) - 1 : h->max;
+			return upper < h->max ? upper : h->max;
+		}
+	}
+	return h->max;
+}
+
+#ifndef TWIRC_NO_STATS
+
+/*
+ * Returns the index of the bucket that the value v goes into.
+ */
+static size_t
+libtwirc_hist_index(uint64_t v)
+{
+	if (v < TWIRC_HIST_SUB)
+	{
+		return v;
+	}
+
+	// The highest bit picks the power of two, the bits below it the
+	// sub-bucket within that
+	int top = 63 - __builtin_clzll(v);
+	int shift = top - __builtin_ctz(TWIRC_HIST_SUB);
+	size_t idx = (size_t) (shift + 1) * TWIRC_HIST_SUB + ((v >> shift) & (TWIRC_HIST_SUB - 1));
+	return idx < TWIRC_HIST_BUCKETS ? idx : TWIRC_HIST_BUCKETS - 1;
+}
+
+/*
+ * Adds the value v to the histogram h.
+ */
+static void
+libtwirc_hist_add(twirc_hist_t *h, uint64_t v)
+{
+	h->buckets[libtwirc_hist_index(v)] += 1;
+	h->count += 1;
+	h->sum   += v;
+	h->max    = v > h->max ? v : h->max;
+}
+
+/*
+ * Adds the value v to the histogram h, which other threads might be adding
+ * to at the same time (callbacks run by a pipeline).
+ */
+static void
+libtwirc_hist_add_atomic(twirc_hist_t *h, uint64_t v)
+{
+	__atomic_fetch_add(&h->buckets[libtwirc_hist_index(v)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, 1,
+	       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+		// max has been updated, try again
+	}
+}
+
+/*
+ * Sets the histogram h back to 0, while other threads might be adding to it.
+ */
+static void
+libtwirc_hist_clear_atomic(twirc_hist_t *h)
+{
+	for (size_t i = 0; i < TWIRC_HIST_BUCKETS; ++i)
+	{
+		__atomic_store_n(&h->buckets[i], 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Adds the histogram from to the histogram h, while other threads might be 
+ * adding to from.
+ */
+static void
+libtwirc_hist_merge_atomic(twirc_hist_t *h, twirc_hist_t *from)
+{
+	for (size_t i = 0; i < TWIRC_HIST_BUCKETS; ++i)
+	{
+		h->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+	}
+	h->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+	h->sum   += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+	h->max    = max > h->max ? max : h->max;
+}
+
+/*
+ * Returns the number of the window that the time now (ns) falls into.
+ */
+static uint64_t
+libtwirc_stats_epoch(uint64_t now)
+{
+	return now / ((uint64_t) TWIRC_STATS_WINDOW * 1000000);
+}
+
+/*
+ * Returns the window of the state s that latencies recorded at time now (ns)
+ * go into. If that is the older of the two, it is started over for the new
+ * window; whichever thread gets there first does that. Values added by other
+ * threads right while it does might get lost, which is fine for statistics.
+ */
+static struct libtwirc_window*
+libtwirc_stats_window(twirc_state_t *s, uint64_t now)
+{
+	uint64_t epoch = libtwirc_stats_epoch(now);
+	struct libtwirc_window *w = &s->windows[epoch & 1];
+
+	uint64_t old = __atomic_load_n(&w->epoch, __ATOMIC_ACQUIRE);
+	while (old < epoch)
+	{
+		if (__atomic_compare_exchange_n(&w->epoch, &old, epoch, 0,
+		    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			libtwirc_hist_clear_atomic(&w->recv_to_cb_ns);
+			libtwirc_hist_clear_atomic(&w->sent_to_cb_ns);
+			break;
+		}
+	}
+	return w;
+}
+
+/*
+ * Returns the tmi-sent-ts tag of the event evt (ms since the epoch), or 0
+ * if it has none. If its tags haven't been split (lazy tags), we look for it
+ * in the tags string, rather than having all of them split for this.
+ */
+static uint64_t
+libtwirc_stats_sent_ts(twirc_event_t *evt)
+{
+	const char *val = NULL;
+	if (evt->tag_block == NULL)
+	{
+		unsigned char idx = evt->tag_index[TWIRC_TAG_TMI_SENT_TS];
+		val = idx ? evt->tag_list[idx - 1]->value : NULL;
+	}
+	else
+	{
+		const char *tag = evt->tag_block;
+		while (tag)
+		{
+			if (strncmp(tag, "tmi-sent-ts=", 12) == 0)
+			{
+				val = tag + 12;
+				break;
+			}
+			tag = strchr(tag, ';');
+			tag = tag ? tag + 1 : NULL;
+		}
+	}
+	return val ? strtoull(val, NULL, 10) : 0;
+}
+
+/*
+ * Returns the current time of the monotonic clock, in nanoseconds.
+ */
+static uint64_t
+libtwirc_stats_now()
+{
+	return libtwirc_now_ns();
+}
+
+/*
+ * Records how long the event evt, which is about to be handed to a callback
+ * at time now (ns), has been on its way: since the server sent it (going by
+ * its tmi-sent-ts tag and our wall clock) and since we received it. Can be
+ * called from any thread. Outbound events are of no interest.
+ */
+static void
+libtwirc_stats_latency(twirc_state_t *s, twirc_event_t *evt, uint64_t now)
+{
+	if (evt == NULL || evt->recv_ns == 0)
+	{
+		return;
+	}
+	struct libtwirc_window *w = libtwirc_stats_window(s, now);
+	libtwirc_hist_add_atomic(&w->recv_to_cb_ns, now > evt->recv_ns ? now - evt->recv_ns : 0);
+
+	uint64_t sent = libtwirc_stats_sent_ts(evt);
+	if (sent == 0)
+	{
+		return;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	uint64_t wall = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	sent *= 1000000;
+
+	// Our clock is behind the server's, so this tells us nothing
+	if (sent > wall)
+	{
+		__atomic_fetch_add(&s->stats.clock_skewed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	libtwirc_hist_add_atomic(&w->sent_to_cb_ns, wall - sent);
+}
+
+/*
+ * Counts a read from the socket that returned res (bytes, 0 or -1).
+ */
+static void
+libtwirc_stats_recv(twirc_state_t *s, ssize_t res)
+{
+	s->stats.recvs += 1;
+	s->stats.bytes_recv += res > 0 ? res : 0;
+}
+
+/*
+ * Counts a write to the socket that returned res (bytes or -1).
+ */
+static void
+libtwirc_stats_send(twirc_state_t *s, ssize_t res)
+{
+	s->stats.sends += 1;
+	s->stats.bytes_sent += res > 0 ? res : 0;
+}
+
+/*
+ * Notes how full the state's buffer is, before its messages are processed.
+ */
+static void
+libtwirc_stats_buffer(twirc_state_t *s)
+{
+	if (s->buf_len > s->stats.buf_high)
+	{
+		s->stats.buf_high = s->buf_len;
+	}
+}
+
+/*
+ * Notes how full the state's outbound queue is, after adding to it.
+ */
+static void
+libtwirc_stats_queue(twirc_state_t *s)
+{
+	size_t queued = s->out_len - s->out_head;
+	if (queued > s->stats.out_high)
+	{
+		s->stats.out_high = queued;
+	}
+}
+
+/*
+ * Counts a message received, or one that has been queued for sending (if
+ * outbound is set); dropped is set if no one is interested in it.
+ */
+static void
+libtwirc_stats_msg(twirc_state_t *s, int outbound, int dropped)
+{
+	if (outbound)
+	{
+		s->stats.msgs_sent += 1;
+		return;
+	}
+	s->stats.msgs_recv += 1;
+	s->stats.msgs_dropped += dropped;
+}
+
+/*
+ * Counts a message that has been parsed, which started at t0 (ns) and took
+ * allocs new chunks of the arena.
+ */
+static void
+libtwirc_stats_parsed(twirc_state_t *s, uint64_t t0, size_t allocs)
+{
+	s->stats.msgs_parsed += 1;
+	s->stats.allocs += allocs;
+	libtwirc_hist_add(&s->stats.parse_ns, libtwirc_stats_now() - t0);
+}
+
+/*
+ * Counts an event dispatched with command id (TWIRC_CMD_COUNT for CTCP).
+ */
+static void
+libtwirc_stats_command(twirc_state_t *s, int id)
+{
+	s->stats.commands[id] += 1;
+}
+
+/*
+ * Counts a callback that started at t0 (ns).
+ */
+static void
+libtwirc_stats_callback(twirc_state_t *s, uint64_t t0)
+{
+	libtwirc_hist_add(&s->stats.callback_ns, libtwirc_stats_now() - t0);
+}
+
+/*
+ * Copies the statistics of the state s into stats. The latency histograms 
+ * are made up of the current window and the one before it, if that is the
+ * last one. Can be called from any thread. Returns 0 on success, -1 if the
+ * library has been built without them (TWIRC_NO_STATS).
+ */
+int
+twirc_get_stats(twirc_state_t *s, twirc_stats_t *stats)
+{
+	pthread_mutex_lock(&s->lock);
+	memcpy(stats, &s->stats, sizeof(twirc_stats_t));
+	pthread_mutex_unlock(&s->lock);
+
+	stats->clock_skewed = __atomic_load_n(&s->stats.clock_skewed, __ATOMIC_RELAXED);
+	memset(&stats->recv_to_cb_ns, 0, sizeof(twirc_hist_t));
+	memset(&stats->sent_to_cb_ns, 0, sizeof(twirc_hist_t));
+	uint64_t epoch = libtwirc_stats_epoch(libtwirc_stats_now());
+	for (int i = 0; i < 2; ++i)
+	{
+		struct libtwirc_window *w = &s->windows[i];
+		if (__atomic_load_n(&w->epoch, __ATOMIC_ACQUIRE) + 1 >= epoch)
+		{
+			libtwirc_hist_merge_atomic(&stats->recv_to_cb_ns, &w->recv_to_cb_ns);
+			libtwirc_hist_merge_atomic(&stats->sent_to_cb_ns, &w->sent_to_cb_ns);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Sets all statistics of the state s back to 0. What callbacks run by a 
+ * pipeline add to (the latencies) is cleared atomically, as they don't 
+ * hold the state's lock.
+ */
+void
+twirc_reset_stats(twirc_state_t *s)
+{
+	// Everything up to the latencies is only ever touched with the lock
+	pthread_mutex_lock(&s->lock);
+	memset(&s->stats, 0, offsetof(twirc_stats_t, recv_to_cb_ns));
+	pthread_mutex_unlock(&s->lock);
+
+	__atomic_store_n(&s->stats.clock_skewed, 0, __ATOMIC_RELAXED);
+	for (int i = 0; i < 2; ++i)
+	{
+		libtwirc_hist_clear_atomic(&s->windows[i].recv_to_cb_ns);
+		libtwirc_hist_clear_atomic(&s->windows[i].sent_to_cb_ns);
+	}
+}
+
+#else
+
+static uint64_t
+libtwirc_stats_now()
+{
+	return 0;
+}
+
+static void
+libtwirc_stats_recv(twirc_state_t *s, ssize_t res)
+{
+}
+
+static void
+libtwirc_stats_send(twirc_state_t *s, ssize_t res)
+{
+}
+
+static void
+libtwirc_stats_buffer(twirc_state_t *s)
+{
+}
+
+static void
+libtwirc_stats_queue(twirc_state_t *s)
+{
+}
+
+static void
+libtwirc_stats_msg(twirc_state_t *s, int outbound, int dropped)
+{
+}
+
+static void
+libtwirc_stats_parsed(twirc_state_t *s, uint64_t t0, size_t allocs)
+{
+}
+
+static void
+libtwirc_stats_command(twirc_state_t *s, int id)
+{
+}
+
+static void
+libtwirc_stats_callback(twirc_state_t *s, uint64_t t0)
+{
+}
+
+static void
+libtwirc_stats_latency(twirc_state_t *s, twirc_event_t *evt, uint64_t now)
+{
+}
+
+/*
+ * Built without statistics, so there are none to get. Returns -1.
+ */
+int
+twirc_get_stats(twirc_state_t *s, twirc_stats_t *stats)
+{
+	memset(stats, 0, sizeof(twirc_stats_t));
+	return -1;
+}
+
+void
+twirc_reset_stats(twirc_state_t *s)
+{
+}
+
+#endif
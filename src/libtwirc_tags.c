@@ -0,0 +1,167 @@
+#include <string.h>     // strcmp()
+#include "libtwirc.h"
+
+/*
+ * Well-known tags. Twitch sends a good number of tags with most messages, and
+ * most of them are always the same. Instead of having to compare the keys of
+ * all tags of an event to find the one we need, we give every well-known tag
+ * an ID (see TWIRC_TAG_* in libtwirc.h) and remember where in the event's tag
+ * array each of them can be found while parsing the tags. Looking up a tag by
+ * its ID is then just an array access.
+ *
+ * To figure out the ID of a key while parsing, we use a perfect hash: every 
+ * well-known key ends up in its own slot of libtwirc_tag_slots. The hash only
+ * looks at the length of the key and three of its characters, so it is cheap
+ * to compute; a single strcmp() then tells us if the key really is the one in
+ * that slot. If you add keys, you'll have to find new factors for the hash, 
+ * so that there are no collisions. A small script trying all combinations of
+ * factors from 1 to 40 will find one in no time.
+ */
+
+// Number of slots in the hash table, has to be a power of two
+#define TWIRC_TAG_SLOTS 128
+
+// Keys of the well-known tags, in the order of their IDs
+static const char *libtwirc_tag_keys[TWIRC_TAG_COUNT] =
+{
+	"badge-info",
+	"badges",
+	"ban-duration",
+	"bits",
+	"broadcaster-lang",
+	"client-nonce",
+	"color",
+	"display-name",
+	"emote-only",
+	"emote-sets",
+	"emotes",
+	"first-msg",
+	"flags",
+	"followers-only",
+	"id",
+	"login",
+	"message-id",
+	"mod",
+	"msg-id",
+	"msg-param-cumulative-months",
+	"msg-param-displayName",
+	"msg-param-login",
+	"msg-param-months",
+	"msg-param-recipient-display-name",
+	"msg-param-recipient-id",
+	"msg-param-recipient-user-name",
+	"msg-param-ritual-name",
+	"msg-param-should-share-streak",
+	"msg-param-streak-months",
+	"msg-param-sub-plan",
+	"msg-param-sub-plan-name",
+	"msg-param-viewerCount",
+	"r9k",
+	"reply-parent-display-name",
+	"reply-parent-msg-body",
+	"reply-parent-msg-id",
+	"reply-parent-user-id",
+	"reply-parent-user-login",
+	"returning-chatter",
+	"room-id",
+	"slow",
+	"subs-only",
+	"subscriber",
+	"system-msg",
+	"target-msg-id",
+	"target-user-id",
+	"thread-id",
+	"tmi-sent-ts",
+	"turbo",
+	"user-id",
+	"user-type",
+	"vip",
+};
+
+// Hash table slots, holding the ID of a well-known tag plus one (0 = empty)
+static const unsigned char libtwirc_tag_slots[TWIRC_TAG_SLOTS] =
+{
+	[  1] = TWIRC_TAG_FOLLOWERS_ONLY + 1,
+	[  2] = TWIRC_TAG_MSG_PARAM_DISPLAYNAME + 1,
+	[  3] = TWIRC_TAG_MSG_PARAM_VIEWERCOUNT + 1,
+	[  5] = TWIRC_TAG_MESSAGE_ID + 1,
+	[ 11] = TWIRC_TAG_COLOR + 1,
+	[ 12] = TWIRC_TAG_MSG_PARAM_SHOULD_SHARE_STREAK + 1,
+	[ 13] = TWIRC_TAG_MSG_ID + 1,
+	[ 15] = TWIRC_TAG_DISPLAY_NAME + 1,
+	[ 16] = TWIRC_TAG_MSG_PARAM_RECIPIENT_DISPLAY_NAME + 1,
+	[ 20] = TWIRC_TAG_SUBS_ONLY + 1,
+	[ 22] = TWIRC_TAG_EMOTES + 1,
+	[ 30] = TWIRC_TAG_MSG_PARAM_SUB_PLAN_NAME + 1,
+	[ 31] = TWIRC_TAG_USER_ID + 1,
+	[ 34] = TWIRC_TAG_TARGET_MSG_ID + 1,
+	[ 36] = TWIRC_TAG_TARGET_USER_ID + 1,
+	[ 40] = TWIRC_TAG_SYSTEM_MSG + 1,
+	[ 42] = TWIRC_TAG_RETURNING_CHATTER + 1,
+	[ 46] = TWIRC_TAG_EMOTE_SETS + 1,
+	[ 47] = TWIRC_TAG_TMI_SENT_TS + 1,
+	[ 48] = TWIRC_TAG_LOGIN + 1,
+	[ 49] = TWIRC_TAG_FIRST_MSG + 1,
+	[ 50] = TWIRC_TAG_MSG_PARAM_RECIPIENT_USER_NAME + 1,
+	[ 51] = TWIRC_TAG_REPLY_PARENT_MSG_BODY + 1,
+	[ 52] = TWIRC_TAG_SLOW + 1,
+	[ 53] = TWIRC_TAG_MSG_PARAM_RECIPIENT_ID + 1,
+	[ 55] = TWIRC_TAG_REPLY_PARENT_DISPLAY_NAME + 1,
+	[ 56] = TWIRC_TAG_MSG_PARAM_STREAK_MONTHS + 1,
+	[ 68] = TWIRC_TAG_VIP + 1,
+	[ 69] = TWIRC_TAG_MSG_PARAM_LOGIN + 1,
+	[ 70] = TWIRC_TAG_CLIENT_NONCE + 1,
+	[ 71] = TWIRC_TAG_MOD + 1,
+	[ 74] = TWIRC_TAG_USER_TYPE + 1,
+	[ 76] = TWIRC_TAG_REPLY_PARENT_MSG_ID + 1,
+	[ 77] = TWIRC_TAG_SUBSCRIBER + 1,
+	[ 78] = TWIRC_TAG_REPLY_PARENT_USER_ID + 1,
+	[ 79] = TWIRC_TAG_BITS + 1,
+	[ 82] = TWIRC_TAG_MSG_PARAM_RITUAL_NAME + 1,
+	[ 85] = TWIRC_TAG_FLAGS + 1,
+	[ 88] = TWIRC_TAG_MSG_PARAM_CUMULATIVE_MONTHS + 1,
+	[ 91] = TWIRC_TAG_BADGES + 1,
+	[ 95] = TWIRC_TAG_TURBO + 1,
+	[ 98] = TWIRC_TAG_MSG_PARAM_MONTHS + 1,
+	[ 99] = TWIRC_TAG_BROADCASTER_LANG + 1,
+	[100] = TWIRC_TAG_BAN_DURATION + 1,
+	[101] = TWIRC_TAG_R9K + 1,
+	[104] = TWIRC_TAG_EMOTE_ONLY + 1,
+	[107] = TWIRC_TAG_MSG_PARAM_SUB_PLAN + 1,
+	[113] = TWIRC_TAG_ID + 1,
+	[114] = TWIRC_TAG_REPLY_PARENT_USER_LOGIN + 1,
+	[116] = TWIRC_TAG_ROOM_ID + 1,
+	[122] = TWIRC_TAG_THREAD_ID + 1,
+	[127] = TWIRC_TAG_BADGE_INFO + 1,
+};
+
+/*
+ * Returns the slot of the hash table that the key of length len belongs to.
+ */
+static inline unsigned
+libtwirc_tag_hash(const char *key, size_t len)
+{
+	const unsigned char *k = (const unsigned char *) key;
+	return (len * 2 + k[0] * 17 + k[len - 1] * 31 + k[(len - 1) / 2] * 24) 
+		& (TWIRC_TAG_SLOTS - 1);
+}
+
+/*
+ * Returns the ID of the tag with the given key, which has a length of len,
+ * or -1 if it isn't one of the well-known tags.
+ */
+static int
+libtwirc_tag_id(const char *key, size_t len)
+{
+	if (len == 0)
+	{
+		return -1;
+	}
+
+	int id = libtwirc_tag_slots[libtwirc_tag_hash(key, len)] - 1;
+	if (id == -1 || strcmp(libtwirc_tag_keys[id], key) != 0)
+	{
+		return -1;
+	}
+	return id;
+}
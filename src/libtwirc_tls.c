@@ -0,0 +1,368 @@
+#include <errno.h>      // errno, EAGAIN, EPROTO
+#include <pthread.h>    // pthread_once()
+#include <sys/epoll.h>  // epoll_ctl()
+#include <sys/socket.h> // shutdown()
+#ifdef TWIRC_TLS
+#include <openssl/ssl.h> // SSL_*()
+#include <openssl/err.h> // ERR_clear_error()
+#endif
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * If enabled (see twirc_set_tls()), the connection to the server is encrypted
+ * with TLS, using OpenSSL (Twitch wants port 6697 for that). The handshake
+ * is done once the socket has connected, in place of reporting the connect;
+ * after that, libtwirc_recv() and libtwirc_flush() go through SSL_read() and
+ * SSL_write(), with OpenSSL wanting to read or write mapped to EAGAIN, so the
+ * rest of the library doesn't have to care. OpenSSL is asked to hand the
+ * encryption off to the kernel (kTLS), for sending and receiving separately;
+ * if the kernel has the tls module, SSL_write() and SSL_read() then come down
+ * to plain send() and recv(), without copying the data through user space
+ * buffers of OpenSSL's. Otherwise (or if the cipher isn't supported by the
+ * kernel), OpenSSL does it as usual. A pool's io_uring would only get to see
+ * encrypted data, so states using TLS are left out of it and handled with
+ * epoll. Build with TWIRC_TLS (and link with -lssl -lcrypto) to have this;
+ * without it, twirc_set_tls() fails.
+ */
+
+#ifdef TWIRC_TLS
+
+// Context used by all states that don't bring their own CA file
+static SSL_CTX *libtwirc_tls_default = NULL;
+static pthread_once_t libtwirc_tls_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Creates a client context that verifies the server's certificate against
+ * the CA certificates in the file ca_file or, if NULL, the system's default
+ * ones. Returns the context or NULL on error.
+ */
+static SSL_CTX*
+libtwirc_tls_ctx(const char *ca_file)
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	if (ctx == NULL)
+	{
+		return NULL;
+	}
+
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+	// Partial writes are what tcpsock_send() would do, too, and the queue
+	// might have moved by the time we retry one
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+			SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	// Twitch doesn't always bother with close_notify; closing the connection
+	// is noticed all the same
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	int ok = ca_file ? SSL_CTX_load_verify_locations(ctx, ca_file, NULL) :
+		SSL_CTX_set_default_verify_paths(ctx);
+	if (!ok)
+	{
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+/*
+ * Creates the default context, once.
+ */
+static void
+libtwirc_tls_init(void)
+{
+	libtwirc_tls_default = libtwirc_tls_ctx(NULL);
+}
+
+/*
+ * Takes the state s out of its pool's io_uring, if it's in there, and has
+ * epoll report incoming data on its socket instead.
+ */
+static void
+libtwirc_tls_unring(twirc_state_t *s)
+{
+	if (s->uring_slot == -1)
+	{
+		return;
+	}
+	libtwirc_uring_detach(s->pool, s);
+
+	struct epoll_event eev = { 0 };
+	eev.data.ptr = &s->sock_watch;
+	eev.events = EPOLLRDHUP | EPOLLOUT | EPOLLET | EPOLLIN;
+	epoll_ctl(s->epfd, EPOLL_CTL_MOD, s->socket_fd, &eev);
+}
+
+/*
+ * Does (the next step of) the TLS handshake, for a state whose socket has
+ * connected. Returns 1 if it is done (or the state doesn't use TLS), 0 if it
+ * is in progress (we'll be called again once the socket is readable or
+ * writable, see libtwirc_handle_event()), -1 if it failed.
+ */
+static int
+libtwirc_tls_handshake(twirc_state_t *s)
+{
+	if (!s->tls)
+	{
+		return 1;
+	}
+
+	if (s->ssl == NULL)
+	{
+		libtwirc_tls_unring(s);
+
+		SSL_CTX *ctx = s->tls_ctx ? s->tls_ctx : libtwirc_tls_default;
+		s->ssl = SSL_new(ctx);
+		if (s->ssl == NULL)
+		{
+			return -1;
+		}
+
+		// Send the host name along (SNI) and make sure the certificate
+		// is actually for it
+		const char *host = s->login.host;
+		if (SSL_set_fd(s->ssl, s->socket_fd) != 1 ||
+		    SSL_set_tlsext_host_name(s->ssl, host) != 1 ||
+		    SSL_set1_host(s->ssl, host) != 1)
+		{
+			libtwirc_tls_free(s);
+			return -1;
+		}
+		SSL_set_connect_state(s->ssl);
+	}
+
+	ERR_clear_error();
+	int ret = SSL_do_handshake(s->ssl);
+	if (ret != 1)
+	{
+		int err = SSL_get_error(s->ssl, ret);
+		return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+	}
+
+	// Find out which directions the kernel took over
+	s->ktls = 0;
+#ifndef OPENSSL_NO_KTLS
+	s->ktls |= BIO_get_ktls_send(SSL_get_wbio(s->ssl)) ? TWIRC_KTLS_TX : 0;
+	s->ktls |= BIO_get_ktls_recv(SSL_get_rbio(s->ssl)) ? TWIRC_KTLS_RX : 0;
+#endif
+	return 1;
+}
+
+/*
+ * Maps the result ret of SSL_read() or SSL_write() to what recv() or send()
+ * would have returned. A connection that has become unusable (broken records,
+ * for example) is shut down, so that it will be noticed like any other lost
+ * connection.
+ */
+static ssize_t
+libtwirc_tls_result(twirc_state_t *s, int ret)
+{
+	if (ret > 0)
+	{
+		return ret;
+	}
+
+	switch (SSL_get_error(s->ssl, ret))
+	{
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_SYSCALL:
+			// errno has been set by the failed call already
+			return -1;
+		default:
+			shutdown(s->socket_fd, SHUT_RDWR);
+			errno = EPROTO;
+			return -1;
+	}
+}
+
+/*
+ * Decrypts up to len bytes of data from the connection into buf. Returns the
+ * number of bytes received, 0 if the peer closed the connection or -1 on
+ * error (with errno set to EAGAIN if there is nothing to read right now).
+ */
+static ssize_t
+libtwirc_tls_recv(twirc_state_t *s, char *buf, size_t len)
+{
+	ERR_clear_error();
+	return libtwirc_tls_result(s, SSL_read(s->ssl, buf, len));
+}
+
+/*
+ * Encrypts and sends up to len bytes of data from buf. Returns the number of
+ * bytes sent or -1 on error (with errno set to EAGAIN if the socket can't
+ * take any more right now).
+ */
+static ssize_t
+libtwirc_tls_send(twirc_state_t *s, const char *buf, size_t len)
+{
+	ERR_clear_error();
+	return libtwirc_tls_result(s, SSL_write(s->ssl, buf, len));
+}
+
+/*
+ * Returns 1 if the TLS handshake of the state s is waiting for its socket to
+ * become writable, otherwise 0 (waiting for it to become readable).
+ */
+static int
+libtwirc_tls_want_write(const twirc_state_t *s)
+{
+	return s->ssl != NULL && SSL_want_write(s->ssl);
+}
+
+/*
+ * Frees the TLS session of the state s, if it has one. Doesn't close the
+ * socket.
+ */
+static void
+libtwirc_tls_free(twirc_state_t *s)
+{
+	if (s->ssl != NULL)
+	{
+		SSL_free(s->ssl);
+		s->ssl = NULL;
+	}
+	s->ktls = 0;
+}
+
+/*
+ * Has the state s use the TLS settings of the state from (the same context,
+ * shared), for a second connection to the same server. The context s might
+ * still hold from an earlier copy is released.
+ */
+static void
+libtwirc_tls_copy(twirc_state_t *s, const twirc_state_t *from)
+{
+	s->tls = from->tls;
+	if (s->tls_ctx == from->tls_ctx)
+	{
+		return;
+	}
+	if (s->tls_ctx != NULL)
+	{
+		SSL_CTX_free(s->tls_ctx);
+		s->tls_ctx = NULL;
+	}
+	if (from->tls_ctx != NULL && SSL_CTX_up_ref(from->tls_ctx) == 1)
+	{
+		s->tls_ctx = from->tls_ctx;
+	}
+}
+
+/*
+ * Has the state s use TLS (if tls is 1) for its next connect, or not (0).
+ * The server's certificate is verified against the CA certificates in the
+ * file ca_file (PEM) or, if NULL, the system's default ones. Returns 0 on
+ * success, -1 if the CA file couldn't be loaded or OpenSSL couldn't be set
+ * up (the error will be set to TWIRC_ERR_TLS_INIT).
+ */
+int
+twirc_set_tls(twirc_state_t *s, int tls, const char *ca_file)
+{
+	if (s->tls_ctx != NULL)
+	{
+		SSL_CTX_free(s->tls_ctx);
+		s->tls_ctx = NULL;
+	}
+	s->tls = 0;
+
+	if (!tls)
+	{
+		return 0;
+	}
+
+	if (ca_file != NULL)
+	{
+		s->tls_ctx = libtwirc_tls_ctx(ca_file);
+	}
+	else
+	{
+		pthread_once(&libtwirc_tls_once, libtwirc_tls_init);
+	}
+	if (s->tls_ctx == NULL && (ca_file != NULL || libtwirc_tls_default == NULL))
+	{
+		s->error = TWIRC_ERR_TLS_INIT;
+		return -1;
+	}
+
+	s->tls = 1;
+	return 0;
+}
+
+#else
+
+static int
+libtwirc_tls_handshake(twirc_state_t *s)
+{
+	return s->tls ? -1 : 1;
+}
+
+static ssize_t
+libtwirc_tls_recv(twirc_state_t *s, char *buf, size_t len)
+{
+	errno = EPROTO;
+	return -1;
+}
+
+static ssize_t
+libtwirc_tls_send(twirc_state_t *s, const char *buf, size_t len)
+{
+	errno = EPROTO;
+	return -1;
+}
+
+static int
+libtwirc_tls_want_write(const twirc_state_t *s)
+{
+	return 0;
+}
+
+static void
+libtwirc_tls_free(twirc_state_t *s)
+{
+	s->ktls = 0;
+}
+
+static void
+libtwirc_tls_copy(twirc_state_t *s, const twirc_state_t *from)
+{
+	s->tls = from->tls;
+}
+
+/*
+ * Built without TWIRC_TLS, so TLS can't be enabled. Returns 0 if tls is 0,
+ * otherwise -1 (the error will be set to TWIRC_ERR_TLS_INIT).
+ */
+int
+twirc_set_tls(twirc_state_t *s, int tls, const char *ca_file)
+{
+	if (tls)
+	{
+		s->error = TWIRC_ERR_TLS_INIT;
+		return -1;
+	}
+	return 0;
+}
+
+#endif
+
+/*
+ * Returns which directions of the state's TLS connection are encrypted by
+ * the kernel, as a combination of TWIRC_KTLS_TX and TWIRC_KTLS_RX, or 0 if
+ * none are (or the state doesn't use TLS, or isn't connected).
+ */
+int
+twirc_get_ktls(const twirc_state_t *s)
+{
+	return s->ktls;
+}
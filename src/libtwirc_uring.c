@@ -0,0 +1,866 @@
+#include <stdlib.h>     // NULL, malloc(), calloc(), realloc(), free()
+#include <string.h>     // memset(), memcpy()
+#include <errno.h>      // errno, ENOBUFS, EINVAL, EINTR
+#include <unistd.h>     // syscall()
+#include <signal.h>     // sigset_t, _NSIG
+#include <sys/mman.h>   // mmap(), munmap()
+#include <sys/syscall.h>// __NR_io_uring_*
+#include <sys/epoll.h>  // epoll_wait()
+#include <poll.h>       // POLLIN
+#include "libtwirc.h"
+#include "libtwirc_internal.h"
+
+/*
+ * The io_uring backend replaces epoll_pwait() and the recv() loop of a pool
+ * with one io_uring instance. Every connected socket has a multishot recv
+ * pending, which picks a buffer from a ring of buffers that the kernel fills
+ * on its own, so that receiving data takes no syscall at all. Sends are
+ * collected while events are handled and submitted in one go, together with
+ * waiting for the next completions, with one io_uring_enter() per tick.
+ * Everything else (connecting, hangups, the rate limiter's timers and the
+ * runtime's mailboxes) still goes through the pool's epoll instance, which is
+ * watched by a multishot poll on the ring; sockets are left in there, but
+ * without EPOLLIN. The completion of every request carries the index of the
+ * state's slot and the kind of request. Before a socket is closed, or its
+ * state leaves the pool, its requests are cancelled; data that came in until
+ * then is only added to the state's buffer, and will be handled along with
+ * the next data received. The ring is used by raw syscalls, so we don't
+ * depend on liburing. Build with TWIRC_NO_URING to leave it out.
+ */
+
+#ifndef TWIRC_NO_URING
+
+// Kinds of requests, stored in the lowest bits of a request's user_data
+#define TWIRC_URING_RECV   1
+#define TWIRC_URING_SEND   2
+#define TWIRC_URING_POLL   3
+#define TWIRC_URING_CANCEL 4
+#define TWIRC_URING_BITS   3
+
+// Buffer group of the provided buffers
+#define TWIRC_URING_BGID 0
+
+/*
+ * Thin wrappers around the io_uring syscalls, which glibc doesn't have.
+ */
+static int
+libtwirc_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+libtwirc_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t size)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+}
+
+static int
+libtwirc_uring_register(int fd, unsigned op, void *arg, unsigned num)
+{
+	return (int) syscall(__NR_io_uring_register, fd, op, arg, num);
+}
+
+/*
+ * Unmaps and closes everything that libtwirc_uring_init() set up and frees
+ * the ring, which doesn't have to be complete.
+ */
+static void
+libtwirc_uring_free(struct libtwirc_uring *u)
+{
+	if (u->br)
+	{
+		munmap(u->br, TWIRC_URING_BUFS * sizeof(struct io_uring_buf));
+	}
+	if (u->sqes)
+	{
+		munmap(u->sqes, u->sqes_size);
+	}
+	if (u->cq_ring && u->cq_ring != u->sq_ring)
+	{
+		munmap(u->cq_ring, u->cq_ring_size);
+	}
+	if (u->sq_ring)
+	{
+		munmap(u->sq_ring, u->sq_ring_size);
+	}
+	if (u->fd != -1)
+	{
+		close(u->fd);
+	}
+	for (size_t i = 0; i < u->num_slots; ++i)
+	{
+		free(u->slots[i].sending);
+	}
+	free(u->bufs);
+	free(u->slots);
+	free(u->dirty);
+	free(u->backlog);
+	free(u);
+}
+
+/*
+ * Hands the buffer with the ID bid (back) to the kernel.
+ */
+static void
+libtwirc_uring_recycle(struct libtwirc_uring *u, unsigned short bid)
+{
+	struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (TWIRC_URING_BUFS - 1)];
+	buf->addr = (uint64_t) (uintptr_t) (u->bufs + (size_t) bid * TWIRC_BUFFER_SIZE);
+	buf->len  = TWIRC_BUFFER_SIZE;
+	buf->bid  = bid;
+	u->br_tail += 1;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Sets up a ring with its buffers. Returns a pointer to it or NULL if that
+ * didn't work out (io_uring not supported, not allowed, out of memory, ...).
+ */
+static struct libtwirc_uring*
+libtwirc_uring_init()
+{
+	struct libtwirc_uring *u = calloc(1, sizeof(struct libtwirc_uring));
+	if (u == NULL) { return NULL; }
+
+	struct io_uring_params params = { 0 };
+	u->fd = libtwirc_uring_setup(TWIRC_URING_ENTRIES, &params);
+	if (u->fd == -1 || !(params.features & IORING_FEAT_EXT_ARG))
+	{
+		libtwirc_uring_free(u);
+		return NULL;
+	}
+
+	// Map the submission and completion rings, which might be one
+	u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (u->cq_ring_size > u->sq_ring_size)
+		{
+			u->sq_ring_size = u->cq_ring_size;
+		}
+		u->cq_ring_size = u->sq_ring_size;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+	{
+		u->sq_ring = NULL;
+		libtwirc_uring_free(u);
+		return NULL;
+	}
+	u->cq_ring = u->sq_ring;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+		{
+			u->cq_ring = NULL;
+			libtwirc_uring_free(u);
+			return NULL;
+		}
+	}
+	u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+	{
+		u->sqes = NULL;
+		libtwirc_uring_free(u);
+		return NULL;
+	}
+
+	char *sq = u->sq_ring;
+	u->sq_head    = (unsigned *) (sq + params.sq_off.head);
+	u->sq_tail    = (unsigned *) (sq + params.sq_off.tail);
+	u->sq_mask    = *(unsigned *) (sq + params.sq_off.ring_mask);
+	u->sq_entries = *(unsigned *) (sq + params.sq_off.ring_entries);
+	u->sq_array   = (unsigned *) (sq + params.sq_off.array);
+	char *cq = u->cq_ring;
+	u->cq_head    = (unsigned *) (cq + params.cq_off.head);
+	u->cq_tail    = (unsigned *) (cq + params.cq_off.tail);
+	u->cq_mask    = *(unsigned *) (cq + params.cq_off.ring_mask);
+	u->cqes       = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	// Set up the buffers the kernel will receive data into
+	u->bufs = malloc((size_t) TWIRC_URING_BUFS * TWIRC_BUFFER_SIZE);
+	u->br = mmap(NULL, TWIRC_URING_BUFS * sizeof(struct io_uring_buf),
+			PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (u->br == MAP_FAILED)
+	{
+		u->br = NULL;
+	}
+	if (u->bufs == NULL || u->br == NULL)
+	{
+		libtwirc_uring_free(u);
+		return NULL;
+	}
+
+	struct io_uring_buf_reg reg = { 0 };
+	reg.ring_addr    = (uint64_t) (uintptr_t) u->br;
+	reg.ring_entries = TWIRC_URING_BUFS;
+	reg.bgid         = TWIRC_URING_BGID;
+	if (libtwirc_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+	{
+		libtwirc_uring_free(u);
+		return NULL;
+	}
+	for (unsigned i = 0; i < TWIRC_URING_BUFS; ++i)
+	{
+		libtwirc_uring_recycle(u, i);
+	}
+
+	u->multishot = 1;
+	return u;
+}
+
+/*
+ * Submits all prepared requests without waiting for any of them.
+ * Returns 0 on success, -1 on error (see errno).
+ */
+static int
+libtwirc_uring_submit(struct libtwirc_uring *u)
+{
+	while (u->to_submit > 0)
+	{
+		int ret = libtwirc_uring_enter(u->fd, u->to_submit, 0, 0, NULL, 0);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		u->to_submit -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Returns the next free submission queue entry, cleared, which will be
+ * submitted with the next call of io_uring_enter(). If the queue is full,
+ * what's in it is submitted first.
+ */
+static struct io_uring_sqe*
+libtwirc_uring_sqe(struct libtwirc_uring *u, int kind, size_t slot)
+{
+	unsigned tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+	{
+		libtwirc_uring_submit(u);
+	}
+
+	unsigned idx = tail & u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->user_data = ((uint64_t) slot << TWIRC_URING_BITS) | kind;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit += 1;
+	return sqe;
+}
+
+/*
+ * Has the ring watch the pool's epoll instance.
+ */
+static void
+libtwirc_uring_poll(twirc_pool_t *p)
+{
+	struct io_uring_sqe *sqe = libtwirc_uring_sqe(p->uring, TWIRC_URING_POLL, 0);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = p->epfd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	p->uring->polling = 1;
+}
+
+/*
+ * Starts receiving on the socket of the state in the given slot.
+ */
+static void
+libtwirc_uring_arm(struct libtwirc_uring *u, size_t slot)
+{
+	struct libtwirc_uring_slot *us = &u->slots[slot];
+	struct io_uring_sqe *sqe = libtwirc_uring_sqe(u, TWIRC_URING_RECV, slot);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = us->state->socket_fd;
+	sqe->ioprio = u->multishot ? IORING_RECV_MULTISHOT : 0;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = TWIRC_URING_BGID;
+	us->armed = 1;
+	us->inflight += 1;
+}
+
+/*
+ * Sends what's in the outbound queue of the state in the given slot. As the
+ * queue might move while the kernel is at it, the data is copied first.
+ */
+static void
+libtwirc_uring_send(struct libtwirc_uring *u, size_t slot)
+{
+	struct libtwirc_uring_slot *us = &u->slots[slot];
+	twirc_state_t *s = us->state;
+	size_t len = s->out_len - s->out_head;
+	if (len > us->send_size)
+	{
+		char *sending = realloc(us->sending, len);
+		if (sending == NULL)
+		{
+			// We'll try again with the next tick
+			libtwirc_oom(s);
+			return;
+		}
+		us->sending   = sending;
+		us->send_size = len;
+	}
+	memcpy(us->sending, s->out + s->out_head, len);
+
+	struct io_uring_sqe *sqe = libtwirc_uring_sqe(u, TWIRC_URING_SEND, slot);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = s->socket_fd;
+	sqe->addr = (uint64_t) (uintptr_t) us->sending;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	us->dirty = 0;
+	us->inflight += 1;
+	us->send_len = len;
+}
+
+/*
+ * Has the outbound queue of the state in the given slot sent with the next
+ * tick, in one batch with all other states, instead of sending it right away.
+ * Returns 0 on success, -1 if we ran out of memory.
+ */
+static int
+libtwirc_uring_mark(struct libtwirc_uring *u, size_t slot)
+{
+	struct libtwirc_uring_slot *us = &u->slots[slot];
+	twirc_state_t *s = us->state;
+	if (us->dirty || s->out_head == s->out_len)
+	{
+		return 0;
+	}
+	if (u->num_dirty == u->size_dirty)
+	{
+		size_t size = u->size_dirty ? 2 * u->size_dirty : TWIRC_NUM_CHANS;
+		size_t *dirty = realloc(u->dirty, size * sizeof(size_t));
+		if (dirty == NULL)
+		{
+			return libtwirc_oom(s);
+		}
+		u->dirty      = dirty;
+		u->size_dirty = size;
+	}
+	u->dirty[u->num_dirty++] = slot;
+	us->dirty = 1;
+	return 0;
+}
+
+/*
+ * libtwirc_flush() for states in a pool that uses io_uring.
+ */
+static int
+libtwirc_uring_flush(twirc_state_t *s)
+{
+	return libtwirc_uring_mark(s->pool->uring, s->uring_slot);
+}
+
+/*
+ * Gets the next completion, from the backlog (see libtwirc_uring_cancel())
+ * or the ring, and copies it to cqe. Returns 1 if there was one, 0 if not.
+ */
+static int
+libtwirc_uring_next(struct libtwirc_uring *u, struct io_uring_cqe *cqe)
+{
+	if (u->backlog_head < u->backlog_len)
+	{
+		*cqe = u->backlog[u->backlog_head++];
+		if (u->backlog_head == u->backlog_len)
+		{
+			u->backlog_head = 0;
+			u->backlog_len  = 0;
+		}
+		return 1;
+	}
+
+	unsigned head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		return 0;
+	}
+	*cqe = u->cqes[head & u->cq_mask];
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Handles the completion of a recv of the state in the given slot. If keep is
+ * not set, the connection is going away and any data is dropped. If process
+ * is not set, requests are being cancelled; data is only added to the state's
+ * buffer and errors are ignored.
+ */
+static void
+libtwirc_uring_recv(struct libtwirc_uring *u, size_t slot, struct io_uring_cqe *cqe, int keep, int process)
+{
+	struct libtwirc_uring_slot *us = &u->slots[slot];
+	twirc_state_t *s = us->state;
+
+	// The recv is done, one way or another, unless the kernel says so
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+	{
+		us->armed = 0;
+		us->inflight -= 1;
+	}
+
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+	{
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (keep && cqe->res > 0)
+		{
+			libtwirc_stats_recv(s, cqe->res);
+			s->recv_ns = libtwirc_now_ns();
+			const char *data = u->bufs + (size_t) bid * TWIRC_BUFFER_SIZE;
+			if (libtwirc_reserve(s, cqe->res) == 0)
+			{
+				memcpy(s->buffer + s->buf_len, data, cqe->res);
+				s->buf_len += cqe->res;
+				s->buffer[s->buf_len] = '\0';
+			}
+			else
+			{
+				libtwirc_oom(s);
+			}
+		}
+		libtwirc_uring_recycle(u, bid);
+	}
+	if (!keep || !process)
+	{
+		return;
+	}
+
+	if (cqe->res > 0)
+	{
+		if (libtwirc_process_buffer(s) == -1)
+		{
+			libtwirc_oom(s);
+		}
+	}
+	// Kernel can't do multishot recv, fall back to one recv at a time
+	else if (cqe->res == -EINVAL && u->multishot)
+	{
+		u->multishot = 0;
+	}
+	// Ran out of buffers, we'll just try again (they'll come back), but
+	// everything else means the connection is gone
+	else if (cqe->res != -ENOBUFS && twirc_is_connected(s))
+	{
+		s->error = cqe->res == 0 ? TWIRC_ERR_CONN_CLOSED : TWIRC_ERR_SOCKET_RECV;
+		libtwirc_on_disconnect(s);
+		libtwirc_callback(s, s->cbs.disconnect, NULL);
+		return;
+	}
+
+	// Callbacks might have removed the state from the pool
+	if (!us->armed && us->state && twirc_is_connected(s))
+	{
+		libtwirc_uring_arm(u, slot);
+	}
+}
+
+/*
+ * Handles the completion of a send of the state in the given slot.
+ */
+static void
+libtwirc_uring_sent(struct libtwirc_uring *u, size_t slot, struct io_uring_cqe *cqe)
+{
+	struct libtwirc_uring_slot *us = &u->slots[slot];
+	twirc_state_t *s = us->state;
+	us->inflight -= 1;
+	us->send_len  = 0;
+	if (s == NULL)
+	{
+		return;
+	}
+
+	libtwirc_stats_send(s, cqe->res);
+	if (cqe->res < 0)
+	{
+		// The socket will let us know if the connection is gone
+		s->error = TWIRC_ERR_SOCKET_SEND;
+		return;
+	}
+	s->out_head += cqe->res;
+	if (s->out_head == s->out_len)
+	{
+		s->out_head = 0;
+		s->out_len  = 0;
+	}
+	else
+	{
+		// More has been queued in the meantime, or only part of it
+		// has been sent; either way, there is more to send
+		libtwirc_uring_mark(u, slot);
+	}
+}
+
+/*
+ * Handles the completion cqe (not one of a state that is being cancelled).
+ */
+static void
+libtwirc_uring_handle(twirc_pool_t *p, struct io_uring_cqe *cqe)
+{
+	struct libtwirc_uring *u = p->uring;
+	int kind = cqe->user_data & ((1 << TWIRC_URING_BITS) - 1);
+	size_t slot = cqe->user_data >> TWIRC_URING_BITS;
+
+	if (kind == TWIRC_URING_POLL)
+	{
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+		{
+			u->polling = 0;
+		}
+
+		// Same as twirc_pool_tick() does with epoll, except that we
+		// start receiving on sockets that are connected now
+		int num_events = epoll_wait(p->epfd, p->events, TWIRC_POOL_EVENTS, 0);
+		p->num_events = num_events > 0 ? num_events : 0;
+		for (p->cur_event = 0; p->cur_event < p->num_events; ++p->cur_event)
+		{
+			struct libtwirc_watch *w = p->events[p->cur_event].data.ptr;
+			libtwirc_handle_watch(&p->events[p->cur_event]);
+			if (w && w->kind == TWIRC_WATCH_SOCKET && w->state->pool == p)
+			{
+				twirc_state_t *s = w->state;
+				if (s->uring_slot != -1 && !u->slots[s->uring_slot].armed &&
+				    twirc_is_connected(s))
+				{
+					libtwirc_uring_arm(u, s->uring_slot);
+				}
+			}
+		}
+		p->num_events = 0;
+		p->cur_event  = 0;
+		return;
+	}
+
+	if (kind == TWIRC_URING_CANCEL)
+	{
+		return;
+	}
+
+	// The state has been removed and this is all that was left
+	twirc_state_t *s = u->slots[slot].state;
+	if (s == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	if (kind == TWIRC_URING_RECV)
+	{
+		libtwirc_uring_recv(u, slot, cqe, 1, 1);
+	}
+	else
+	{
+		libtwirc_uring_sent(u, slot, cqe);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Makes the pool p use io_uring instead of epoll for the sockets of its
+ * states (see above). This has to be done while the pool is still empty.
+ * Returns 0 on success, -1 if the pool isn't empty or if io_uring can't be
+ * used (not supported by the kernel, or not allowed), in which case the pool
+ * simply keeps using epoll.
+ */
+int
+twirc_pool_use_uring(twirc_pool_t *p)
+{
+	if (p->uring)
+	{
+		return 0;
+	}
+	if (p->num > 0)
+	{
+		return -1;
+	}
+	p->uring = libtwirc_uring_init();
+	return p->uring ? 0 : -1;
+}
+
+/*
+ * Gives the state s, which is being added to the pool p, a slot in the ring.
+ * If it's connected already, it'll start receiving with the next tick.
+ * Returns 0 on success, -1 if we ran out of memory.
+ */
+static int
+libtwirc_uring_attach(twirc_pool_t *p, twirc_state_t *s)
+{
+	struct libtwirc_uring *u = p->uring;
+
+	// Find a slot that isn't used anymore, or add one
+	size_t slot = 0;
+	while (slot < u->num_slots &&
+	       (u->slots[slot].state != NULL || u->slots[slot].inflight > 0))
+	{
+		++slot;
+	}
+	if (slot == u->num_slots)
+	{
+		struct libtwirc_uring_slot *slots = realloc(u->slots,
+				(u->num_slots + 1) * sizeof(struct libtwirc_uring_slot));
+		if (slots == NULL)
+		{
+			return libtwirc_oom(s);
+		}
+		u->slots = slots;
+		memset(&u->slots[u->num_slots++], 0, sizeof(struct libtwirc_uring_slot));
+	}
+
+	struct libtwirc_uring_slot *us = &u->slots[slot];
+	free(us->sending);
+	memset(us, 0, sizeof(struct libtwirc_uring_slot));
+	us->state = s;
+	s->uring_slot = slot;
+
+	if (twirc_is_connected(s))
+	{
+		libtwirc_uring_arm(u, slot);
+		libtwirc_uring_mark(u, slot);
+	}
+	return 0;
+}
+
+/*
+ * Cancels all requests of the state s (which must have a slot in the io_uring
+ * of the pool p) and waits for them to be done, so that the socket can be
+ * closed, or the state can be moved elsewhere. Completions of other states
+ * that come in while we wait are put aside for the next tick. If keep is set,
+ * data that has been received in the meantime is added to the state's 
+ * buffer; if not, it's dropped, as the connection is going away.
+ */
+static void
+libtwirc_uring_cancel(twirc_pool_t *p, twirc_state_t *s, int keep)
+{
+	struct libtwirc_uring *u = p->uring;
+	size_t slot = s->uring_slot;
+	struct libtwirc_uring_slot *us = &u->slots[slot];
+
+	// Send what we can right away, there won't be another tick for it;
+	// this is how a QUIT still gets out before the socket is closed
+	if (us->dirty && us->send_len == 0)
+	{
+		ssize_t ret = tcpsock_send(s->socket_fd, s->out + s->out_head, s->out_len - s->out_head);
+		if (ret > 0)
+		{
+			s->out_head += ret;
+		}
+	}
+	us->dirty = 0;
+
+	if (us->inflight > 0)
+	{
+		struct io_uring_sqe *sqe = libtwirc_uring_sqe(u, TWIRC_URING_CANCEL, slot);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = s->socket_fd;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+		libtwirc_uring_submit(u);
+	}
+
+	// Completions of this state that have been put aside before
+	size_t kept = u->backlog_head;
+	for (size_t i = u->backlog_head; i < u->backlog_len; ++i)
+	{
+		struct io_uring_cqe *cqe = &u->backlog[i];
+		if ((cqe->user_data >> TWIRC_URING_BITS) != slot ||
+		    (cqe->user_data & ((1 << TWIRC_URING_BITS) - 1)) == TWIRC_URING_POLL ||
+		    (cqe->user_data & ((1 << TWIRC_URING_BITS) - 1)) == TWIRC_URING_CANCEL)
+		{
+			u->backlog[kept++] = *cqe;
+			continue;
+		}
+		if ((cqe->user_data & ((1 << TWIRC_URING_BITS) - 1)) == TWIRC_URING_RECV)
+		{
+			libtwirc_uring_recv(u, slot, cqe, keep, 0);
+		}
+		else
+		{
+			libtwirc_uring_sent(u, slot, cqe);
+		}
+	}
+	u->backlog_len = kept;
+
+	// Wait for the rest, putting aside the completions of other states
+	while (us->inflight > 0)
+	{
+		unsigned head = *u->cq_head;
+		if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			if (libtwirc_uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)
+			{
+				break;
+			}
+			continue;
+		}
+		struct io_uring_cqe cqe = u->cqes[head & u->cq_mask];
+		__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		int kind = cqe.user_data & ((1 << TWIRC_URING_BITS) - 1);
+		if ((cqe.user_data >> TWIRC_URING_BITS) == slot && kind == TWIRC_URING_RECV)
+		{
+			libtwirc_uring_recv(u, slot, &cqe, keep, 0);
+			continue;
+		}
+		if ((cqe.user_data >> TWIRC_URING_BITS) == slot && kind == TWIRC_URING_SEND)
+		{
+			libtwirc_uring_sent(u, slot, &cqe);
+			continue;
+		}
+		if (u->backlog_len == u->backlog_size)
+		{
+			size_t size = u->backlog_size ? 2 * u->backlog_size : TWIRC_POOL_EVENTS;
+			struct io_uring_cqe *backlog = realloc(u->backlog, size * sizeof(struct io_uring_cqe));
+			if (backlog == NULL)
+			{
+				// Not much we can do, the completion is lost
+				continue;
+			}
+			u->backlog      = backlog;
+			u->backlog_size = size;
+		}
+		u->backlog[u->backlog_len++] = cqe;
+	}
+}
+
+/*
+ * Takes the state s out of the ring of the pool p: cancels its requests,
+ * keeping what it had received, and frees its slot.
+ */
+static void
+libtwirc_uring_detach(twirc_pool_t *p, twirc_state_t *s)
+{
+	libtwirc_uring_cancel(p, s, 1);
+	p->uring->slots[s->uring_slot].state = NULL;
+	s->uring_slot = -1;
+}
+
+/*
+ * twirc_pool_tick() for pools using io_uring: submits all prepared sends and
+ * recvs, waits up to timeout milliseconds for completions (-1 meaning no
+ * timeout), and handles all of them. Returns 0 on success, -1 on error (see
+ * errno; for example, EINTR if a signal has been caught).
+ */
+static int
+libtwirc_uring_tick(twirc_pool_t *p, int timeout)
+{
+	struct libtwirc_uring *u = p->uring;
+
+	if (!u->polling)
+	{
+		libtwirc_uring_poll(p);
+	}
+
+	// Batch up the sends of all states that have something to send;
+	// those still waiting for their last send will be back afterwards
+	size_t num_dirty = u->num_dirty;
+	u->num_dirty = 0;
+	for (size_t i = 0; i < num_dirty; ++i)
+	{
+		struct libtwirc_uring_slot *us = &u->slots[u->dirty[i]];
+		if (us->state == NULL || !us->dirty)
+		{
+			continue;
+		}
+		if (us->send_len > 0)
+		{
+			u->dirty[u->num_dirty++] = u->dirty[i];
+			continue;
+		}
+		pthread_mutex_lock(&us->state->lock);
+		libtwirc_uring_send(u, u->dirty[i]);
+		pthread_mutex_unlock(&us->state->lock);
+	}
+
+	// Submit and wait in one go, unless there are completions already
+	unsigned wait = u->backlog_len == 0 &&
+		*u->cq_head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) && timeout != 0;
+	if (u->to_submit > 0 || wait)
+	{
+		sigset_t sigset;
+		libtwirc_sigset(&sigset);
+
+		struct __kernel_timespec ts = { 0 };
+		ts.tv_sec  = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+
+		struct io_uring_getevents_arg arg = { 0 };
+		arg.sigmask    = (uint64_t) (uintptr_t) &sigset;
+		arg.sigmask_sz = _NSIG / 8;
+		arg.ts         = timeout > 0 ? (uint64_t) (uintptr_t) &ts : 0;
+
+		int ret = libtwirc_uring_enter(u->fd, u->to_submit, wait,
+				IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		if (ret == -1 && errno != ETIME)
+		{
+			return -1;
+		}
+		u->to_submit -= ret > 0 ? (unsigned) ret : 0;
+	}
+
+	struct io_uring_cqe cqe;
+	while (libtwirc_uring_next(u, &cqe))
+	{
+		libtwirc_uring_handle(p, &cqe);
+	}
+	return 0;
+}
+
+#else
+
+/*
+ * Built without io_uring, the pool always uses epoll.
+ */
+int
+twirc_pool_use_uring(twirc_pool_t *p)
+{
+	return -1;
+}
+
+static int
+libtwirc_uring_flush(twirc_state_t *s)
+{
+	return 0;
+}
+
+static int
+libtwirc_uring_attach(twirc_pool_t *p, twirc_state_t *s)
+{
+	return 0;
+}
+
+static void
+libtwirc_uring_cancel(twirc_pool_t *p, twirc_state_t *s, int keep)
+{
+}
+
+static void
+libtwirc_uring_detach(twirc_pool_t *p, twirc_state_t *s)
+{
+}
+
+static int
+libtwirc_uring_tick(twirc_pool_t *p, int timeout)
+{
+	return -1;
+}
+
+static void
+libtwirc_uring_free(struct libtwirc_uring *u)
+{
+}
+
+#endif
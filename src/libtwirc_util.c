@@ -54,6 +54,10 @@ twirc_get_login(twirc_state_t *state)
 twirc_tag_t*
 twirc_get_tag(twirc_tag_t **tags, const char *key)
 {
+	if (tags == NULL)
+	{
+		return NULL;
+	}
 	for (int i = 0; tags[i] != NULL; ++i)
 	{
 		if (strcmp(tags[i]->key, key) == 0)
@@ -81,6 +85,10 @@ twirc_get_tag_by_key(twirc_tag_t **tags, const char *key)
 char const*
 twirc_get_tag_value(twirc_tag_t **tags, const char *key)
 {
+	if (tags == NULL)
+	{
+		return NULL;
+	}
 	for (int i = 0; tags[i] != NULL; ++i)
 	{
 		if (strcmp(tags[i]->key, key) == 0)
@@ -91,6 +99,83 @@ twirc_get_tag_value(twirc_tag_t **tags, const char *key)
 	return NULL;
 }
 
+/*
+ * Returns a pointer to the NULL terminated array of tags of the given event,
+ * which will be NULL if the event has no tags. If lazy tag parsing has been
+ * enabled, this will split the tags and unescape all of their values first, 
+ * unless that has been done already. With lazy tag parsing, the tags member
+ * of the event will be NULL until this function has been called.
+ */
+twirc_tag_t**
+twirc_get_tags(twirc_event_t *evt)
+{
+	if (evt->tag_block && libtwirc_split_tags(&evt->state->arena, evt, 1) == -1)
+	{
+		evt->state->error = TWIRC_ERR_OUT_OF_MEMORY;
+		return NULL;
+	}
+	for (size_t i = 0; evt->tag_escaped && i < evt->num_tags; ++i)
+	{
+		libtwirc_unescape_tag(evt, i);
+	}
+	evt->tag_escaped = NULL;
+	evt->tags = evt->tag_list;
+	return evt->tags;
+}
+
+/*
+ * Returns a pointer to the tag of the given event that has the given ID (one
+ * of the TWIRC_TAG_* constants), or NULL if the event has no such tag. This
+ * is a lot faster than looking up the tag by its key with twirc_get_tag().
+ * If lazy tag parsing has been enabled, this will split the tags, unless that
+ * has been done already, and unescape the value of the requested tag only;
+ * the tags member of the event stays NULL until twirc_get_tags() is called,
+ * as the values of the other tags might still be escaped.
+ */
+twirc_tag_t*
+twirc_get_tag_id(twirc_event_t *evt, int id)
+{
+	if (id < 0 || id >= TWIRC_TAG_COUNT)
+	{
+		return NULL;
+	}
+	if (evt->tag_block && libtwirc_split_tags(&evt->state->arena, evt, 1) == -1)
+	{
+		evt->state->error = TWIRC_ERR_OUT_OF_MEMORY;
+		return NULL;
+	}
+
+	twirc_tag_t *tag = NULL;
+	if (evt->tag_index[id])
+	{
+		tag = evt->tag_list[evt->tag_index[id] - 1];
+	}
+	// Only the first so-many tags are indexed, find the others by key
+	else if (evt->num_tags >= UCHAR_MAX)
+	{
+		tag = twirc_get_tag(evt->tag_list, libtwirc_tag_keys[id]);
+	}
+
+	// All tags live in one array, so we can figure out the tag's index
+	if (tag)
+	{
+		libtwirc_unescape_tag(evt, tag - evt->tag_list[0]);
+	}
+	return tag;
+}
+
+/*
+ * Returns a pointer to the value of the tag of the given event that has the
+ * given ID (one of the TWIRC_TAG_* constants), or NULL if there is no such
+ * tag. See twirc_get_tag_id().
+ */
+char const*
+twirc_get_tag_id_value(twirc_event_t *evt, int id)
+{
+	twirc_tag_t *tag = twirc_get_tag_id(evt, id);
+	return tag ? tag->value : NULL;
+}
+
 /*
  * Return the error code of the last error or -1 if non occurred so far.
  */
@@ -100,6 +185,92 @@ twirc_get_last_error(const twirc_state_t *state)
 	return state->error;
 }
 
+/*
+ * Enables (lazy = 1) or disables (lazy = 0) lazy tag parsing. If enabled, the
+ * tags of an event will only be split into keys and values once they are 
+ * requested via twirc_get_tags() or twirc_get_tag_id(), and values will only
+ * be unescaped when requested. Until twirc_get_tags() has been called, the
+ * tags member of the event will be NULL. This saves quite some work if you
+ * only look at the tags of some events, or only at some of the tags.
+ * Disabled by default.
+ */
+void
+twirc_set_lazy_tags(twirc_state_t *s, int lazy)
+{
+	s->lazy_tags = lazy;
+}
+
+/*
+ * Enables (zero_copy = 1) or disables (zero_copy = 0) zero-copy parsing. If
+ * enabled, received messages will not be copied before they are parsed; the
+ * delimiters are replaced with null terminators right in the receive buffer
+ * and the members of the event point into it. As this leaves nothing of the
+ * message as received, the raw member of inbound events will be NULL.
+ * Disabled by default.
+ */
+void
+twirc_set_zero_copy(twirc_state_t *s, int zero_copy)
+{
+	s->zero_copy = zero_copy;
+}
+
+/*
+ * Sets the high-water mark of the outbound queue, in bytes. Messages that 
+ * can't be sent right away are queued until the socket is writable again.
+ * Once there are max bytes (or more) in the queue, sending further messages 
+ * will fail with TWIRC_ERR_QUEUE_FULL until the queue has drained. A max of 
+ * 0 means no limit at all. Defaults to TWIRC_QUEUE_MAX.
+ */
+void
+twirc_set_queue_max(twirc_state_t *s, size_t max)
+{
+	s->out_max = max;
+}
+
+/*
+ * Sets the IP version to connect with: TWIRC_IPV4, TWIRC_IPV6 or TWIRC_IPANY
+ * (the default), which races the IPv6 and IPv4 addresses of the host against
+ * each other and uses whichever connects first. Takes effect on connecting.
+ */
+void
+twirc_set_ip_type(twirc_state_t *s, int ip_type)
+{
+	s->ip_type = ip_type;
+}
+
+/*
+ * Returns the number of bytes in the outbound queue that are still waiting 
+ * to be sent to the server, including messages held back by rate limits.
+ */
+size_t
+twirc_get_queue_len(const twirc_state_t *s)
+{
+	return s->out_len - s->out_head + s->pend_len;
+}
+
+/*
+ * Sets the rate limit of the given bucket (one of the TWIRC_RATE_* constants)
+ * to limit messages per period milliseconds. Outgoing messages that count 
+ * against this limit will be held back until they can be sent without going 
+ * over it. A limit of 0 disables the bucket. Use this if your account has 
+ * been granted higher limits (e.g. as a verified bot). Best done before 
+ * connecting, as this forgets about the messages that have been sent before.
+ * Returns 0 on success, -1 on error (invalid bucket or out of memory).
+ */
+int
+twirc_set_rate_limit(twirc_state_t *s, int bucket, unsigned limit, unsigned period)
+{
+	if (bucket < 0 || bucket >= TWIRC_RATE_COUNT)
+	{
+		return -1;
+	}
+	if (libtwirc_bucket_set(&s->rate[bucket], limit, period) == -1)
+	{
+		return libtwirc_oom(s);
+	}
+	return 0;
+}
+
 void
 twirc_set_context(twirc_state_t *s, void *ctx)
 {
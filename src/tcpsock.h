@@ -2,11 +2,14 @@
 #define TCPSOCK_H
 
 #include <stdlib.h>     // NULL, EXIT_FAILURE, EXIT_SUCCESS
+#include <string.h>     // memcpy()
 #include <unistd.h>     // close(), fcntl()
 #include <errno.h>      // errno
 #include <fcntl.h>      // fcntl()
 #include <sys/types.h>  // ssize_t
-#include <sys/socket.h> // socket(), connect(), send(), recv()
+#include <sys/uio.h>    // struct iovec
+#include <sys/socket.h> // socket(), connect(), send(), recv(), recvmsg()
+#include <time.h>       // struct timespec
 #include <netdb.h>      // getaddrinfo()
 
 //
@@ -15,6 +18,7 @@
 
 #define TCPSOCK_IPV4 AF_INET
 #define TCPSOCK_IPV6 AF_INET6
+#define TCPSOCK_IPANY AF_UNSPEC
 
 #define TCPSOCK_NONBLOCK 0
 #define TCPSOCK_BLOCK    1
@@ -45,6 +49,14 @@ int tcpsock_blocking(int sockfd);
  */
 int tcpsock_connect(int sockfd, int ip_type, const char *host, const char *port);
 
+/*
+ * Initiates a connection for the TCP socket described by sockfd to the given
+ * address, which has been resolved already (and matches the socket's type).
+ * Returns 0 if the connection was successfully initiated (is now in progress).
+ * Returns -1 if the connection could not be established. Check errno.
+ */
+int tcpsock_connect_addr(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+
 /*
  * Queries getsockopt() for the socket status in an attempt to figure out
  * whether the socket is connected. Note that this should not be used unless
@@ -77,6 +89,14 @@ int tcpsock_send(int sockfd, const char *msg, size_t len);
  */
 int tcpsock_receive(int sockfd, char *buf, size_t len);
 
+/*
+ * Like tcpsock_receive(), but uses recvmsg() to also fetch the time at which
+ * the kernel received the (last) data read, if SO_TIMESTAMPNS has been set
+ * on the socket. That time (CLOCK_REALTIME) is stored in ts; if there is
+ * none, ts will be zero.
+ */
+int tcpsock_receive_ts(int sockfd, char *buf, size_t len, struct timespec *ts);
+
 /*
  * Closes the given socket.
  * Returns 0 on success, -1 on error (see errno).
@@ -108,8 +128,8 @@ int tcpsock_create(int ip_type, int block)
 		return -1;
 	}
 
-	// Nonblocking, we're done
-	if (block == 0)
+	// Blocking, we're done
+	if (block == TCPSOCK_BLOCK)
 	{
 		// All done, return socket file descriptor
 		return sfd;
@@ -146,14 +166,6 @@ int tcpsock_blocking(int sockfd)
 
 int tcpsock_connect(int sockfd, int ip_type, const char *host, const char *port)
 {
-	// Figure out if the socket is blocking
-	int block = tcpsock_blocking(sockfd);
-	if (block == -1)
-	{
-		// Couldn't figure out if socket is blocking or non-blocking
-		return -1;
-	}
-
 	// If ip_type was neither IPv4 nor IPv6, we fall back to IPv4
 	if ((ip_type != AF_INET) && (ip_type != AF_INET6))
 	{
@@ -180,8 +192,23 @@ int tcpsock_connect(int sockfd, int ip_type, const char *host, const char *port)
 	}
 
 	// Attempt to initiate a connection
-	int con = connect(sockfd, info->ai_addr, info->ai_addrlen);
+	int con = tcpsock_connect_addr(sockfd, info->ai_addr, info->ai_addrlen);
 	freeaddrinfo(info);
+	return con;
+}
+
+int tcpsock_connect_addr(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	// Figure out if the socket is blocking
+	int block = tcpsock_blocking(sockfd);
+	if (block == -1)
+	{
+		// Couldn't figure out if socket is blocking or non-blocking
+		return -1;
+	}
+
+	// Attempt to initiate a connection
+	int con = connect(sockfd, addr, addrlen);
 
 	// connect() should return 0 for success on blocking sockets, -1 for non-blocking sockets
 	if (con == -1)
@@ -236,6 +263,40 @@ int tcpsock_receive(int sockfd, char *buf, size_t len)
 	return recv(sockfd, buf, len, 0);
 }
 
+int tcpsock_receive_ts(int sockfd, char *buf, size_t len, struct timespec *ts)
+{
+	struct iovec iov = { buf, len };
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(struct timespec))];
+		struct cmsghdr align;
+	} control;
+
+	struct msghdr msg = { 0 };
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	ts->tv_sec  = 0;
+	ts->tv_nsec = 0;
+
+	ssize_t res = recvmsg(sockfd, &msg, 0);
+	if (res <= 0)
+	{
+		return res;
+	}
+
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c))
+	{
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			memcpy(ts, CMSG_DATA(c), sizeof(struct timespec));
+		}
+	}
+	return res;
+}
+
 int tcpsock_close(int sockfd)
 {
 	return close(sockfd);